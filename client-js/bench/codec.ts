@@ -0,0 +1,149 @@
+// Measures how many messages per second the protocol codec decodes, as the
+// client receives them, and encodes, as it sends them.
+//
+// Usage: yarn bench:codec [message count]
+
+import {
+  deserialiseMqttMessage,
+  serialiseMqttMessage,
+  SlingMessage,
+  SlingMessageType,
+  SlingOptionalIdMessage
+} from '../src/slingProtocol';
+
+const messageCount = Number(process.argv[2] ?? 1_000_000);
+
+function serialiseOrThrow(message: SlingOptionalIdMessage): Buffer {
+  const payload = serialiseMqttMessage(message);
+  if (!payload) {
+    throw new Error(`cannot serialise ${message.type}`);
+  }
+  return payload;
+}
+
+function report(name: string, count: number, bytes: number, elapsedNs: bigint): void {
+  const seconds = Number(elapsedNs) / 1e9;
+  console.log(
+    `${name.padEnd(16)} ${(count / seconds).toFixed(0).padStart(10)} messages/s ` +
+      `${(bytes / seconds / 1e6).toFixed(1).padStart(8)} MB/s`
+  );
+}
+
+const displayTopic = 'bench-device/display';
+
+const lines = [
+  'Hello, world!',
+  'list(1, 2, 3) has length 3',
+  'a somewhat longer line of output, as a program printing a table might produce'
+];
+const stringPayloads = lines.map((value, i) =>
+  serialiseOrThrow({
+    id: i + 1,
+    type: SlingMessageType.DISPLAY,
+    displayType: 'output',
+    selfFlushing: false,
+    payloadType: 'str',
+    value,
+    runId: 7
+  })
+);
+const numberPayload = serialiseOrThrow({
+  id: 10,
+  type: SlingMessageType.DISPLAY,
+  displayType: 'output',
+  selfFlushing: false,
+  payloadType: 'f32',
+  value: 1.5,
+  runId: 7
+});
+const flushPayload = serialiseOrThrow({
+  id: 11,
+  type: SlingMessageType.DISPLAY,
+  displayType: 'flush',
+  selfFlushing: false,
+  startingId: 1,
+  endingId: 11,
+  runId: 7
+});
+const batchRecords: SlingMessage[] = [];
+for (let i = 0; i < 32; ++i) {
+  batchRecords.push({
+    id: 100 + i,
+    type: SlingMessageType.DISPLAY,
+    displayType: 'output',
+    selfFlushing: false,
+    payloadType: 'str',
+    value: lines[i % lines.length],
+    runId: 7
+  });
+}
+const batchPayload = serialiseOrThrow({
+  id: 100,
+  type: SlingMessageType.DISPLAY,
+  displayType: 'batch',
+  selfFlushing: false,
+  messages: batchRecords
+});
+
+// reads every value, as the client does when it emits them
+function decode(name: string, payloads: Buffer[], recordsPerPayload: number): void {
+  let bytes = 0;
+  let checksum = 0;
+  const start = process.hrtime.bigint();
+  for (let i = 0; i < messageCount; ++i) {
+    const payload = payloads[i % payloads.length];
+    bytes += payload.length;
+    const message = deserialiseMqttMessage(displayTopic, payload);
+    if (!message || message.type !== SlingMessageType.DISPLAY) {
+      throw new Error('decoding failed');
+    }
+    const records = message.displayType === 'batch' ? message.messages : [message];
+    for (const record of records) {
+      if (
+        record.type === SlingMessageType.DISPLAY &&
+        record.displayType !== 'flush' &&
+        record.displayType !== 'batch'
+      ) {
+        checksum += `${record.value}`.length;
+      }
+    }
+  }
+  report(name, messageCount * recordsPerPayload, bytes, process.hrtime.bigint() - start);
+  if (recordsPerPayload > 1 && checksum === 0) {
+    throw new Error('no values read');
+  }
+}
+
+function encode(name: string, message: SlingOptionalIdMessage): void {
+  let bytes = 0;
+  const start = process.hrtime.bigint();
+  for (let i = 0; i < messageCount; ++i) {
+    const payload = serialiseMqttMessage(message);
+    bytes += payload ? payload.length : 0;
+  }
+  report(name, messageCount, bytes, process.hrtime.bigint() - start);
+}
+
+for (let round = 0; round < 3; ++round) {
+  decode('decode string', stringPayloads, 1);
+  decode('decode number', [numberPayload], 1);
+  decode('decode flush', [flushPayload], 1);
+  decode('decode batch', [batchPayload], 32);
+
+  encode('encode input', {
+    type: SlingMessageType.INPUT,
+    displayType: 'response',
+    selfFlushing: false,
+    payloadType: 'str',
+    value: 'a line typed in response to a prompt',
+    runId: 7
+  });
+  encode('encode stop', { type: SlingMessageType.STOP, runId: 7 });
+  encode('encode run 4 KiB', {
+    type: SlingMessageType.RUN,
+    code: Buffer.alloc(4096, 1),
+    runId: 7,
+    heapSize: 0x10000
+  });
+  console.log();
+}
@@ -0,0 +1,167 @@
+// Replays a shuffled stream of display messages through the client's reorder
+// buffer and display assembler, and through the map-and-range-scan approach
+// they replaced, checking both reassemble every line.
+//
+// Usage: yarn bench [fragment count] [concurrent runs]
+
+import { SlingDisplayAssembler, SlingReorderBuffer } from '../src/reassembly';
+import { SlingMessage, SlingMessageType } from '../src/slingProtocol';
+
+const fragmentCount = Number(process.argv[2] ?? 100_000);
+const runCount = Number(process.argv[3] ?? 4);
+
+interface Stream {
+  firstId: number;
+  messages: SlingMessage[];
+  lines: string[];
+}
+
+// lines of 1 to 8 fragments, from runs taking turns, numbered from firstId
+function makeStream(firstId: number): Stream {
+  const messages: SlingMessage[] = [];
+  const lines: string[] = [];
+  const startingIds = new Map<number, number>();
+  const pending = new Map<number, string>();
+  let id = firstId;
+  let fragment = 0;
+  while (fragment < fragmentCount) {
+    const runId = fragment % runCount;
+    if (!startingIds.has(runId)) {
+      startingIds.set(runId, id);
+      pending.set(runId, '');
+    }
+    const value = `${runId}:${fragment} `;
+    messages.push({
+      id,
+      type: SlingMessageType.DISPLAY,
+      displayType: 'output',
+      selfFlushing: false,
+      payloadType: 'str',
+      value,
+      runId
+    });
+    pending.set(runId, pending.get(runId) + value);
+    id = (id + 1) >>> 0;
+    ++fragment;
+
+    // flush after about 1 in 8 fragments
+    if (Math.imul(fragment, 2654435761) >>> 29 === 0 || fragment === fragmentCount) {
+      for (const [flushRunId, startingId] of startingIds) {
+        messages.push({
+          id,
+          type: SlingMessageType.DISPLAY,
+          displayType: 'flush',
+          selfFlushing: false,
+          startingId,
+          endingId: id,
+          runId: flushRunId
+        });
+        lines.push(`${flushRunId}/${pending.get(flushRunId)}`);
+        id = (id + 1) >>> 0;
+      }
+      startingIds.clear();
+    }
+  }
+  return { firstId, messages, lines };
+}
+
+// deterministic, so runs are comparable
+function shuffle<T>(items: T[]): T[] {
+  let seed = 1;
+  for (let i = items.length - 1; i > 0; --i) {
+    seed = (Math.imul(seed, 1103515245) + 12345) >>> 0;
+    const j = seed % (i + 1);
+    [items[i], items[j]] = [items[j], items[i]];
+  }
+  return items;
+}
+
+function reassemble(stream: SlingMessage[], firstId: number): string[] {
+  const lines: string[] = [];
+  const reorderBuffer = new SlingReorderBuffer<SlingMessage>();
+  const assembler = new SlingDisplayAssembler();
+  reorderBuffer.reset(firstId);
+  for (const message of stream) {
+    reorderBuffer.push(message.id, message);
+    for (let next = reorderBuffer.shift(); next; next = reorderBuffer.shift()) {
+      if (next.type !== SlingMessageType.DISPLAY || next.displayType === 'batch') {
+        continue;
+      }
+      if (next.displayType === 'flush') {
+        const display = assembler.flush(next);
+        if (display) {
+          lines.push(`${next.runId}/${display.value}`);
+        }
+      } else {
+        assembler.add(next);
+      }
+    }
+  }
+  return lines;
+}
+
+// as SlingClient did before, which cannot cope with message numbers wrapping around
+function reassembleByScanning(stream: SlingMessage[], firstId: number): string[] {
+  const lines: string[] = [];
+  const queuedMessages = new Map<number, SlingMessage>();
+  const displayBuffer = new Map<number, SlingMessage>();
+  let lastProcessedId = firstId - 1;
+  for (const message of stream) {
+    queuedMessages.set(message.id, message);
+    let next = queuedMessages.get(lastProcessedId + 1);
+    while (next) {
+      queuedMessages.delete(lastProcessedId + 1);
+      lastProcessedId = next.id;
+      if (next.type === SlingMessageType.DISPLAY && next.displayType === 'flush') {
+        const parts = [];
+        for (let i = next.startingId; i < next.endingId; ++i) {
+          const part = displayBuffer.get(i);
+          if (!part || part.type !== SlingMessageType.DISPLAY || part.runId !== next.runId) {
+            continue;
+          }
+          displayBuffer.delete(i);
+          if (part.displayType !== 'flush' && part.displayType !== 'batch') {
+            parts.push(`${part.value}`);
+          }
+        }
+        lines.push(`${next.runId}/${parts.join('')}`);
+      } else {
+        displayBuffer.set(next.id, next);
+      }
+      next = queuedMessages.get(lastProcessedId + 1);
+    }
+  }
+  return lines;
+}
+
+function measure(
+  name: string,
+  stream: Stream,
+  run: (messages: SlingMessage[], firstId: number) => string[]
+): void {
+  const shuffled = shuffle(stream.messages.slice());
+  const start = process.hrtime.bigint();
+  const lines = run(shuffled, stream.firstId);
+  const elapsedMs = Number(process.hrtime.bigint() - start) / 1e6;
+
+  // lines of different runs may finish in either order, so compare them sorted
+  const expected = stream.lines.slice().sort();
+  const actual = lines.sort();
+  const ok = actual.length === expected.length && actual.every((line, i) => line === expected[i]);
+  console.log(
+    `${name.padEnd(10)} ${stream.messages.length} messages in ${elapsedMs.toFixed(1)} ms: ` +
+      `${((stream.messages.length / elapsedMs) * 1000).toFixed(0)} messages/s, ` +
+      `${lines.length} lines${ok ? '' : ' (MISMATCH)'}`
+  );
+  if (!ok) {
+    process.exitCode = 1;
+  }
+}
+
+// the new path also has to handle the message numbers wrapping around midway
+const wrapping = makeStream((0x100000000 - Math.floor(fragmentCount / 2)) >>> 0);
+const plain = makeStream(1);
+for (let i = 0; i < 3; ++i) {
+  measure('ring', wrapping, reassemble);
+  measure('scan', plain, reassembleByScanning);
+}
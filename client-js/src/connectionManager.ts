@@ -0,0 +1,232 @@
+import { TypedEmitter } from 'tiny-typed-emitter';
+import { MqttClient, connect as mqttConnect } from 'mqtt';
+import { slingDeviceMessageTypes } from './slingProtocol';
+
+export interface SlingConnectionOptions {
+  /**
+   * The WebSocket endpoint URL to connect to.
+   */
+  readonly websocketEndpoint: string;
+  /**
+   * The MQTT client ID for this client to use.
+   */
+  readonly clientId: string;
+  /**
+   * Milliseconds to wait at most before the first attempt to reconnect; this
+   * doubles with each failed attempt, up to reconnectMaxDelay. Defaults to 1000.
+   */
+  readonly reconnectMinDelay?: number;
+  /**
+   * Milliseconds to wait at most between attempts to reconnect. Defaults to 60000.
+   */
+  readonly reconnectMaxDelay?: number;
+}
+
+/**
+ * How a connection hands a device's messages to its client.
+ */
+export interface SlingDeviceHandler {
+  /**
+   * Called once the device's topics are subscribed, and again after every reconnection.
+   */
+  handleConnect(): void;
+  handleMessage(topic: string, payload: Buffer): void;
+}
+
+export interface SlingConnectionEvents {
+  connect: () => void;
+  close: () => void;
+  error: (error: Error) => void;
+}
+
+// AWS IoT takes at most 8 topics in one subscribe or unsubscribe request
+const SUBSCRIBE_BATCH_MAX = 8;
+
+// only what the device publishes; a wildcard would also bring back every run and
+// input sent to it, by this client or any other
+function deviceTopics(deviceId: string): string[] {
+  return slingDeviceMessageTypes.map((type) => `${deviceId}/${type}`);
+}
+
+/**
+ * One MQTT connection shared by the clients of many devices. Clients attach
+ * and detach their devices without reconnecting; subscriptions made in the
+ * same tick go out together, packed into as few requests as the broker allows. Lost connections
+ * are retried with exponential backoff and full jitter, so clients that lost
+ * the broker together do not all return at once.
+ */
+export class SlingConnectionManager extends TypedEmitter<SlingConnectionEvents> {
+  readonly options: SlingConnectionOptions;
+
+  private _mqttClient?: MqttClient;
+  private readonly _devices = new Map<string, SlingDeviceHandler>();
+  // device IDs whose subscriptions have yet to be changed, once connected
+  private readonly _pendingSubscribes = new Set<string>();
+  private readonly _pendingUnsubscribes = new Set<string>();
+  private _flushScheduled = false;
+  private _reconnectAttempts = 0;
+  private _reconnectTimer?: ReturnType<typeof setTimeout>;
+
+  constructor(options: SlingConnectionOptions) {
+    super();
+    this.options = options;
+  }
+
+  connect(): void {
+    if (this._mqttClient) {
+      return;
+    }
+    // reconnection and resubscription are left to us, to pace them
+    this._mqttClient = mqttConnect(this.options.websocketEndpoint, {
+      clientId: this.options.clientId,
+      reconnectPeriod: 0,
+      resubscribe: false
+    });
+    this._mqttClient.on('connect', () => {
+      this._handleConnect();
+    });
+    this._mqttClient.on('close', () => {
+      this._handleClose();
+    });
+    this._mqttClient.on('error', (error) => {
+      this.emit('error', error);
+    });
+    this._mqttClient.on('message', (topic, payload) => {
+      this._routeMessage(topic, payload);
+    });
+  }
+
+  end(): void {
+    if (this._reconnectTimer !== undefined) {
+      clearTimeout(this._reconnectTimer);
+      this._reconnectTimer = undefined;
+    }
+    if (!this._mqttClient) {
+      return;
+    }
+    this._mqttClient.removeAllListeners();
+    this._mqttClient.end();
+    this._mqttClient = undefined;
+    this._pendingSubscribes.clear();
+    this._pendingUnsubscribes.clear();
+  }
+
+  /**
+   * Routes a device's messages to the given handler. Each device may have only
+   * one handler at a time.
+   */
+  attach(deviceId: string, handler: SlingDeviceHandler): void {
+    if (this._devices.has(deviceId)) {
+      throw new Error(`Device ${deviceId} is already attached`);
+    }
+    this._devices.set(deviceId, handler);
+    this._pendingUnsubscribes.delete(deviceId);
+    this._pendingSubscribes.add(deviceId);
+    this._scheduleFlush();
+  }
+
+  detach(deviceId: string, handler: SlingDeviceHandler): void {
+    if (this._devices.get(deviceId) !== handler) {
+      return;
+    }
+    this._devices.delete(deviceId);
+    this._pendingSubscribes.delete(deviceId);
+    this._pendingUnsubscribes.add(deviceId);
+    this._scheduleFlush();
+  }
+
+  publish(topic: string, payload: Buffer): void {
+    this._mqttClient?.publish(topic, payload, { qos: 1 });
+  }
+
+  private _handleConnect(): void {
+    this._reconnectAttempts = 0;
+    // the session is clean, so every device needs subscribing again
+    this._pendingUnsubscribes.clear();
+    for (const deviceId of this._devices.keys()) {
+      this._pendingSubscribes.add(deviceId);
+    }
+    this._flush();
+    this.emit('connect');
+  }
+
+  private _handleClose(): void {
+    this.emit('close');
+    if (!this._mqttClient || this._reconnectTimer !== undefined) {
+      return;
+    }
+    const minDelay = this.options.reconnectMinDelay ?? 1000;
+    const maxDelay = this.options.reconnectMaxDelay ?? 60000;
+    const ceiling = Math.min(maxDelay, minDelay * 2 ** this._reconnectAttempts);
+    if (ceiling < maxDelay) {
+      ++this._reconnectAttempts;
+    }
+    this._reconnectTimer = setTimeout(() => {
+      this._reconnectTimer = undefined;
+      this._mqttClient?.reconnect();
+    }, Math.random() * ceiling);
+  }
+
+  private _scheduleFlush(): void {
+    if (this._flushScheduled) {
+      return;
+    }
+    this._flushScheduled = true;
+    void Promise.resolve().then(() => {
+      this._flushScheduled = false;
+      this._flush();
+    });
+  }
+
+  private _flush(): void {
+    const client = this._mqttClient;
+    if (!client || !client.connected) {
+      // whatever is attached by then is subscribed on connecting
+      this._pendingSubscribes.clear();
+      this._pendingUnsubscribes.clear();
+      return;
+    }
+
+    const unsubscribes = Array.from(this._pendingUnsubscribes).flatMap(deviceTopics);
+    this._pendingUnsubscribes.clear();
+    for (let i = 0; i < unsubscribes.length; i += SUBSCRIBE_BATCH_MAX) {
+      client.unsubscribe(unsubscribes.slice(i, i + SUBSCRIBE_BATCH_MAX));
+    }
+
+    // a device's topics may span requests; it is connected once the last of them is granted
+    const subscribes: Array<[deviceId: string, topic: string]> = [];
+    const remainingTopics = new Map<string, number>();
+    for (const deviceId of this._pendingSubscribes) {
+      const topics = deviceTopics(deviceId);
+      remainingTopics.set(deviceId, topics.length);
+      for (const topic of topics) {
+        subscribes.push([deviceId, topic]);
+      }
+    }
+    this._pendingSubscribes.clear();
+    for (let i = 0; i < subscribes.length; i += SUBSCRIBE_BATCH_MAX) {
+      const batch = subscribes.slice(i, i + SUBSCRIBE_BATCH_MAX);
+      client.subscribe(batch.map(([, topic]) => topic), { qos: 1 }, (error) => {
+        if (error) {
+          this.emit('error', error);
+          return;
+        }
+        for (const [deviceId] of batch) {
+          const remaining = (remainingTopics.get(deviceId) ?? 1) - 1;
+          remainingTopics.set(deviceId, remaining);
+          if (remaining === 0) {
+            this._devices.get(deviceId)?.handleConnect();
+          }
+        }
+      });
+    }
+  }
+
+  private _routeMessage(topic: string, payload: Buffer): void {
+    const separator = topic.lastIndexOf('/');
+    if (separator < 0) {
+      return;
+    }
+    this._devices.get(topic.slice(0, separator))?.handleMessage(topic, payload);
+  }
+}
@@ -1,61 +1,113 @@
 import { TypedEmitter } from 'tiny-typed-emitter';
-import { MqttClient, connect as mqttConnect } from 'mqtt';
 import {
-  slingDeviceMessageTypes,
   deserialiseMqttMessage,
   SlingMessage,
   SlingMessageType,
   serialiseMqttMessage,
   SlingOptionalIdMessage,
+  SlingRunMessage,
   SlingNonFlushDisplayMessage,
-  SlingDisplayFlushMessage,
-  SlingDisplayMessageType
+  SlingDisplayMessageType,
+  SlingCapability,
+  SlingRunUsage,
+  SlingOutputLimits,
+  hashProgram,
+  makeNonce
 } from './slingProtocol';
+import { SlingDisplayAssembler, SlingReorderBuffer } from './reassembly';
+import {
+  SlingConnectionManager,
+  SlingConnectionOptions,
+  SlingDeviceHandler
+} from './connectionManager';
 
-export interface SlingClientOptions {
-  /**
-   * The WebSocket endpoint URL to connect to.
-   */
-  readonly websocketEndpoint: string;
-  /**
-   * The MQTT client ID for this client to use.
-   */
-  readonly clientId: string;
+export { SlingConnectionManager, SlingConnectionOptions } from './connectionManager';
+
+export type SlingClientOptions = {
   /**
    * The MQTT client ID of the device.
    */
   readonly deviceId: string;
-}
+} & (
+  | SlingConnectionOptions
+  | {
+      /**
+       * A connection shared with the clients of other devices, to use instead
+       * of one of this client's own.
+       */
+      readonly connectionManager: SlingConnectionManager;
+    }
+);
 
 export type SlingClientDisplayValue = SlingNonFlushDisplayMessage['value'];
 
 export interface SlingClientEvents {
   connect: () => void;
+  /**
+   * Errors of a shared connection are emitted by its connection manager instead.
+   */
   error: (error: Error) => void;
   message: (message: SlingMessage) => void;
   statusChange: (isRunning: boolean) => void;
-  prompt: (prompt: string) => void;
-  promptDismiss: () => void;
+  /**
+   * Emitted by devices with the concurrent runs capability as each run starts and ends.
+   */
+  runStatusChange: (runId: number, isRunning: boolean) => void;
+  /**
+   * Emitted as a run ends, with what it cost, by devices that report it.
+   */
+  exit: (usage: SlingRunUsage, runId?: number) => void;
+  /**
+   * Emitted when a program asks for input; answer it with sendInput. Devices
+   * with the concurrent runs capability give the run that asked.
+   */
+  prompt: (prompt: string, runId?: number) => void;
+  promptDismiss: (runId?: number) => void;
   display: (
     message: SlingClientDisplayValue,
-    type: Exclude<SlingDisplayMessageType, 'flush' | 'response'>
+    type: Exclude<SlingDisplayMessageType, 'flush' | 'response' | 'batch'>,
+    runId?: number
   ) => void;
 }
 
+// how long a message may be missing, with later ones waiting behind it, before
+// we ask a device with the replay capability to publish it again
+const REPLAY_STALL_MS = 1000;
+
 export class SlingClient extends TypedEmitter<SlingClientEvents> {
   readonly options: SlingClientOptions;
 
-  private _mqttClient?: MqttClient;
+  private _connection?: SlingConnectionManager;
+  private _ownsConnection = false;
+  private readonly _deviceHandler: SlingDeviceHandler = {
+    handleConnect: () => {
+      // fetch whatever we missed while disconnected, then catch up on the status
+      this.requestReplay();
+      this.sendPing();
+    },
+    handleMessage: (topic, payload) => {
+      this._handleMessage(topic, payload);
+    }
+  };
   private _deviceStatus?: {
     running: boolean;
     prompt?: string;
   };
-  private _lastProcessedMessageId?: number;
-  private _queuedMessages = new Map<number, SlingMessage>();
+  private readonly _reorderBuffer = new SlingReorderBuffer<SlingMessage>();
   private _seenHellos = new Set<number>();
+  private _helloNonce?: number;
+  private _deviceCapabilities = 0;
+  private _stallTimer?: ReturnType<typeof setTimeout>;
+  // hashes of programs sent to the device since it last said hello
+  private readonly _uploadedPrograms = new Set<string>();
+  // run_cached messages we may have to follow up with the full program, by run ID
+  private readonly _pendingCachedRuns = new Map<number, { hash: Buffer; code: Buffer }>();
+  // runs in progress, on devices with the concurrent runs capability
+  private readonly _runningRuns = new Set<number>();
+  // runs waiting for input, on devices with the concurrent runs capability
+  private readonly _promptingRuns = new Set<number>();
 
-  private readonly _displayBuffer = new Map<number, SlingNonFlushDisplayMessage>();
-  private readonly _queuedFlushes = new Set<SlingDisplayFlushMessage>();
+  private readonly _displayAssembler = new SlingDisplayAssembler();
 
   constructor(options: SlingClientOptions) {
     super();
@@ -63,43 +115,123 @@ export class SlingClient extends TypedEmitter<SlingClientEvents> {
   }
 
   connect(): void {
-    this._mqttClient = mqttConnect(this.options.websocketEndpoint, {
-      clientId: this.options.clientId
-    });
-    this._mqttClient.on('connect', () => {
-      this._handleConnect();
-    });
-    this._mqttClient.on('error', (error) => {
+    if (this._connection) {
+      return;
+    }
+    if ('connectionManager' in this.options) {
+      this._connection = this.options.connectionManager;
+      this._connection.attach(this.options.deviceId, this._deviceHandler);
+      return;
+    }
+    this._connection = new SlingConnectionManager(this.options);
+    this._ownsConnection = true;
+    this._connection.on('error', (error) => {
       this.emit('error', error);
     });
-    this._mqttClient.on('message', (topic, payload) => {
-      this._handleMessage(topic, payload);
-    });
+    this._connection.attach(this.options.deviceId, this._deviceHandler);
+    this._connection.connect();
   }
 
   disconnect(): void {
-    if (!this._mqttClient) {
+    if (!this._connection) {
       return;
     }
-    this._mqttClient.removeAllListeners();
-    this._mqttClient.end();
+    this._connection.detach(this.options.deviceId, this._deviceHandler);
+    if (this._ownsConnection) {
+      this._connection.removeAllListeners();
+      this._connection.end();
+    }
+    this._connection = undefined;
+    this._ownsConnection = false;
     this._deviceStatus = undefined;
+    this._clearStallTimer();
+  }
+
+  /**
+   * Asks the device to run a program.
+   *
+   * @param heapSize bytes of heap to give the program, instead of the device's
+   * default; devices may cap this
+   * @param outputLimits limits on the program's standard output, stricter than
+   * the device's own
+   * @returns the run ID, which names the run in `runStatusChange` and `display`
+   * events on devices with the concurrent runs capability
+   */
+  sendRun(code: Buffer, heapSize?: number, outputLimits?: SlingOutputLimits): number {
+    const runId = makeNonce();
+    // run_cached cannot carry run options, so such runs always send the program
+    if (
+      this._deviceCapabilities & SlingCapability.PROGRAM_CACHE &&
+      heapSize === undefined &&
+      outputLimits === undefined
+    ) {
+      const hash = hashProgram(code);
+      const hashKey = hash.toString('hex');
+      if (this._uploadedPrograms.has(hashKey)) {
+        // the device probably still has it; if not, we get a cache_miss and upload it then
+        this._pendingCachedRuns.set(runId, { hash, code });
+        this.sendMessage({ type: SlingMessageType.RUN_CACHED, id: runId, hash });
+        return runId;
+      }
+      this._uploadedPrograms.add(hashKey);
+    }
+    this.sendMessage({
+      type: SlingMessageType.RUN,
+      id: runId,
+      code,
+      ...(heapSize === undefined ? {} : { heapSize }),
+      ...(outputLimits === undefined ? {} : { outputLimits }),
+      ...this._compressionFields()
+    });
+    return runId;
   }
 
-  sendRun(code: Buffer): void {
-    this.sendMessage({ type: SlingMessageType.RUN, code });
+  /**
+   * Asks the device to stop a run, or everything it is running if no run ID is given.
+   */
+  sendStop(runId?: number): void {
+    this.sendMessage({ type: SlingMessageType.STOP, ...this._runIdField(runId) });
   }
 
-  sendStop(): void {
-    this.sendMessage({ type: SlingMessageType.STOP });
+  /**
+   * Answers a prompt. The run ID is only needed for devices with the concurrent
+   * runs capability.
+   */
+  sendInput(response: string, runId?: number): void {
+    this.sendMessage({
+      type: SlingMessageType.INPUT,
+      displayType: 'response',
+      selfFlushing: false,
+      payloadType: 'str',
+      value: response,
+      ...this._runIdField(runId)
+    });
   }
 
   sendPing(): void {
     this.sendMessage({ type: SlingMessageType.PING });
   }
 
+  /**
+   * Asks a device with the replay capability to publish again every message
+   * from the next one this client has yet to process, so output missed while
+   * disconnected arrives without running the program again. Done on
+   * reconnecting, and when a message goes missing for a while.
+   */
+  requestReplay(): void {
+    const startingId = this._reorderBuffer.nextId;
+    if (
+      !(this._deviceCapabilities & SlingCapability.REPLAY) ||
+      this._helloNonce === undefined ||
+      startingId === undefined
+    ) {
+      return;
+    }
+    this.sendMessage({ type: SlingMessageType.REPLAY, nonce: this._helloNonce, startingId });
+  }
+
   sendMessage(message: SlingOptionalIdMessage): void {
-    if (!this._mqttClient) {
+    if (!this._connection) {
       return;
     }
 
@@ -108,22 +240,21 @@ export class SlingClient extends TypedEmitter<SlingClientEvents> {
       return;
     }
 
-    this._mqttClient.publish(`${this.options.deviceId}/${message.type}`, mqttPayload, {
-      qos: 1
-    });
+    this._connection.publish(`${this.options.deviceId}/${message.type}`, mqttPayload);
   }
 
-  private _handleConnect(): void {
-    if (!this._mqttClient) {
-      return;
-    }
-    this._mqttClient.subscribe(
-      slingDeviceMessageTypes.map((type) => `${this.options.deviceId}/${type}`),
-      { qos: 1 },
-      () => {
-        this.sendPing();
-      }
-    );
+  // devices with the compression capability get programs compressed, and may compress output
+  private _compressionFields(): Pick<SlingRunMessage, 'compress' | 'acceptCompressedDisplay'> {
+    return this._deviceCapabilities & SlingCapability.COMPRESSION
+      ? { compress: true, acceptCompressedDisplay: true }
+      : {};
+  }
+
+  // run IDs only go on the wire for devices that understand them
+  private _runIdField(runId?: number): { runId?: number } {
+    return runId !== undefined && this._deviceCapabilities & SlingCapability.CONCURRENT_RUNS
+      ? { runId }
+      : {};
   }
 
   private _handleMessage(topic: string, payload: Buffer): void {
@@ -132,38 +263,88 @@ export class SlingClient extends TypedEmitter<SlingClientEvents> {
       return;
     }
 
+    if (message.type === SlingMessageType.REPLAY_GAP) {
+      // what is missing before the oldest message the device still has is lost for good
+      this._reorderBuffer.skipTo(message.id);
+      this._releaseMessages();
+    } else if (message.type === SlingMessageType.DISPLAY && message.displayType === 'batch') {
+      for (const record of message.messages) {
+        this._handleOrderedMessage(record);
+      }
+    } else {
+      this._handleOrderedMessage(message);
+    }
+    this._watchForStall();
+  }
+
+  private _handleOrderedMessage(message: SlingMessage): void {
     if (message.type === 'hello' && !this._seenHellos.has(message.nonce)) {
       this._seenHellos.add(message.nonce);
-      this._lastProcessedMessageId = 0;
+      this._helloNonce = message.nonce;
+      this._reorderBuffer.reset(1);
+      this._displayAssembler.clear();
+      this._deviceCapabilities = message.capabilities;
+      this._uploadedPrograms.clear();
+      this._pendingCachedRuns.clear();
+      this._runningRuns.clear();
+      this._promptingRuns.clear();
       return;
     }
 
-    if (
-      this._lastProcessedMessageId === undefined ||
-      message.id === this._lastProcessedMessageId + 1 ||
-      (this._lastProcessedMessageId >= 4_294_967_295 && message.id === 0)
+    if (this._reorderBuffer.push(message.id, message)) {
+      this._releaseMessages();
+    }
+  }
+
+  private _releaseMessages(): void {
+    for (
+      let nextMessage = this._reorderBuffer.shift();
+      nextMessage;
+      nextMessage = this._reorderBuffer.shift()
     ) {
-      this._processMessage(message);
-    } else if (message.id > this._lastProcessedMessageId + 1) {
-      this._queuedMessages.set(message.id, message);
+      this._processMessage(nextMessage);
     }
+  }
 
-    if (!this._lastProcessedMessageId) {
+  // asks for a replay if messages wait behind one that does not arrive in time
+  private _watchForStall(): void {
+    if (this._reorderBuffer.pending === 0 || !(this._deviceCapabilities & SlingCapability.REPLAY)) {
+      this._clearStallTimer();
       return;
     }
+    if (this._stallTimer !== undefined) {
+      return;
+    }
+    const stalledId = this._reorderBuffer.nextId;
+    this._stallTimer = setTimeout(() => {
+      this._stallTimer = undefined;
+      if (this._reorderBuffer.nextId === stalledId) {
+        this.requestReplay();
+      }
+      this._watchForStall();
+    }, REPLAY_STALL_MS);
+  }
 
-    let queuedMessage = this._queuedMessages.get(this._lastProcessedMessageId + 1);
-    while (queuedMessage) {
-      this._queuedMessages.delete(this._lastProcessedMessageId + 1);
-      this._processMessage(queuedMessage);
-      queuedMessage = this._queuedMessages.get(this._lastProcessedMessageId + 1);
+  private _clearStallTimer(): void {
+    if (this._stallTimer !== undefined) {
+      clearTimeout(this._stallTimer);
+      this._stallTimer = undefined;
     }
   }
 
   private _processMessage(message: SlingMessage): void {
-    this._lastProcessedMessageId = message.id;
     switch (message.type) {
       case SlingMessageType.STATUS: {
+        if (message.runId !== undefined) {
+          this._processRunStatus(message.runId, message.status !== 'idle');
+          if (message.status === 'prompt') {
+            this._promptingRuns.add(message.runId);
+            this.emit('prompt', message.prompt, message.runId);
+          } else if (this._promptingRuns.delete(message.runId)) {
+            this.emit('promptDismiss', message.runId);
+          }
+          break;
+        }
         const oldRunning = this._deviceStatus?.running;
         this._deviceStatus = {
           ...this._deviceStatus,
@@ -175,6 +356,12 @@ export class SlingClient extends TypedEmitter<SlingClientEvents> {
         if (oldRunning !== this._deviceStatus.running) {
           this.emit('statusChange', this._deviceStatus.running);
         }
+        if (
+          this._deviceStatus.running &&
+          !(this._deviceCapabilities & SlingCapability.CONCURRENT_RUNS)
+        ) {
+          this._pendingCachedRuns.clear();
+        }
         if (message.status === 'prompt') {
           this._deviceStatus.prompt = message.prompt;
           this.emit('prompt', message.prompt);
@@ -185,54 +372,67 @@ export class SlingClient extends TypedEmitter<SlingClientEvents> {
         break;
       }
 
+      case SlingMessageType.CACHE_MISS: {
+        for (const [runId, pendingRun] of this._pendingCachedRuns) {
+          if (
+            (message.runId === undefined || message.runId === runId) &&
+            pendingRun.hash.equals(message.hash)
+          ) {
+            this._pendingCachedRuns.delete(runId);
+            // keep the run ID, so the caller can still tell which run is which
+            this.sendMessage({
+              type: SlingMessageType.RUN,
+              code: pendingRun.code,
+              ...this._runIdField(runId),
+              ...this._compressionFields()
+            });
+            break;
+          }
+        }
+        break;
+      }
+
+      case SlingMessageType.EXIT: {
+        this.emit('exit', message.usage, message.runId);
+        break;
+      }
+
       case SlingMessageType.DISPLAY: {
+        if (message.displayType === 'batch') {
+          // unpacked in _handleMessage
+          break;
+        }
         if (message.selfFlushing && message.displayType !== 'flush') {
-          this.emit('display', message.value, message.displayType);
+          this.emit('display', message.value, message.displayType, message.runId);
         } else if (message.displayType === 'flush') {
-          this._queuedFlushes.add(message);
-          this._attemptFlush(message);
-        } else {
-          this._displayBuffer.set(message.id, message);
-          for (const flush of this._queuedFlushes) {
-            if (flush.startingId <= message.id && message.id < flush.endingId) {
-              this._attemptFlush(flush);
-              break;
-            }
+          const display = this._displayAssembler.flush(message);
+          if (display) {
+            this.emit('display', display.value, display.displayType, message.runId);
           }
+        } else {
+          this._displayAssembler.add(message);
         }
         break;
       }
     }
   }
 
-  private _attemptFlush(flush: SlingDisplayFlushMessage): void {
-    const maxId = flush.endingId;
-    const messageParts = [];
-    let displayType: SlingDisplayMessageType | undefined;
-    for (let i = flush.startingId; i < maxId; ++i) {
-      const displayMessage = this._displayBuffer.get(i);
-      if (!displayMessage) {
-        return;
-      }
-      if (displayType && displayType !== displayMessage.displayType) {
-        // TODO handle this somehow
-      } else if (!displayType) {
-        displayType = displayMessage.displayType;
-      }
-      messageParts.push(displayMessage.value);
+  private _processRunStatus(runId: number, running: boolean): void {
+    const wasRunning = this._runningRuns.has(runId);
+    if (running) {
+      this._runningRuns.add(runId);
+      this._pendingCachedRuns.delete(runId);
+    } else {
+      this._runningRuns.delete(runId);
     }
-
-    // TODO tighten the types here so the last 2 clauses are not needed
-    if (!displayType || displayType === 'flush' || displayType === 'response') {
-      // TODO should not happen
-      return;
+    if (wasRunning !== running) {
+      this.emit('runStatusChange', runId, running);
     }
 
-    this._queuedFlushes.delete(flush);
-    for (let i = flush.startingId; i < maxId; ++i) {
-      this._displayBuffer.delete(i);
+    const oldRunning = this._deviceStatus?.running;
+    this._deviceStatus = { ...this._deviceStatus, running: this._runningRuns.size > 0 };
+    if (oldRunning !== undefined && oldRunning !== this._deviceStatus.running) {
+      this.emit('statusChange', this._deviceStatus.running);
     }
-    const message = messageParts.map((x) => `${x}`).join('');
-    this.emit('display', message, displayType);
   }
 }
@@ -0,0 +1,155 @@
+// LZ4 block format (no frame), matching common/sling_lz4.c on the device.
+
+const HASH_BITS = 12;
+const MIN_MATCH = 4;
+const MAX_OFFSET = 0xffff;
+// The last 5 bytes are always literals, and the last match starts at least 12 bytes before the end
+const LAST_LITERALS = 5;
+const MATCH_FIND_LIMIT = 12;
+
+function hash32(data: Buffer, position: number): number {
+  return Math.imul(data.readUInt32LE(position), 2654435761) >>> (32 - HASH_BITS);
+}
+
+function writeLength(out: number[], length: number): void {
+  for (; length >= 255; length -= 255) {
+    out.push(255);
+  }
+  out.push(length);
+}
+
+function writeSequence(
+  out: number[],
+  data: Buffer,
+  literalStart: number,
+  literalLength: number,
+  offset: number,
+  matchLength: number
+): void {
+  const tokenPosition = out.length;
+  out.push(Math.min(literalLength, 15) << 4);
+  if (literalLength >= 15) {
+    writeLength(out, literalLength - 15);
+  }
+  for (let i = 0; i < literalLength; ++i) {
+    out.push(data[literalStart + i]);
+  }
+  if (matchLength === 0) {
+    // the last sequence has no match
+    return;
+  }
+
+  out.push(offset & 0xff, offset >>> 8);
+  matchLength -= MIN_MATCH;
+  out[tokenPosition] |= Math.min(matchLength, 15);
+  if (matchLength >= 15) {
+    writeLength(out, matchLength - 15);
+  }
+}
+
+/**
+ * Compresses data, greedily, into a single LZ4 block.
+ */
+export function lz4Compress(data: Buffer): Buffer {
+  const out: number[] = [];
+  let position = 0;
+  let anchor = 0;
+
+  if (data.length > MATCH_FIND_LIMIT) {
+    const table = new Int32Array(1 << HASH_BITS).fill(-1);
+    const matchEndLimit = data.length - LAST_LITERALS;
+    while (position + MATCH_FIND_LIMIT <= data.length) {
+      const h = hash32(data, position);
+      const reference = table[h];
+      table[h] = position;
+      if (
+        reference < 0 ||
+        position - reference > MAX_OFFSET ||
+        data.readUInt32LE(reference) !== data.readUInt32LE(position)
+      ) {
+        ++position;
+        continue;
+      }
+
+      let length = MIN_MATCH;
+      while (position + length < matchEndLimit && data[reference + length] === data[position + length]) {
+        ++length;
+      }
+      writeSequence(out, data, anchor, position - anchor, position - reference, length);
+      position += length;
+      anchor = position;
+    }
+  }
+
+  writeSequence(out, data, anchor, data.length - anchor, 0, 0);
+  return Buffer.from(out);
+}
+
+function readLength(data: Buffer, position: number): [number, number] {
+  let length = 0;
+  let b: number;
+  do {
+    if (position >= data.length) {
+      throw new Error('Truncated LZ4 block');
+    }
+    b = data[position++];
+    length += b;
+  } while (b === 255);
+  return [length, position];
+}
+
+/**
+ * Decompresses a single LZ4 block, which must come to exactly size bytes.
+ */
+export function lz4Decompress(data: Buffer, size: number): Buffer {
+  const out = Buffer.alloc(size);
+  let position = 0;
+  let outPosition = 0;
+
+  while (position < data.length) {
+    const token = data[position++];
+
+    let literalLength = token >>> 4;
+    if (literalLength === 15) {
+      const [extra, next] = readLength(data, position);
+      literalLength += extra;
+      position = next;
+    }
+    if (literalLength > data.length - position || literalLength > size - outPosition) {
+      throw new Error('Malformed LZ4 block');
+    }
+    outPosition += data.copy(out, outPosition, position, position + literalLength);
+    position += literalLength;
+    if (position === data.length) {
+      if (outPosition !== size) {
+        throw new Error('LZ4 block decompressed to the wrong size');
+      }
+      return out;
+    }
+
+    if (data.length - position < 2) {
+      throw new Error('Truncated LZ4 block');
+    }
+    const offset = data.readUInt16LE(position);
+    position += 2;
+    if (offset === 0 || offset > outPosition) {
+      throw new Error('Malformed LZ4 block');
+    }
+
+    let matchLength = token & 15;
+    if (matchLength === 15) {
+      const [extra, next] = readLength(data, position);
+      matchLength += extra;
+      position = next;
+    }
+    matchLength += MIN_MATCH;
+    if (matchLength > size - outPosition) {
+      throw new Error('Malformed LZ4 block');
+    }
+    // the match may overlap what it produces, so copy byte by byte
+    for (let i = 0; i < matchLength; ++i, ++outPosition) {
+      out[outPosition] = out[outPosition - offset];
+    }
+  }
+  throw new Error('Truncated LZ4 block');
+}
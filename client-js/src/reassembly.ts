@@ -0,0 +1,197 @@
+import {
+  SlingDisplayFlushMessage,
+  SlingDisplayMessageType,
+  SlingNonFlushDisplayMessage
+} from './slingProtocol';
+
+type SlingDisplayPart = SlingNonFlushDisplayMessage & { id: number };
+
+// the furthest ahead of the next expected message number a message may be
+// before it is taken for garbage rather than held for its predecessors
+const REORDER_WINDOW_MAX = 1 << 20;
+
+/**
+ * Puts device messages back in message number order. Early messages wait in a
+ * ring indexed by message number, so each is stored and released in O(1). The
+ * ring doubles when a message arrives further ahead than it spans. Message
+ * numbers wrap around after 2^32 - 1.
+ */
+export class SlingReorderBuffer<T> {
+  private _slots: (T | undefined)[] = new Array<T | undefined>(16);
+  private _mask = 15;
+  private _nextId?: number;
+  private _pending = 0;
+
+  /**
+   * The message number expected next, or undefined if none has arrived yet.
+   */
+  get nextId(): number | undefined {
+    return this._nextId;
+  }
+
+  /**
+   * How many messages are waiting for one before them to arrive.
+   */
+  get pending(): number {
+    return this._pending;
+  }
+
+  /**
+   * Forgets every message waiting, and expects the given message number next.
+   */
+  reset(nextId?: number): void {
+    this._slots.fill(undefined);
+    this._nextId = nextId;
+    this._pending = 0;
+  }
+
+  /**
+   * Gives up on the messages before the given message number, expecting it
+   * next. Messages already waiting from it on are kept.
+   */
+  skipTo(id: number): void {
+    if (this._nextId === undefined) {
+      this._nextId = id;
+      return;
+    }
+    const distance = (id - this._nextId) >>> 0;
+    if (distance >= 0x80000000) {
+      return;
+    }
+    if (distance > this._mask) {
+      // every message waiting is before it
+      this._slots.fill(undefined);
+      this._pending = 0;
+    } else {
+      for (let i = 0; i < distance; ++i) {
+        const index = (this._nextId + i) & this._mask;
+        if (this._slots[index] !== undefined) {
+          this._slots[index] = undefined;
+          --this._pending;
+        }
+      }
+    }
+    this._nextId = id;
+  }
+
+  /**
+   * Adds a message to be released in order. The first message ever added is
+   * expected, whatever its number. Returns false if the message was dropped,
+   * either as a repeat of one already released or too far ahead.
+   */
+  push(id: number, message: T): boolean {
+    if (this._nextId === undefined) {
+      this._nextId = id;
+    }
+    // how far ahead this is; message numbers more than 2^31 ahead are behind
+    const distance = (id - this._nextId) >>> 0;
+    if (distance >= 0x80000000 || distance >= REORDER_WINDOW_MAX) {
+      return false;
+    }
+    if (distance > this._mask) {
+      this._grow(distance);
+    }
+    if (this._slots[id & this._mask] === undefined) {
+      ++this._pending;
+    }
+    this._slots[id & this._mask] = message;
+    return true;
+  }
+
+  /**
+   * Takes the next message in order, if it has arrived.
+   */
+  shift(): T | undefined {
+    if (this._nextId === undefined) {
+      return undefined;
+    }
+    const index = this._nextId & this._mask;
+    const message = this._slots[index];
+    if (message === undefined) {
+      return undefined;
+    }
+    this._slots[index] = undefined;
+    --this._pending;
+    this._nextId = (this._nextId + 1) >>> 0;
+    return message;
+  }
+
+  private _grow(distance: number): void {
+    let size = this._slots.length * 2;
+    while (size <= distance) {
+      size *= 2;
+    }
+    const slots = new Array<T | undefined>(size);
+    const mask = size - 1;
+    // _nextId is set, as push sets it first
+    const nextId = this._nextId as number;
+    for (let i = 0; i < this._slots.length; ++i) {
+      const id = (nextId + i) >>> 0;
+      slots[id & mask] = this._slots[id & this._mask];
+    }
+    this._slots = slots;
+    this._mask = mask;
+  }
+}
+
+export interface SlingAssembledDisplay {
+  value: string;
+  displayType: Exclude<SlingDisplayMessageType, 'flush' | 'response' | 'batch'>;
+}
+
+/**
+ * Collects the parts of display messages for each run until their flush.
+ * Messages reach it in order, so a flush covers just the parts of its run
+ * collected since its starting message number, and each part is handled once.
+ */
+export class SlingDisplayAssembler {
+  private readonly _parts = new Map<number | undefined, SlingDisplayPart[]>();
+
+  add(message: SlingDisplayPart): void {
+    const parts = this._parts.get(message.runId);
+    if (parts) {
+      parts.push(message);
+    } else {
+      this._parts.set(message.runId, [message]);
+    }
+  }
+
+  /**
+   * Returns the display message a flush completes, or undefined if it covers
+   * no parts.
+   */
+  flush(flush: SlingDisplayFlushMessage): SlingAssembledDisplay | undefined {
+    const parts = this._parts.get(flush.runId);
+    if (!parts) {
+      return undefined;
+    }
+    this._parts.delete(flush.runId);
+
+    // parts from before the starting message number lost their flush; drop them
+    const span = (flush.endingId - flush.startingId) >>> 0;
+    const values = [];
+    let displayType: SlingDisplayPart['displayType'] | undefined;
+    for (const part of parts) {
+      if ((part.id - flush.startingId) >>> 0 >= span) {
+        continue;
+      }
+      if (displayType && displayType !== part.displayType) {
+        // TODO handle this somehow
+      } else if (!displayType) {
+        displayType = part.displayType;
+      }
+      values.push(`${part.value}`);
+    }
+
+    // TODO tighten the types here so the last clause is not needed
+    if (!displayType || displayType === 'response') {
+      // TODO should not happen
+      return undefined;
+    }
+    return { value: values.join(''), displayType };
+  }
+
+  clear(): void {
+    this._parts.clear();
+  }
+}
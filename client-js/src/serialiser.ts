@@ -1,9 +1,8 @@
-export type SerialiserEntry = InternalSerialiserEntry | ['str', string];
-
-type InternalSerialiserEntry =
+export type SerialiserEntry =
   | ['u16' | 'u32' | 'i32' | 'f32', number]
   | ['blob', Buffer]
-  | ['boolean', boolean];
+  | ['boolean', boolean]
+  | ['str', string];
 
 const dataTypeSizes = {
   u16: 2,
@@ -13,27 +12,36 @@ const dataTypeSizes = {
   boolean: 1
 };
 
+function entrySize(entry: SerialiserEntry): number {
+  switch (entry[0]) {
+    case 'str':
+      // length-prefixed and null-terminated, as devices expect
+      return 4 + Buffer.byteLength(entry[1], 'utf8') + 1;
+    case 'blob':
+      return entry[1].byteLength;
+    default:
+      return dataTypeSizes[entry[0]];
+  }
+}
+
+// sizes the output first, then writes every entry straight into it
 export function serialise(entries: SerialiserEntry[]): Buffer {
   let finalSize = 0;
-  const processedEntries: InternalSerialiserEntry[] = [];
   for (const entry of entries) {
-    if (entry[0] === 'str') {
-      const buf = Buffer.from(entry[1], 'utf8');
-      finalSize += buf.byteLength + 1;
-      processedEntries.push(['blob', buf]);
-    } else if (entry[0] === 'blob') {
-      finalSize += entry[1].byteLength;
-      processedEntries.push(entry);
-    } else {
-      finalSize += dataTypeSizes[entry[0]];
-      processedEntries.push(entry);
-    }
+    finalSize += entrySize(entry);
   }
 
-  const out = Buffer.alloc(finalSize);
+  const out = Buffer.allocUnsafe(finalSize);
   let position = 0;
-  for (const entry of processedEntries) {
+  for (const entry of entries) {
     switch (entry[0]) {
+      case 'str': {
+        const length = out.write(entry[1], position + 4, 'utf8');
+        out.writeUInt32LE(length, position);
+        out[position + 4 + length] = 0;
+        position += 4 + length + 1;
+        continue;
+      }
       case 'blob':
         position += entry[1].copy(out, position);
         continue;
@@ -49,6 +57,9 @@ export function serialise(entries: SerialiserEntry[]): Buffer {
       case 'f32':
         out.writeFloatLE(entry[1], position);
         break;
+      case 'boolean':
+        out.writeUInt8(entry[1] ? 1 : 0, position);
+        break;
     }
     position += dataTypeSizes[entry[0]];
   }
@@ -1,31 +1,46 @@
+import { createHash } from 'crypto';
+import { lz4Compress, lz4Decompress } from './lz4';
 import { SerialiserEntry, serialise } from './serialiser';
 
-function flip<T extends string>(o: Record<T, number>): Record<number, T | undefined> {
-  // TODO fixme
-  // eslint-disable-next-line @typescript-eslint/no-unsafe-return
-  return Object.fromEntries(Object.entries(o).map(([k, v]) => [v, k]));
+// the names in o, indexed by their IDs; the IDs are small, so an array makes the quickest lookup
+function byId<T extends string>(o: Record<T, number>): (T | undefined)[] {
+  const names: (T | undefined)[] = [];
+  for (const name in o) {
+    names[o[name]] = name;
+  }
+  return names;
 }
 
 export const enum SlingMessageType {
   RUN = 'run',
+  RUN_CACHED = 'run_cached',
   STOP = 'stop',
   PING = 'ping',
   STATUS = 'status',
   DISPLAY = 'display',
   INPUT = 'input',
-  HELLO = 'hello'
+  HELLO = 'hello',
+  CACHE_MISS = 'cache_miss',
+  EXIT = 'exit',
+  REPLAY = 'replay',
+  REPLAY_GAP = 'replay_gap'
 }
 
 export const slingDeviceMessageTypes = [
   SlingMessageType.DISPLAY,
   SlingMessageType.STATUS,
-  SlingMessageType.HELLO
+  SlingMessageType.HELLO,
+  SlingMessageType.CACHE_MISS,
+  SlingMessageType.EXIT,
+  SlingMessageType.REPLAY_GAP
 ];
 export const slingClientMessageTypes = [
   SlingMessageType.RUN,
+  SlingMessageType.RUN_CACHED,
   SlingMessageType.STOP,
   SlingMessageType.PING,
-  SlingMessageType.INPUT
+  SlingMessageType.INPUT,
+  SlingMessageType.REPLAY
 ];
 export const slingMessageTypes = [...slingDeviceMessageTypes, ...slingClientMessageTypes];
 
@@ -39,6 +54,42 @@ export interface SlingEmptyMessage<T extends SlingMessageType> {
   type: T;
 }
 
+export const enum SlingCapability {
+  PROGRAM_CACHE = 1 << 0,
+  CONCURRENT_RUNS = 1 << 1,
+  COMPRESSION = 1 << 2,
+  REPLAY = 1 << 3
+}
+
+/**
+ * Names a run on devices with the concurrent runs capability, which append it
+ * to status, display and cache_miss messages.
+ */
+export interface SlingRunIdField {
+  runId?: number;
+}
+
+// "SLRH"
+const RUN_HEADER_MAGIC = 0x48524c53;
+const RUN_HEADER_SIZE = 6;
+const enum RunOption {
+  RUN_ID = 1,
+  HEAP_SIZE = 2,
+  COMPRESSED_PROGRAM = 3,
+  ACCEPT_COMPRESSED_DISPLAY = 4,
+  OUTPUT_LIMITS = 5
+}
+
+// set in the data type of string and array display bodies that are LZ4-compressed
+const DISPLAY_DATA_COMPRESSED = 0x80;
+
+/**
+ * Computes the hash used to name a program in `run_cached` messages.
+ */
+export function hashProgram(code: Buffer): Buffer {
+  return createHash('sha256').update(code).digest();
+}
+
 export type SlingDisplayPayloadType = keyof typeof displayPayloadTypeToId;
 
 const displayPayloadTypeToId = {
@@ -52,7 +103,7 @@ const displayPayloadTypeToId = {
   function: 8
 } as const;
 
-const displayPayloadTypeById = flip<SlingDisplayPayloadType>(displayPayloadTypeToId);
+const displayPayloadTypeById = byId<SlingDisplayPayloadType>(displayPayloadTypeToId);
 
 export type SlingDisplayMessageType = keyof typeof displayMessageTypeToId;
 
@@ -61,15 +112,17 @@ const displayMessageTypeToId = {
   error: 1,
   result: 2,
   response: 4,
-  flush: 100
+  flush: 100,
+  batch: 101
 } as const;
 
-const displayMessageTypeById = flip<SlingDisplayMessageType>(displayMessageTypeToId);
+const displayMessageTypeById = byId<SlingDisplayMessageType>(displayMessageTypeToId);
 
 export interface SlingEmptyDisplayMessageGeneric<
   T extends SlingMessageType.DISPLAY | SlingMessageType.INPUT,
   MT extends SlingDisplayMessageType
-> extends SlingEmptyMessage<T> {
+> extends SlingEmptyMessage<T>,
+    SlingRunIdField {
   displayType: MT;
   selfFlushing: boolean;
 }
@@ -104,7 +157,19 @@ export type SlingNonFlushDisplayMessage =
   | SlingDisplayMessageGeneric<SlingMessageType.DISPLAY, 'output' | 'error' | 'result'>
   | SlingDisplayMessageGeneric<SlingMessageType.INPUT, 'response'>;
 
-export type SlingDisplayMessage = SlingNonFlushDisplayMessage | SlingDisplayFlushMessage;
+/**
+ * Several consecutive display messages published together. Each record
+ * carries its own message number; the batch takes that of the first record.
+ */
+export interface SlingDisplayBatchMessage
+  extends SlingEmptyDisplayMessageGeneric<SlingMessageType.DISPLAY, 'batch'> {
+  messages: SlingMessage[];
+}
+
+export type SlingDisplayMessage =
+  | SlingNonFlushDisplayMessage
+  | SlingDisplayFlushMessage
+  | SlingDisplayBatchMessage;
 
 export type SlingStatus = keyof typeof slingStatusToId;
 
@@ -114,76 +179,377 @@ const slingStatusToId = {
   prompt: 2
 } as const;
 
-const slingStatusById = flip<SlingStatus>(slingStatusToId);
+const slingStatusById = byId<SlingStatus>(slingStatusToId);
 
 export type SlingStatusMessage = SlingEmptyMessage<SlingMessageType.STATUS> &
+  SlingRunIdField &
   ({ status: Exclude<SlingStatus, 'prompt'> } | { status: 'prompt'; prompt: string });
 
-export interface SlingRunMessage extends SlingEmptyMessage<SlingMessageType.RUN> {
+/**
+ * Limits on the standard output of a run. Devices keep their own limit where
+ * a field is 0 or stricter.
+ */
+export interface SlingOutputLimits {
+  bytesPerSecond: number;
+  messagesPerSecond: number;
+  /** Over the whole run */
+  maxBytes: number;
+}
+
+export interface SlingRunMessage extends SlingEmptyMessage<SlingMessageType.RUN>, SlingRunIdField {
   code: Buffer;
+  /**
+   * Bytes of heap to give the program, instead of the device's default. Devices
+   * may cap this.
+   */
+  heapSize?: number;
+  /**
+   * Send the program compressed, if that makes it smaller. Only for devices
+   * with the compression capability.
+   */
+  compress?: boolean;
+  /**
+   * Let the device compress long display strings for this run. Only for
+   * devices with the compression capability.
+   */
+  acceptCompressedDisplay?: boolean;
+  outputLimits?: SlingOutputLimits;
+}
+
+export interface SlingRunCachedMessage
+  extends SlingEmptyMessage<SlingMessageType.RUN_CACHED>,
+    SlingRunIdField {
+  hash: Buffer;
 }
 
-export type SlingStopMessage = SlingEmptyMessage<SlingMessageType.STOP>;
+export interface SlingCacheMissMessage
+  extends SlingEmptyMessage<SlingMessageType.CACHE_MISS>,
+    SlingRunIdField {
+  hash: Buffer;
+}
+
+export type SlingExitReason = keyof typeof exitReasonToId;
+
+const exitReasonToId = {
+  finished: 0,
+  stopped: 1,
+  crashed: 2,
+  timeLimit: 3,
+  cpuLimit: 4,
+  memoryLimit: 5,
+  outputLimit: 6
+} as const;
+
+const exitReasonById = byId<SlingExitReason>(exitReasonToId);
+
+/**
+ * What a run cost. Times are in microseconds.
+ */
+export interface SlingRunUsage {
+  reason: SlingExitReason;
+  exitCode: number;
+  wallTime: number;
+  userTime: number;
+  systemTime: number;
+  maxRssKiB: number;
+  minorFaults: number;
+  majorFaults: number;
+  voluntaryContextSwitches: number;
+  involuntaryContextSwitches: number;
+}
+
+export type SlingExitMessage = SlingEmptyMessage<SlingMessageType.EXIT> &
+  SlingRunIdField & { usage: SlingRunUsage };
+
+export type SlingStopMessage = SlingEmptyMessage<SlingMessageType.STOP> & SlingRunIdField;
 export type SlingPingMessage = SlingEmptyMessage<SlingMessageType.PING>;
-export type SlingHelloMessage = SlingEmptyMessage<SlingMessageType.HELLO> & { nonce: number };
+export type SlingHelloMessage = SlingEmptyMessage<SlingMessageType.HELLO> & {
+  nonce: number;
+  capabilities: number;
+};
+
+/**
+ * Asks a device with the replay capability to publish its messages again, from
+ * startingId on. nonce is that of the last hello seen.
+ */
+export type SlingReplayMessage = SlingEmptyMessage<SlingMessageType.REPLAY> & {
+  nonce: number;
+  startingId: number;
+};
+/**
+ * Says messages asked to be replayed are gone. It takes up no message number:
+ * its id is the oldest message number the device still has.
+ */
+export type SlingReplayGapMessage = SlingEmptyMessage<SlingMessageType.REPLAY_GAP>;
 
 export type SlingNoIdMessage =
   | SlingRunMessage
+  | SlingRunCachedMessage
+  | SlingCacheMissMessage
+  | SlingExitMessage
   | SlingDisplayMessage
   | SlingStatusMessage
   | SlingStopMessage
   | SlingPingMessage
-  | SlingHelloMessage;
+  | SlingHelloMessage
+  | SlingReplayMessage
+  | SlingReplayGapMessage;
 
 export type SlingOptionalIdMessage = SlingNoIdMessage & { id?: number };
 export type SlingMessage = SlingNoIdMessage & { id: number };
 
-function parseDisplayPayload(data: Buffer) {
-  const payloadType = displayPayloadTypeById[data.readUInt16LE(6)];
+function readRunId(data: Buffer, offset: number): SlingRunIdField {
+  return data.length >= offset + 4 ? { runId: data.readUInt32LE(offset) } : {};
+}
+
+// sets the run ID in place, rather than spreading readRunId into a copy
+function withRunId<M extends SlingRunIdField>(message: M, data: Buffer, offset: number): M {
+  if (data.length >= offset + 4) {
+    message.runId = data.readUInt32LE(offset);
+  }
+  return message;
+}
+
+/**
+ * A string or array display message that still refers to the MQTT payload it
+ * came in, and only decodes its value when that is first read. Most are only
+ * read once, when their flush arrives, if at all.
+ *
+ * As value is a getter, it is not an own property, and is left out by object
+ * spread and JSON.stringify.
+ */
+class SlingStringDisplayMessage<
+  T extends SlingMessageType.DISPLAY | SlingMessageType.INPUT,
+  MT extends SlingDisplayMessageType
+> {
+  runId?: number;
+  private _value?: string;
+  private _data?: Buffer;
+
+  constructor(
+    readonly id: number,
+    readonly type: T,
+    readonly displayType: MT,
+    readonly selfFlushing: boolean,
+    readonly payloadType: 'str' | 'array',
+    data: Buffer,
+    private readonly _start: number,
+    private readonly _length: number,
+    // the size of the LZ4 block the value is in, if it is compressed
+    private readonly _compressedSize?: number
+  ) {
+    this._data = data;
+  }
+
+  get value(): string {
+    if (this._value === undefined) {
+      const data = this._data as Buffer;
+      this._value =
+        this._compressedSize === undefined
+          ? data.toString('utf8', this._start, this._start + this._length)
+          : lz4Decompress(
+              data.slice(this._start, this._start + this._compressedSize),
+              this._length
+            ).toString('utf8');
+      // let the payload go
+      this._data = undefined;
+    }
+    return this._value;
+  }
+}
+
+// topics seen so far, by the message type they carry, so each is only split once
+const topicTypes = new Map<string, SlingMessageType | null>();
+// enough for every topic of a dashboard's worth of devices
+const TOPIC_CACHE_MAX = 2048;
+
+function topicType(topic: string): SlingMessageType | null {
+  let type = topicTypes.get(topic);
+  if (type === undefined) {
+    const splitTopic = topic.split('/');
+    type = splitTopic.length >= 2 && isValidSlingMessageType(splitTopic[1]) ? splitTopic[1] : null;
+    if (topicTypes.size >= TOPIC_CACHE_MAX) {
+      topicTypes.clear();
+    }
+    topicTypes.set(topic, type);
+  }
+  return type;
+}
+
+// where the fixed-size part of a display message, plus any string, ends
+function displayPayloadEnd(data: Buffer): number {
+  const dataType = data.readUInt16LE(6);
+  if (dataType & DISPLAY_DATA_COMPRESSED) {
+    return 16 + data.readUInt32LE(12);
+  }
+  const payloadType = displayPayloadTypeById[dataType];
+  return payloadType === 'str' || payloadType === 'array' ? 13 + data.readUInt32LE(8) : 12;
+}
+
+type RunHeader = SlingRunIdField & {
+  heapSize?: number;
+  uncompressedSize?: number;
+  acceptCompressedDisplay?: boolean;
+  outputLimits?: SlingOutputLimits;
+  codeOffset: number;
+};
+
+function parseRunHeader(data: Buffer): RunHeader {
+  if (data.length < 4 + RUN_HEADER_SIZE || data.readUInt32LE(4) !== RUN_HEADER_MAGIC) {
+    return { codeOffset: 4 };
+  }
+  const headerEnd = 4 + data.readUInt16LE(8);
+  const result: RunHeader = { codeOffset: headerEnd };
+  for (let position = 4 + RUN_HEADER_SIZE; position + 4 <= headerEnd; ) {
+    const optionType = data.readUInt16LE(position);
+    const optionLength = data.readUInt16LE(position + 2);
+    if (optionType === RunOption.RUN_ID && optionLength === 4) {
+      result.runId = data.readUInt32LE(position + 4);
+    } else if (optionType === RunOption.HEAP_SIZE && optionLength === 4) {
+      result.heapSize = data.readUInt32LE(position + 4);
+    } else if (optionType === RunOption.COMPRESSED_PROGRAM && optionLength === 4) {
+      result.uncompressedSize = data.readUInt32LE(position + 4);
+    } else if (optionType === RunOption.ACCEPT_COMPRESSED_DISPLAY) {
+      result.acceptCompressedDisplay = true;
+    } else if (optionType === RunOption.OUTPUT_LIMITS && optionLength === 12) {
+      result.outputLimits = {
+        bytesPerSecond: data.readUInt32LE(position + 4),
+        messagesPerSecond: data.readUInt32LE(position + 8),
+        maxBytes: data.readUInt32LE(position + 12)
+      };
+    }
+    position += 4 + optionLength;
+  }
+  return result;
+}
+
+function readDisplayMessage<
+  T extends SlingMessageType.DISPLAY | SlingMessageType.INPUT,
+  MT extends SlingDisplayMessageType
+>(
+  id: number,
+  type: T,
+  displayType: MT,
+  selfFlushing: boolean,
+  data: Buffer
+): (SlingDisplayMessageGeneric<T, MT> & { id: number }) | null {
+  const dataType = data.readUInt16LE(6);
+  const payloadType = displayPayloadTypeById[dataType & ~DISPLAY_DATA_COMPRESSED];
   if (!payloadType) {
     return null;
   }
 
+  if (dataType & DISPLAY_DATA_COMPRESSED) {
+    if (payloadType !== 'str' && payloadType !== 'array') {
+      return null;
+    }
+    const stringLength = data.readUInt32LE(8);
+    const compressedLength = data.readUInt32LE(12);
+    return new SlingStringDisplayMessage(
+      id,
+      type,
+      displayType,
+      selfFlushing,
+      payloadType,
+      data,
+      16,
+      stringLength,
+      compressedLength
+    );
+  }
+
   switch (payloadType) {
     case 'undefined':
     case 'function':
-      return { payloadType, value: undefined };
+      return { id, type, displayType, selfFlushing, payloadType, value: undefined };
+    case 'null':
+      return { id, type, displayType, selfFlushing, payloadType, value: null };
     case 'boolean':
-      return { payloadType, value: !!data.readUInt8(8) };
+      return { id, type, displayType, selfFlushing, payloadType, value: !!data.readUInt8(8) };
     case 'i32':
-      return { payloadType, value: data.readInt32LE(8) };
+      return { id, type, displayType, selfFlushing, payloadType, value: data.readInt32LE(8) };
     case 'f32':
-      return { payloadType, value: data.readFloatLE(8) };
+      return { id, type, displayType, selfFlushing, payloadType, value: data.readFloatLE(8) };
     case 'str':
-    case 'array': {
-      const stringLength = data.readUInt32LE(8);
-      const value = data.toString('utf8', 12, 12 + stringLength);
-      return { payloadType, value };
-    }
+    case 'array':
+      return new SlingStringDisplayMessage(
+        id,
+        type,
+        displayType,
+        selfFlushing,
+        payloadType,
+        data,
+        12,
+        data.readUInt32LE(8)
+      );
   }
   return null;
 }
 
 export function deserialiseMqttMessage(topic: string, data: Buffer): SlingMessage | null {
-  const splitTopic = topic.split('/');
-  if (splitTopic.length < 2) {
-    return null;
-  }
-  const [, type] = splitTopic;
-  if (!isValidSlingMessageType(type)) {
-    return null;
-  }
+  const type = topicType(topic);
+  return type && deserialiseMessage(type, data);
+}
 
+function deserialiseMessage(type: SlingMessageType, data: Buffer): SlingMessage | null {
   const id = data.readUInt32LE(0);
 
   switch (type) {
     case SlingMessageType.HELLO:
-      return { id, type, nonce: data.readUInt32LE(4) };
+      return {
+        id,
+        type,
+        nonce: data.readUInt32LE(4),
+        capabilities: data.length >= 12 ? data.readUInt32LE(8) : 0
+      };
     case SlingMessageType.PING:
-    case SlingMessageType.STOP:
+    case SlingMessageType.REPLAY_GAP:
       return { id, type };
-    case SlingMessageType.RUN:
-      return { id, type, code: data.slice(4) };
+    case SlingMessageType.REPLAY:
+      return { id, type, nonce: data.readUInt32LE(4), startingId: data.readUInt32LE(8) };
+    case SlingMessageType.STOP:
+      return { id, type, ...readRunId(data, 4) };
+    case SlingMessageType.RUN: {
+      const { codeOffset, runId, heapSize, uncompressedSize, acceptCompressedDisplay, outputLimits } =
+        parseRunHeader(data);
+      const code = data.slice(codeOffset);
+      return {
+        id,
+        type,
+        code: uncompressedSize === undefined ? code : lz4Decompress(code, uncompressedSize),
+        ...(runId === undefined ? {} : { runId }),
+        ...(heapSize === undefined ? {} : { heapSize }),
+        ...(uncompressedSize === undefined ? {} : { compress: true }),
+        ...(acceptCompressedDisplay ? { acceptCompressedDisplay } : {}),
+        ...(outputLimits ? { outputLimits } : {})
+      };
+    }
+    case SlingMessageType.RUN_CACHED:
+    case SlingMessageType.CACHE_MISS:
+      return { id, type, hash: data.slice(4, 36), ...readRunId(data, 36) };
+    case SlingMessageType.EXIT: {
+      const reason = exitReasonById[data.readUInt16LE(4)];
+      if (!reason || data.length < 42) {
+        return null;
+      }
+      const message: SlingExitMessage & { id: number } = {
+        id,
+        type,
+        usage: {
+          reason,
+          exitCode: data.readInt32LE(6),
+          wallTime: data.readUInt32LE(10),
+          userTime: data.readUInt32LE(14),
+          systemTime: data.readUInt32LE(18),
+          maxRssKiB: data.readUInt32LE(22),
+          minorFaults: data.readUInt32LE(26),
+          majorFaults: data.readUInt32LE(30),
+          voluntaryContextSwitches: data.readUInt32LE(34),
+          involuntaryContextSwitches: data.readUInt32LE(38)
+        }
+      };
+      return withRunId(message, data, 42);
+    }
     case SlingMessageType.STATUS: {
       const status = slingStatusById[data.readUInt16LE(4)];
       if (!status) {
@@ -192,15 +558,18 @@ export function deserialiseMqttMessage(topic: string, data: Buffer): SlingMessag
       switch (status) {
         case 'prompt': {
           const stringLength = data.readUInt32LE(6);
-          return {
+          const message: SlingStatusMessage & { id: number } = {
             id,
             type,
             status,
             prompt: data.toString('utf8', 10, 10 + stringLength)
           };
+          return withRunId(message, data, 11 + stringLength);
+        }
+        default: {
+          const message: SlingStatusMessage & { id: number } = { id, type, status };
+          return withRunId(message, data, 6);
         }
-        default:
-          return { id, type, status };
       }
     }
     case SlingMessageType.DISPLAY: {
@@ -210,7 +579,7 @@ export function deserialiseMqttMessage(topic: string, data: Buffer): SlingMessag
         return null;
       }
       if (displayType === 'flush') {
-        return {
+        const message: SlingDisplayFlushMessage & { id: number } = {
           id,
           type,
           displayType,
@@ -218,40 +587,48 @@ export function deserialiseMqttMessage(topic: string, data: Buffer): SlingMessag
           endingId: id,
           selfFlushing: false
         };
-      } else if (displayType !== 'response') {
-        const payload = parseDisplayPayload(data);
-        return (
-          payload && {
-            id,
-            type,
-            displayType,
-            selfFlushing: (displayTypeId & 0xff00) === 0x100,
-            ...payload
+        return withRunId(message, data, 10);
+      } else if (displayType === 'batch') {
+        const recordCount = data.readUInt16LE(6);
+        const messages: SlingMessage[] = [];
+        let position = 8;
+        for (let i = 0; i < recordCount && position + 2 <= data.length; ++i) {
+          const recordLength = data.readUInt16LE(position);
+          position += 2;
+          // a view, not a copy
+          const record = data.slice(position, position + recordLength);
+          position += recordLength;
+          const recordMessage = deserialiseMessage(type, record);
+          // batches do not nest
+          if (recordMessage && !('messages' in recordMessage)) {
+            messages.push(recordMessage);
           }
+        }
+        return { id, type, displayType, selfFlushing: false, messages };
+      } else if (displayType !== 'response') {
+        const message = readDisplayMessage(
+          id,
+          type,
+          displayType,
+          (displayTypeId & 0xff00) === 0x100,
+          data
         );
+        return message && withRunId(message, data, displayPayloadEnd(data));
       }
       return null;
     }
     case SlingMessageType.INPUT: {
       const displayType = displayMessageTypeById[data.readUInt16LE(4)];
       if (displayType === 'response') {
-        const payload = parseDisplayPayload(data);
-        return (
-          payload && {
-            id,
-            type,
-            displayType,
-            selfFlushing: false,
-            ...payload
-          }
-        );
+        const message = readDisplayMessage(id, type, displayType, false, data);
+        return message && withRunId(message, data, displayPayloadEnd(data));
       }
     }
   }
   return null;
 }
 
-function makeNonce() {
+export function makeNonce(): number {
   return Math.floor(Math.random() * 4294967296);
 }
 
@@ -260,16 +637,77 @@ export function serialiseMqttMessage(message: SlingOptionalIdMessage): Buffer |
   switch (message.type) {
     case SlingMessageType.PING:
     case SlingMessageType.STOP:
+    case SlingMessageType.REPLAY_GAP:
+      break;
+
+    case SlingMessageType.REPLAY:
+      entries.push(['u32', message.nonce], ['u32', message.startingId]);
       break;
 
     case SlingMessageType.HELLO:
-      entries.push(['u32', message.nonce]);
+      entries.push(['u32', message.nonce], ['u32', message.capabilities]);
+      break;
+
+    case SlingMessageType.RUN: {
+      // each option's value is some u32s
+      const options: Array<[RunOption, ...number[]]> = [];
+      if (message.runId !== undefined) {
+        options.push([RunOption.RUN_ID, message.runId]);
+      }
+      if (message.heapSize !== undefined) {
+        options.push([RunOption.HEAP_SIZE, message.heapSize]);
+      }
+      let code = message.code;
+      if (message.compress) {
+        const compressed = lz4Compress(code);
+        if (compressed.length < code.length) {
+          options.push([RunOption.COMPRESSED_PROGRAM, code.length]);
+          code = compressed;
+        }
+      }
+      if (message.acceptCompressedDisplay) {
+        options.push([RunOption.ACCEPT_COMPRESSED_DISPLAY]);
+      }
+      if (message.outputLimits) {
+        const { bytesPerSecond, messagesPerSecond, maxBytes } = message.outputLimits;
+        options.push([RunOption.OUTPUT_LIMITS, bytesPerSecond, messagesPerSecond, maxBytes]);
+      }
+      if (options.length > 0) {
+        const optionsSize = options.reduce((size, [, ...values]) => size + 4 + 4 * values.length, 0);
+        entries.push(['u32', RUN_HEADER_MAGIC], ['u16', RUN_HEADER_SIZE + optionsSize]);
+        for (const [optionType, ...values] of options) {
+          entries.push(['u16', optionType], ['u16', 4 * values.length]);
+          for (const value of values) {
+            entries.push(['u32', value]);
+          }
+        }
+      }
+      entries.push(['blob', code]);
       break;
+    }
 
-    case SlingMessageType.RUN:
-      entries.push(['blob', message.code]);
+    case SlingMessageType.RUN_CACHED:
+    case SlingMessageType.CACHE_MISS:
+      entries.push(['blob', message.hash]);
       break;
 
+    case SlingMessageType.EXIT: {
+      const { usage } = message;
+      entries.push(
+        ['u16', exitReasonToId[usage.reason]],
+        ['i32', usage.exitCode],
+        ['u32', usage.wallTime],
+        ['u32', usage.userTime],
+        ['u32', usage.systemTime],
+        ['u32', usage.maxRssKiB],
+        ['u32', usage.minorFaults],
+        ['u32', usage.majorFaults],
+        ['u32', usage.voluntaryContextSwitches],
+        ['u32', usage.involuntaryContextSwitches]
+      );
+      break;
+    }
+
     case SlingMessageType.STATUS:
       entries.push(['u16', slingStatusToId[message.status]]);
       if (message.status === 'prompt') {
@@ -282,6 +720,15 @@ export function serialiseMqttMessage(message: SlingOptionalIdMessage): Buffer |
       entries.push(['u16', displayMessageTypeToId[message.displayType]]);
       if (message.displayType === 'flush') {
         entries.push(['u32', message.startingId]);
+      } else if (message.displayType === 'batch') {
+        entries.push(['u16', message.messages.length]);
+        for (const record of message.messages) {
+          const recordPayload = serialiseMqttMessage(record);
+          if (!recordPayload) {
+            return null;
+          }
+          entries.push(['u16', recordPayload.byteLength], ['blob', recordPayload]);
+        }
       } else {
         entries.push(['u16', displayPayloadTypeToId[message.payloadType]]);
         switch (message.payloadType) {
@@ -289,10 +736,11 @@ export function serialiseMqttMessage(message: SlingOptionalIdMessage): Buffer |
           case 'null':
           case 'function':
             break;
-          // the following 4 cases are duplicated because typescript isn't
+          // the following 3 cases are duplicated because typescript isn't
           // powerful enough to tell it is correct if the cases are together
           case 'boolean':
-            entries.push([message.payloadType, message.value]);
+            // in the same 4 bytes as the other values, as devices lay it out
+            entries.push(['u32', message.value ? 1 : 0]);
             break;
           case 'i32':
             entries.push([message.payloadType, message.value]);
@@ -312,5 +760,9 @@ export function serialiseMqttMessage(message: SlingOptionalIdMessage): Buffer |
     default:
       return null;
   }
+  // the run ID goes at the end, except for run, which carries it in the run header
+  if ('runId' in message && message.runId !== undefined && message.type !== SlingMessageType.RUN) {
+    entries.push(['u32', message.runId]);
+  }
   return serialise(entries);
 }
@@ -0,0 +1,336 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sling_format.h"
+
+static const char digit_pairs[200] = "00010203040506070809"
+                                     "10111213141516171819"
+                                     "20212223242526272829"
+                                     "30313233343536373839"
+                                     "40414243444546474849"
+                                     "50515253545556575859"
+                                     "60616263646566676869"
+                                     "70717273747576777879"
+                                     "80818283848586878889"
+                                     "90919293949596979899";
+
+// Writes the digits of value without a terminator, returning the count
+static size_t format_uint32(uint32_t value, char *out) {
+  char buf[10];
+  char *p = buf + sizeof(buf);
+  while (value >= 100) {
+    const uint32_t pair = value % 100;
+    value /= 100;
+    p -= 2;
+    memcpy(p, digit_pairs + pair * 2, 2);
+  }
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, digit_pairs + value * 2, 2);
+  } else {
+    *--p = '0' + value;
+  }
+  const size_t length = buf + sizeof(buf) - p;
+  memcpy(out, p, length);
+  return length;
+}
+
+size_t sling_format_int32(int32_t value, char *out) {
+  size_t length = 0;
+  uint32_t magnitude = value;
+  if (value < 0) {
+    out[length++] = '-';
+    magnitude = -magnitude;
+  }
+  length += format_uint32(magnitude, out + length);
+  out[length] = '\0';
+  return length;
+}
+
+// Just enough of a bignum for the shortest digits of a float: values reach
+// about 2^180, for the smallest subnormals scaled up by 10^45. Operations take
+// the number of words in use, which is one or two for everyday values
+#define BIG_WORDS 8
+
+struct big {
+  uint32_t words[BIG_WORDS];
+};
+
+static void big_set(struct big *b, uint32_t value, unsigned shift) {
+  memset(b, 0, sizeof(*b));
+  const unsigned word = shift / 32, bit = shift % 32;
+  b->words[word] = value << bit;
+  if (bit && word + 1 < BIG_WORDS) {
+    b->words[word + 1] = value >> (32 - bit);
+  }
+}
+
+static void big_mul_small(struct big *b, uint32_t m, size_t n) {
+  uint64_t carry = 0;
+  for (size_t i = 0; i < n; ++i) {
+    carry += (uint64_t)b->words[i] * m;
+    b->words[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+}
+
+static void big_mul_pow10(struct big *b, unsigned n) {
+  static const uint32_t pow10[] = {1,      10,      100,      1000,      10000,
+                                   100000, 1000000, 10000000, 100000000, 1000000000};
+  for (; n >= 9; n -= 9) {
+    big_mul_small(b, pow10[9], BIG_WORDS);
+  }
+  if (n) {
+    big_mul_small(b, pow10[n], BIG_WORDS);
+  }
+}
+
+static void big_add(struct big *sum, const struct big *a, const struct big *b, size_t n) {
+  uint64_t carry = 0;
+  for (size_t i = 0; i < n; ++i) {
+    carry += (uint64_t)a->words[i] + b->words[i];
+    sum->words[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+}
+
+// a -= b, where a >= b
+static void big_sub(struct big *a, const struct big *b, size_t n) {
+  uint64_t borrow = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t difference = (uint64_t)a->words[i] - b->words[i] - borrow;
+    a->words[i] = (uint32_t)difference;
+    borrow = difference >> 63;
+  }
+}
+
+static int big_cmp(const struct big *a, const struct big *b, size_t n) {
+  for (size_t i = n; i-- > 0;) {
+    if (a->words[i] != b->words[i]) {
+      return a->words[i] < b->words[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+// Whether r + m reaches s, where reaching it exactly counts if inclusive
+static bool big_sum_reaches(const struct big *r, const struct big *m, const struct big *s,
+                            bool inclusive, size_t n) {
+  struct big sum;
+  big_add(&sum, r, m, n);
+  const int cmp = big_cmp(&sum, s, n);
+  return inclusive ? cmp >= 0 : cmp > 0;
+}
+
+static uint64_t big_to_uint64(const struct big *b) {
+  return (uint64_t)b->words[1] << 32 | b->words[0];
+}
+
+static inline bool reaches(uint64_t value, uint64_t limit, bool inclusive) {
+  return inclusive ? value >= limit : value > limit;
+}
+
+// shortest_digits below, from after the scaling, for when everything fits in 64 bits
+static size_t shortest_digits64(uint64_t r, uint64_t s, uint64_t m_plus, uint64_t m_minus,
+                                bool inclusive, int k, char digits[10], int *exponent) {
+  while (reaches(r + m_plus, s, inclusive)) {
+    s *= 10;
+    ++k;
+  }
+  while (!reaches((r + m_plus) * 10, s, inclusive)) {
+    r *= 10;
+    m_plus *= 10;
+    m_minus *= 10;
+    --k;
+  }
+  *exponent = k;
+
+  size_t count = 0;
+  while (true) {
+    r *= 10;
+    m_plus *= 10;
+    m_minus *= 10;
+    int digit = r / s;
+    r %= s;
+
+    const bool low = inclusive ? r <= m_minus : r < m_minus;
+    const bool high = reaches(r + m_plus, s, inclusive);
+    if (!low && !high) {
+      digits[count++] = '0' + digit;
+      continue;
+    }
+    if (low && high) {
+      if (r * 2 > s || (r * 2 == s && (digit & 1))) {
+        ++digit;
+      }
+    } else if (high) {
+      ++digit;
+    }
+    digits[count++] = '0' + digit;
+    return count;
+  }
+}
+
+// Free-format shortest digits (Burger and Dybvig) of a positive finite float.
+// Returns the digit count; the value is 0.digits * 10^*exponent
+static size_t shortest_digits(uint32_t bits, char digits[10], int *exponent) {
+  const uint32_t biased = (bits >> 23) & 0xff;
+  const uint32_t fraction = bits & 0x7fffff;
+  const uint32_t f = biased ? fraction | 0x800000 : fraction;
+  const int e = biased ? (int)biased - 150 : -149;
+  // the gap below a power of 2 is half the gap above it
+  const bool unequal_gaps = fraction == 0 && biased > 1;
+  // round to nearest even reads the boundaries back as this value if f is even
+  const bool inclusive = (f & 1) == 0;
+
+  // value = r / s, and the neighbouring floats are halfway at (r - m_minus) / s and (r + m_plus) / s
+  struct big r, s, m_plus, m_minus;
+  if (e >= 0) {
+    big_set(&r, f, e + (unequal_gaps ? 2 : 1));
+    big_set(&s, unequal_gaps ? 4 : 2, 0);
+    big_set(&m_plus, 1, e + (unequal_gaps ? 1 : 0));
+    big_set(&m_minus, 1, e);
+  } else {
+    big_set(&r, f, unequal_gaps ? 2 : 1);
+    big_set(&s, 1, -e + (unequal_gaps ? 2 : 1));
+    big_set(&m_plus, unequal_gaps ? 2 : 1, 0);
+    big_set(&m_minus, 1, 0);
+  }
+
+  // estimate the exponent from log2(value) * log10(2), then correct it so the first digit is nonzero
+  const int log2_value = e + 31 - __builtin_clz(f);
+  int k = log2_value >= 0 ? ((log2_value * 1233) >> 12) + 1 : -((-log2_value * 1233) >> 12);
+  if (k >= 0) {
+    big_mul_pow10(&s, k);
+  } else {
+    big_mul_pow10(&r, -k);
+    big_mul_pow10(&m_plus, -k);
+    big_mul_pow10(&m_minus, -k);
+  }
+
+  // s is the largest, and may yet grow tenfold as the estimate may be one too
+  // low; r * 10 + m_plus * 10 < s * 20 then still fits in n words
+  size_t n = BIG_WORDS;
+  while (n > 1 && !s.words[n - 1]) {
+    --n;
+  }
+  if (n < BIG_WORDS && s.words[n - 1] >= 0x1000000) {
+    ++n;
+  }
+  if (n <= 2) {
+    return shortest_digits64(big_to_uint64(&r), big_to_uint64(&s), big_to_uint64(&m_plus),
+                             big_to_uint64(&m_minus), inclusive, k, digits, exponent);
+  }
+
+  while (big_sum_reaches(&r, &m_plus, &s, inclusive, n)) {
+    big_mul_small(&s, 10, n);
+    ++k;
+  }
+  while (true) {
+    struct big r10 = r, m_plus10 = m_plus;
+    big_mul_small(&r10, 10, n);
+    big_mul_small(&m_plus10, 10, n);
+    if (big_sum_reaches(&r10, &m_plus10, &s, inclusive, n)) {
+      break;
+    }
+    r = r10;
+    m_plus = m_plus10;
+    big_mul_small(&m_minus, 10, n);
+    --k;
+  }
+  *exponent = k;
+
+  size_t count = 0;
+  while (true) {
+    big_mul_small(&r, 10, n);
+    big_mul_small(&m_plus, 10, n);
+    big_mul_small(&m_minus, 10, n);
+    int digit = 0;
+    while (big_cmp(&r, &s, n) >= 0) {
+      big_sub(&r, &s, n);
+      ++digit;
+    }
+
+    const int low_cmp = big_cmp(&r, &m_minus, n);
+    const bool low = inclusive ? low_cmp <= 0 : low_cmp < 0;
+    const bool high = big_sum_reaches(&r, &m_plus, &s, inclusive, n);
+    if (!low && !high) {
+      digits[count++] = '0' + digit;
+      continue;
+    }
+    if (low && high) {
+      // either digit reads back correctly; take the closer one, or the even one on a tie
+      struct big r2;
+      big_add(&r2, &r, &r, n);
+      const int cmp = big_cmp(&r2, &s, n);
+      if (cmp > 0 || (cmp == 0 && (digit & 1))) {
+        ++digit;
+      }
+    } else if (high) {
+      ++digit;
+    }
+    digits[count++] = '0' + digit;
+    return count;
+  }
+}
+
+size_t sling_format_float(float value, char *out) {
+  if (isnan(value)) {
+    memcpy(out, "NaN", 4);
+    return 3;
+  }
+
+  size_t length = 0;
+  if (signbit(value) && value != 0) {
+    out[length++] = '-';
+    value = -value;
+  }
+  if (isinf(value)) {
+    memcpy(out + length, "Infinity", 9);
+    return length + 8;
+  }
+  if (value <= 0x1p24f && value == (float)(int32_t)value) {
+    // integers are exact, so they need no more digits than they have
+    return length + sling_format_int32((int32_t)value, out + length);
+  }
+
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  char digits[10];
+  int k;
+  const size_t count = shortest_digits(bits, digits, &k);
+
+  // as in ECMAScript's Number::toString
+  if ((int)count <= k && k <= 21) {
+    memcpy(out + length, digits, count);
+    memset(out + length + count, '0', k - count);
+    length += k;
+  } else if (0 < k && k <= 21) {
+    memcpy(out + length, digits, k);
+    out[length + k] = '.';
+    memcpy(out + length + k + 1, digits + k, count - k);
+    length += count + 1;
+  } else if (-6 < k && k <= 0) {
+    out[length++] = '0';
+    out[length++] = '.';
+    memset(out + length, '0', -k);
+    length += -k;
+    memcpy(out + length, digits, count);
+    length += count;
+  } else {
+    out[length++] = digits[0];
+    if (count > 1) {
+      out[length++] = '.';
+      memcpy(out + length, digits + 1, count - 1);
+      length += count - 1;
+    }
+    out[length++] = 'e';
+    out[length++] = k - 1 < 0 ? '-' : '+';
+    length += format_uint32(k - 1 < 0 ? 1 - k : k - 1, out + length);
+  }
+  out[length] = '\0';
+  return length;
+}
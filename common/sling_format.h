@@ -0,0 +1,19 @@
+#ifndef SLING_FORMAT_H
+#define SLING_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Room for any number formatted below, including the null terminator
+#define SLING_FORMAT_NUMBER_MAX 24
+
+// Formats value in decimal into out, which must have room for
+// SLING_FORMAT_NUMBER_MAX bytes. Returns the length, excluding the null terminator.
+size_t sling_format_int32(int32_t value, char *out);
+
+// Formats value as Source (i.e. JavaScript's Number.prototype.toString) would,
+// with the fewest significant digits that read back as the same float. Returns
+// the length, as above.
+size_t sling_format_float(float value, char *out);
+
+#endif
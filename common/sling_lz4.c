@@ -0,0 +1,164 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sling_lz4.h"
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 0xffff
+// The last 5 bytes are always literals, and the last match starts at least 12 bytes before the end
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_FIND_LIMIT 12
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t *write_length(uint8_t *op, size_t length) {
+  for (; length >= 255; length -= 255) {
+    *op++ = 255;
+  }
+  *op++ = length;
+  return op;
+}
+
+// Returns the new output position, or NULL if the sequence would not fit.
+// The last sequence of a block has literals only
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals,
+                               size_t literal_length, size_t offset, size_t match_length, bool last) {
+  const size_t needed = 1 + literal_length + literal_length / 255 + 1 +
+                        (last ? 0 : 2 + match_length / 255 + 1);
+  if (needed > (size_t)(oend - op)) {
+    return NULL;
+  }
+
+  uint8_t *token = op++;
+  *token = (literal_length < 15 ? literal_length : 15) << 4;
+  if (literal_length >= 15) {
+    op = write_length(op, literal_length - 15);
+  }
+  memcpy(op, literals, literal_length);
+  op += literal_length;
+  if (last) {
+    return op;
+  }
+
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  match_length -= LZ4_MIN_MATCH;
+  *token |= match_length < 15 ? match_length : 15;
+  if (match_length >= 15) {
+    op = write_length(op, match_length - 15);
+  }
+  return op;
+}
+
+size_t sling_lz4_compress(const void *src, size_t src_size, void *dst, size_t dst_capacity) {
+  const uint8_t *const base = src;
+  const uint8_t *const end = base + src_size;
+  const uint8_t *ip = base;
+  const uint8_t *anchor = base;
+  uint8_t *op = dst;
+  const uint8_t *const oend = op + dst_capacity;
+
+  if (src_size > LZ4_MATCH_FIND_LIMIT) {
+    // positions are relative to base; a stale or zero entry just fails the comparison
+    uint32_t table[1 << LZ4_HASH_BITS] = {0};
+    const uint8_t *const match_end_limit = end - LZ4_LAST_LITERALS;
+    while (ip + LZ4_MATCH_FIND_LIMIT <= end) {
+      const uint32_t h = hash32(read32(ip));
+      const uint8_t *ref = base + table[h];
+      table[h] = ip - base;
+      if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != read32(ip)) {
+        ++ip;
+        continue;
+      }
+
+      size_t length = LZ4_MIN_MATCH;
+      while (ip + length < match_end_limit && ref[length] == ip[length]) {
+        ++length;
+      }
+      op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, length, false);
+      if (!op) {
+        return 0;
+      }
+      ip += length;
+      anchor = ip;
+    }
+  }
+
+  op = write_sequence(op, oend, anchor, end - anchor, 0, 0, true);
+  return op ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+// Reads the extra length bytes following a token nibble of 15
+static bool read_length(const uint8_t **ip, const uint8_t *iend, size_t *length) {
+  uint8_t b;
+  do {
+    if (*ip >= iend) {
+      return false;
+    }
+    b = *(*ip)++;
+    *length += b;
+  } while (b == 255);
+  return true;
+}
+
+bool sling_lz4_decompress(const void *src, size_t src_size, void *dst, size_t dst_size) {
+  const uint8_t *ip = src;
+  const uint8_t *const iend = ip + src_size;
+  uint8_t *op = dst;
+  uint8_t *const oend = op + dst_size;
+
+  while (ip < iend) {
+    const uint8_t token = *ip++;
+
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && !read_length(&ip, iend, &literal_length)) {
+      return false;
+    }
+    if (literal_length > (size_t)(iend - ip) || literal_length > (size_t)(oend - op)) {
+      return false;
+    }
+    memcpy(op, ip, literal_length);
+    op += literal_length;
+    ip += literal_length;
+    if (ip == iend) {
+      // the last sequence has no match
+      return op == oend;
+    }
+
+    if (iend - ip < 2) {
+      return false;
+    }
+    const size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) {
+      return false;
+    }
+
+    size_t match_length = token & 15;
+    if (match_length == 15 && !read_length(&ip, iend, &match_length)) {
+      return false;
+    }
+    match_length += LZ4_MIN_MATCH;
+    if (match_length > (size_t)(oend - op)) {
+      return false;
+    }
+    // the match may overlap what it produces, so copy byte by byte
+    const uint8_t *ref = op - offset;
+    for (size_t i = 0; i < match_length; ++i) {
+      op[i] = ref[i];
+    }
+    op += match_length;
+  }
+  return false;
+}
@@ -0,0 +1,17 @@
+#ifndef SLING_LZ4_H
+#define SLING_LZ4_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// LZ4 block format (no frame), for compressed run payloads and display bodies.
+// Compression is greedy with a small hash table, trading ratio for speed on
+// small CPUs.
+
+// Returns the compressed size, or 0 if it would not fit in dst_capacity bytes.
+size_t sling_lz4_compress(const void *src, size_t src_size, void *dst, size_t dst_capacity);
+
+// Returns false if src is malformed or does not decompress to exactly dst_size bytes.
+bool sling_lz4_decompress(const void *src, size_t src_size, void *dst, size_t dst_size);
+
+#endif
@@ -6,13 +6,109 @@
 #include <stdio.h>
 
 #define SLING_INTOPIC_RUN "run"
+#define SLING_INTOPIC_RUN_CACHED "run_cached"
 #define SLING_INTOPIC_STOP "stop"
 #define SLING_INTOPIC_PING "ping"
 #define SLING_INTOPIC_INPUT "input"
+#define SLING_INTOPIC_REPLAY "replay"
 
 #define SLING_OUTTOPIC_STATUS "status"
 #define SLING_OUTTOPIC_DISPLAY "display"
 #define SLING_OUTTOPIC_HELLO "hello"
+#define SLING_OUTTOPIC_CACHE_MISS "cache_miss"
+#define SLING_OUTTOPIC_EXIT "exit"
+// Not numbered; the payload is metrics in the Prometheus text format
+#define SLING_OUTTOPIC_METRICS "metrics"
+// Not numbered; the message number field holds the oldest message number still kept
+#define SLING_OUTTOPIC_REPLAY_GAP "replay_gap"
+
+// SHA-256 of the program
+#define SLING_PROGRAM_HASH_SIZE 32
+
+enum sling_capability {
+  sling_capability_program_cache = 1 << 0,
+  sling_capability_concurrent_runs = 1 << 1,
+  sling_capability_compression = 1 << 2,
+  sling_capability_replay = 1 << 3
+};
+
+// A run ID, for devices with sling_capability_concurrent_runs, trails status,
+// display and cache_miss messages, and may trail run_cached and stop messages
+typedef uint32_t sling_run_id_t;
+
+// "SLRH"; a run payload starting with this has a run header before the program
+#define SLING_RUN_HEADER_MAGIC 0x48524c53
+
+struct __attribute__((packed)) sling_run_header {
+  uint32_t magic;
+  // Including the magic and this field; the program starts at this offset
+  uint16_t header_size;
+  // sling_run_option records until header_size
+  unsigned char options[];
+};
+_Static_assert(sizeof(struct sling_run_header) == 6, "Wrong sling_run_header size");
+
+enum sling_run_option_type {
+  sling_run_option_run_id = 1,
+  sling_run_option_heap_size = 2,
+  // The program is LZ4-compressed; the value is its size once decompressed
+  sling_run_option_compressed_program = 3,
+  // No value; the client can read compressed display bodies for this run
+  sling_run_option_accept_compressed_display = 4,
+  // sling_run_option_output_limits
+  sling_run_option_output_limits = 5
+};
+
+struct __attribute__((packed)) sling_run_option {
+  uint16_t type;
+  // Of value only
+  uint16_t length;
+  unsigned char value[];
+};
+_Static_assert(sizeof(struct sling_run_option) == 4, "Wrong sling_run_option size");
+
+// Limits on the standard output of a run, which may only be stricter than the
+// device's own. 0 leaves the device's limit as it is
+struct __attribute__((packed)) sling_run_option_output_limits {
+  uint32_t bytes_per_second;
+  uint32_t messages_per_second;
+  uint32_t max_bytes;
+};
+_Static_assert(sizeof(struct sling_run_option_output_limits) == 12,
+               "Wrong sling_run_option_output_limits size");
+
+struct __attribute__((packed)) sling_message_hello {
+  uint32_t message_counter;
+  uint32_t nonce;
+  uint32_t capabilities;
+};
+_Static_assert(sizeof(struct sling_message_hello) == 12, "Wrong sling_message_hello size");
+
+// Asks the device to publish its messages again, from starting_id on
+struct __attribute__((packed)) sling_message_replay {
+  uint32_t message_counter;
+  // Of the hello the client last saw
+  uint32_t nonce;
+  uint32_t starting_id;
+};
+_Static_assert(sizeof(struct sling_message_replay) == 12, "Wrong sling_message_replay size");
+
+struct __attribute__((packed)) sling_message_replay_gap {
+  uint32_t oldest_id;
+};
+_Static_assert(sizeof(struct sling_message_replay_gap) == 4, "Wrong sling_message_replay_gap size");
+
+struct __attribute__((packed)) sling_message_run_cached {
+  uint32_t message_counter;
+  uint8_t program_hash[SLING_PROGRAM_HASH_SIZE];
+};
+_Static_assert(sizeof(struct sling_message_run_cached) == 36, "Wrong sling_message_run_cached size");
+
+struct __attribute__((packed)) sling_message_cache_miss {
+  uint32_t message_counter;
+  uint8_t program_hash[SLING_PROGRAM_HASH_SIZE];
+};
+_Static_assert(sizeof(struct sling_message_cache_miss) == 36, "Wrong sling_message_cache_miss size");
 
 enum sling_message_status_type {
   sling_message_status_type_idle = 0,
@@ -35,12 +131,42 @@ struct __attribute__((packed)) sling_message_status_prompt {
 };
 _Static_assert(sizeof(struct sling_message_status_prompt) == 10, "Wrong sling_message_status_prompt size");
 
+enum sling_exit_reason {
+  sling_exit_reason_finished = 0,
+  sling_exit_reason_stopped = 1,
+  sling_exit_reason_crashed = 2,
+  sling_exit_reason_time_limit = 3,
+  sling_exit_reason_cpu_limit = 4,
+  sling_exit_reason_memory_limit = 5,
+  sling_exit_reason_output_limit = 6
+};
+
+// What a run cost, sent when its host exits. Times saturate at UINT32_MAX
+struct __attribute__((packed)) sling_message_exit {
+  uint32_t message_counter;
+  uint16_t reason;
+  // Exit status if the host exited, or the negated number of the signal that killed it
+  int32_t exit_code;
+  uint32_t wall_time_us;
+  uint32_t user_time_us;
+  uint32_t system_time_us;
+  uint32_t max_rss_kib;
+  uint32_t minor_faults;
+  uint32_t major_faults;
+  uint32_t voluntary_context_switches;
+  uint32_t involuntary_context_switches;
+};
+_Static_assert(sizeof(struct sling_message_exit) == 42, "Wrong sling_message_exit size");
+
 enum sling_message_display_type {
   sling_message_display_type_output = 0,
   sling_message_display_type_error = 1,
   sling_message_display_type_result = 2,
+  // Sinter host to daemon only: the program wants input, and the string is the prompt
+  sling_message_display_type_prompt = 3,
   sling_message_display_type_prompt_response = 4,
   sling_message_display_type_flush = 100,
+  sling_message_display_type_batch = 101,
   sling_message_display_type_self_flushing = 0x100
 };
 
@@ -52,6 +178,18 @@ struct __attribute__((packed)) sling_message_display_flush {
 _Static_assert(sizeof(struct sling_message_display_flush) == 10,
                "Wrong sling_message_display_flush size");
 
+// Several consecutive display messages in one publish. The message counter is
+// that of the first record; each record is a u16 length followed by a complete
+// display message (including its own message counter)
+struct __attribute__((packed)) sling_message_display_batch {
+  uint32_t message_counter;
+  uint16_t message_type;
+  uint16_t record_count;
+  unsigned char records[];
+};
+_Static_assert(sizeof(struct sling_message_display_batch) == 8,
+               "Wrong sling_message_display_batch size");
+
 struct __attribute__((packed)) sling_message_display {
   uint32_t message_counter;
   uint16_t display_type;
@@ -67,6 +205,26 @@ struct __attribute__((packed)) sling_message_display {
 };
 _Static_assert(sizeof(struct sling_message_display) == 12, "Wrong sling_message_display size");
 
+// Display data types with a string body, as in sinter_type_t
+#define SLING_DISPLAY_DATA_STRING 6
+#define SLING_DISPLAY_DATA_ARRAY 7
+
+// Set in data_type for string and array bodies sent LZ4-compressed, to runs that
+// accept it. The body is not null-terminated
+#define SLING_DISPLAY_DATA_COMPRESSED 0x80
+
+struct __attribute__((packed)) sling_message_display_compressed {
+  uint32_t message_counter;
+  uint16_t display_type;
+  uint16_t data_type;
+  // Once decompressed, excluding null terminator
+  uint32_t string_length;
+  uint32_t compressed_length;
+  unsigned char data[];
+};
+_Static_assert(sizeof(struct sling_message_display_compressed) == 16,
+               "Wrong sling_message_display_compressed size");
+
 static inline char *sling_topic(const char *device_id, const char *topic) {
   char *ret = NULL;
   if (asprintf(&ret, "%s/%s", device_id, topic) == -1) {
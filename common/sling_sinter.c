@@ -7,41 +7,61 @@
 #include "sling_message.h"
 #include "sling_sinter.h"
 
-struct sling_message_display *sling_sinter_value_to_message(sinter_value_t *value, size_t *message_size) {
-  // TODO handle array
-  const size_t extra_size = value->type == sinter_type_string ? strlen(value->string_value) + 1 : 0;
-  const size_t message_len = sizeof(struct sling_message_display) + extra_size;
-  struct sling_message_display *payload = malloc(message_len);
-  if (!payload) {
-    return payload;
-  }
+void sling_sinter_string_to_header(const char *string, size_t length,
+                                   struct sling_message_display *header, const char **body,
+                                   size_t *body_size) {
+  header->data_type = sinter_type_string;
+  header->string_length = length;
+  *body = string;
+  *body_size = length + 1;
+}
 
-  payload->data_type = value->type;
+void sling_sinter_value_to_header(sinter_value_t *value, struct sling_message_display *header,
+                                  const char **body, size_t *body_size) {
+  header->data_type = value->type;
+  *body = NULL;
+  *body_size = 0;
 
   switch (value->type) {
   case sinter_type_boolean:
-    payload->boolean = value->boolean_value;
+    header->boolean = value->boolean_value;
     break;
   case sinter_type_integer:
-    payload->int32 = value->integer_value;
+    header->int32 = value->integer_value;
     break;
   case sinter_type_float:
-    payload->float32 = value->float_value;
+    header->float32 = value->float_value;
     break;
-  case sinter_type_string: {
-    payload->string_length = extra_size - 1;
-    memcpy(&payload->string, value->string_value, extra_size);
-    break;
-  }
-  case sinter_type_array:
-    // TODO
+  case sinter_type_string:
+    sling_sinter_string_to_header(value->string_value, strlen(value->string_value), header, body,
+                                  body_size);
     break;
   case sinter_type_null:
   case sinter_type_undefined:
   case sinter_type_function:
+  case sinter_type_array:
   default:
+    // arrays have no fixed-size encoding; sinter_host streams them as strings instead
     break;
   }
+}
+
+struct sling_message_display *sling_sinter_value_to_message(sinter_value_t *value, size_t *message_size) {
+  struct sling_message_display header = {0};
+  const char *body = NULL;
+  size_t body_size = 0;
+  sling_sinter_value_to_header(value, &header, &body, &body_size);
+
+  const size_t message_len = sizeof(struct sling_message_display) + body_size;
+  struct sling_message_display *payload = malloc(message_len);
+  if (!payload) {
+    return payload;
+  }
+
+  memcpy(payload, &header, sizeof(header));
+  if (body_size) {
+    memcpy(&payload->string, body, body_size);
+  }
 
   if (message_size) {
     *message_size = message_len;
@@ -7,4 +7,16 @@
 
 struct sling_message_display *sling_sinter_value_to_message(sinter_value_t *value, size_t *message_size);
 
+// Encodes value into header without allocating. For strings, the string body
+// (including the null terminator) is not copied; *body and *body_size are set
+// so the caller can send it after the header, e.g. with scatter/gather I/O.
+// For other types, *body_size is set to 0.
+void sling_sinter_value_to_header(sinter_value_t *value, struct sling_message_display *header,
+                                  const char **body, size_t *body_size);
+
+// As above, for a string whose length (excluding null terminator) is already known.
+void sling_sinter_string_to_header(const char *string, size_t length,
+                                   struct sling_message_display *header, const char **body,
+                                   size_t *body_size);
+
 #endif
@@ -0,0 +1,7 @@
+function integrate(x, dx, end, acc) {
+  return x >= end
+    ? acc
+    : integrate(x + dx, dx, end, acc + math_sqrt(x) * math_sin(x) * dx + math_pow(x, 1.5) / 1000);
+}
+
+integrate(0, 0.001, 20, 0);
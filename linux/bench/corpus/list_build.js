@@ -0,0 +1,17 @@
+function build(n, xs) {
+  return n === 0 ? xs : build(n - 1, pair(n, xs));
+}
+
+function reverse_onto(xs, ys) {
+  return is_null(xs) ? ys : reverse_onto(tail(xs), pair(head(xs), ys));
+}
+
+function sum(xs, acc) {
+  return is_null(xs) ? acc : sum(tail(xs), acc + head(xs));
+}
+
+function repeat(k, acc) {
+  return k === 0 ? acc : repeat(k - 1, acc + sum(reverse_onto(build(2000, null), null), 0));
+}
+
+repeat(20, 0);
@@ -0,0 +1,6 @@
+function build(i, acc) {
+  return i === 0 ? acc : build(i - 1, pair(i, acc));
+}
+
+// the result is rendered and sent in fragments as it is walked
+build(100000, null);
@@ -0,0 +1,13 @@
+function print_numbers(i, n, x) {
+  if (i < n) {
+    display(i);
+    display(x);
+    display(x * 1e12);
+    display([i, x]);
+    return print_numbers(i + 1, n, x + 0.1);
+  } else {
+    return x;
+  }
+}
+
+print_numbers(0, 500, 0);
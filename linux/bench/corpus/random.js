@@ -0,0 +1,11 @@
+function estimate_pi(n, inside, i) {
+  if (i === n) {
+    return 4 * inside / n;
+  } else {
+    const x = math_random();
+    const y = math_random();
+    return estimate_pi(n, x * x + y * y <= 1 ? inside + 1 : inside, i + 1);
+  }
+}
+
+estimate_pi(20000, 0, 0);
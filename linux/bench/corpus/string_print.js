@@ -0,0 +1,16 @@
+function grow(s, n) {
+  return n === 0 ? s : grow(s + "ab", n - 1);
+}
+
+function print_lines(i, n, s) {
+  if (i < n) {
+    display(s);
+    display("line");
+    display(i);
+    return print_lines(i + 1, n, s);
+  } else {
+    return s;
+  }
+}
+
+print_lines(0, 500, grow("", 40));
@@ -0,0 +1,99 @@
+// Measures how many display messages per second sinter_host can encode and
+// hand to the kernel, comparing the malloc-per-message encoding against the
+// allocation-free header + scatter/gather encoding.
+//
+// Usage: display_encode_bench [message count] [string length]
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sinter.h>
+
+#include "../../common/sling_sinter.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check_write(ssize_t res) {
+  if (res == -1) {
+    perror("writev");
+    exit(1);
+  }
+}
+
+static void encode_malloc(int fd, sinter_value_t *value) {
+  size_t message_size = 0;
+  struct sling_message_display *message = sling_sinter_value_to_message(value, &message_size);
+  if (!message) {
+    fputs("malloc failed\n", stderr);
+    exit(1);
+  }
+  message->display_type = sling_message_display_type_output;
+  struct iovec iov = {.iov_base = message, .iov_len = message_size};
+  check_write(writev(fd, &iov, 1));
+  free(message);
+}
+
+static void encode_header(int fd, sinter_value_t *value) {
+  struct sling_message_display header = {0};
+  const char *body = NULL;
+  size_t body_size = 0;
+  sling_sinter_value_to_header(value, &header, &body, &body_size);
+  header.display_type = sling_message_display_type_output;
+  struct iovec iov[2] = {{.iov_base = &header, .iov_len = sizeof(header)},
+                         {.iov_base = (char *)body, .iov_len = body_size}};
+  check_write(writev(fd, iov, body_size ? 2 : 1));
+}
+
+static void run(const char *name, void (*encode)(int, sinter_value_t *), int fd,
+                unsigned long count, const char *string) {
+  sinter_value_t values[] = {
+      {.type = sinter_type_string, .string_value = string},
+      {.type = sinter_type_integer, .integer_value = 42},
+      {.type = sinter_type_float, .float_value = 0.5f},
+  };
+  const size_t value_count = sizeof(values) / sizeof(*values);
+
+  const double start = now();
+  for (unsigned long i = 0; i < count; ++i) {
+    encode(fd, &values[i % value_count]);
+  }
+  const double elapsed = now() - start;
+  printf("%-8s %10lu messages in %.3f s: %12.0f messages/s\n", name, count, elapsed,
+         count / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+  const unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 0) : 5000000;
+  const size_t string_length = argc > 2 ? strtoul(argv[2], NULL, 0) : 16;
+
+  char *string = malloc(string_length + 1);
+  if (!string) {
+    return 1;
+  }
+  memset(string, 'x', string_length);
+  string[string_length] = '\0';
+
+  // the kernel side of the send is as cheap as it gets, so the encoding dominates
+  int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror("open");
+    return 1;
+  }
+
+  run("malloc", encode_malloc, fd, count, string);
+  run("header", encode_header, fd, count, string);
+
+  close(fd);
+  free(string);
+  return 0;
+}
@@ -0,0 +1,112 @@
+// Measures how many numbers per second sinter_host can print into its display
+// buffer, comparing vsnprintf (with a second vsnprintf when the buffer fills up)
+// against the sling_format formatters. Full buffers are written to /dev/null,
+// as fragments would be sent to the daemon.
+//
+// Usage: format_bench [print count]
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../common/sling_format.h"
+#include "../src/common.h"
+
+static char display_buf[IPC_DISPLAY_BUF_SIZE];
+static size_t display_buf_index = 0;
+static int fd = -1;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void send_fragment(void) {
+  if (write(fd, display_buf, display_buf_index) == -1) {
+    perror("write");
+    exit(1);
+  }
+  display_buf_index = 0;
+}
+
+__attribute__((format(printf, 1, 2))) static void printf_buf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  const size_t can_write = sizeof(display_buf) - display_buf_index;
+  int written = vsnprintf(display_buf + display_buf_index, can_write, format, args);
+  va_end(args);
+  if (written >= 0 && (size_t)written < can_write) {
+    display_buf_index += written;
+    return;
+  }
+
+  send_fragment();
+  va_start(args, format);
+  display_buf_index += vsnprintf(display_buf, sizeof(display_buf), format, args);
+  va_end(args);
+}
+
+static char *reserve_display_buf(size_t size) {
+  if (sizeof(display_buf) - display_buf_index < size) {
+    send_fragment();
+  }
+  return display_buf + display_buf_index;
+}
+
+static void print_int_printf(int32_t value) { printf_buf("%d", value); }
+
+static void print_int_format(int32_t value) {
+  display_buf_index += sling_format_int32(value, reserve_display_buf(SLING_FORMAT_NUMBER_MAX));
+}
+
+static void print_float_printf(float value) { printf_buf("%f", value); }
+
+static void print_float_format(float value) {
+  display_buf_index += sling_format_float(value, reserve_display_buf(SLING_FORMAT_NUMBER_MAX));
+}
+
+static void run_int(const char *name, void (*print)(int32_t), unsigned long count) {
+  display_buf_index = 0;
+  const double start = now();
+  for (unsigned long i = 0; i < count; ++i) {
+    // a mix of small and large magnitudes, both signs
+    print((int32_t)(i * 2654435761u) >> (i % 24));
+  }
+  const double elapsed = now() - start;
+  printf("%-14s %10lu prints in %.3f s: %12.0f prints/s\n", name, count, elapsed, count / elapsed);
+}
+
+static void run_float(const char *name, void (*print)(float), unsigned long count) {
+  display_buf_index = 0;
+  const double start = now();
+  for (unsigned long i = 0; i < count; ++i) {
+    // typical results of arithmetic on small values, plus the odd large one
+    print((float)(i % 1000) / 7.0f * (i % 64 == 0 ? 1e12f : 1.0f));
+  }
+  const double elapsed = now() - start;
+  printf("%-14s %10lu prints in %.3f s: %12.0f prints/s\n", name, count, elapsed, count / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+  const unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 0) : 5000000;
+
+  fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror("open");
+    return 1;
+  }
+
+  run_int("int printf", print_int_printf, count);
+  run_int("int format", print_int_format, count);
+  run_float("float printf", print_float_printf, count);
+  run_float("float format", print_float_format, count);
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,10 @@
+function print_from(i, n) {
+  if (i < n) {
+    display(i);
+    return print_from(i + 1, n);
+  } else {
+    return n;
+  }
+}
+
+print_from(0, 2000);
@@ -0,0 +1,6 @@
+function ask(i, answers) {
+  return i === 0 ? answers : ask(i - 1, answers + prompt("Next?"));
+}
+
+// sling_loadgen answers each prompt, so every run makes the round trip three times
+ask(3, "");
@@ -0,0 +1,5 @@
+function spin(i) {
+  return spin(i + 1);
+}
+
+spin(0);
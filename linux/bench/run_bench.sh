@@ -0,0 +1,113 @@
+#!/bin/bash
+# End-to-end benchmark: starts a local broker and Sling daemons, drives them
+# with sling_loadgen, and appends one line of JSON per workload to the output.
+#
+# Usage: run_bench.sh <mosquitto> <sling> <sinter_host> <sling_loadgen>
+#
+# Tunables, from the environment:
+#   BENCH_DEVICES      Number of devices to serve; defaults to 1
+#   BENCH_SHARED       Set to 1 to serve them all from one daemon, rather than a daemon each
+#   BENCH_MAX_RUNS     --max-runs for each daemon; defaults to 1
+#   BENCH_CONCURRENCY  Runs in progress at once per device; defaults to BENCH_MAX_RUNS
+#   BENCH_COUNT        Runs or pings per workload; defaults to 200
+#   BENCH_PORT         Port for the broker; defaults to 18830
+#   BENCH_OUTPUT       File to append results to; defaults to bench_results.jsonl
+#   BENCH_LABEL        Included in each result, to tell runs apart
+#   BENCH_SVM_DIR      Directory of precompiled programs; otherwise they are compiled with SVMC
+#   SVMC               The SVML compiler from js-slang; defaults to svmc
+#   SLING_ARGS         Extra arguments for each daemon
+
+fatal_error() {
+  >&2 echo $1
+  exit 1
+}
+
+if [ $# -ne 4 ]; then
+  fatal_error "Usage: $0 <mosquitto> <sling> <sinter_host> <sling_loadgen>"
+fi
+
+MOSQUITTO="$1"
+SLING="$2"
+SINTER_HOST="$3"
+LOADGEN="$4"
+
+BENCH_DIR="$(cd "$(dirname "$0")" && pwd)"
+BENCH_DEVICES="${BENCH_DEVICES:-1}"
+BENCH_SHARED="${BENCH_SHARED:-0}"
+BENCH_MAX_RUNS="${BENCH_MAX_RUNS:-1}"
+BENCH_CONCURRENCY="${BENCH_CONCURRENCY:-$BENCH_MAX_RUNS}"
+BENCH_COUNT="${BENCH_COUNT:-200}"
+BENCH_PORT="${BENCH_PORT:-18830}"
+BENCH_OUTPUT="${BENCH_OUTPUT:-bench_results.jsonl}"
+BENCH_LABEL="${BENCH_LABEL:-}"
+SVMC="${SVMC:-svmc}"
+
+WORK_DIR="$(mktemp -d)"
+PIDS=()
+
+cleanup() {
+  for pid in "${PIDS[@]}"; do
+    kill "$pid" 2>/dev/null
+  done
+  wait 2>/dev/null
+  rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# programs
+for program in trivial print prompt spin; do
+  if [ -n "$BENCH_SVM_DIR" ]; then
+    cp "$BENCH_SVM_DIR/$program.svm" "$WORK_DIR/$program.svm" || fatal_error "Missing $BENCH_SVM_DIR/$program.svm"
+  else
+    "$SVMC" -o "$WORK_DIR/$program.svm" "$BENCH_DIR/programs/$program.js" > /dev/null ||
+      fatal_error "Failed to compile $program.js; set SVMC, or BENCH_SVM_DIR to precompiled programs"
+  fi
+done
+
+# broker
+cat > "$WORK_DIR/mosquitto.conf" <<CONF
+listener $BENCH_PORT 127.0.0.1
+allow_anonymous true
+persistence false
+max_inflight_messages 0
+max_queued_messages 0
+CONF
+"$MOSQUITTO" -c "$WORK_DIR/mosquitto.conf" > "$WORK_DIR/mosquitto.log" 2>&1 &
+PIDS+=($!)
+sleep 0.5
+kill -0 "${PIDS[0]}" 2>/dev/null || fatal_error "Broker failed to start: $(cat "$WORK_DIR/mosquitto.log")"
+
+# daemons
+DEVICE_IDS=()
+for ((i = 0; i < BENCH_DEVICES; ++i)); do
+  device_id="bench-$$-$i"
+  DEVICE_IDS+=("$device_id")
+  if [ "$BENCH_SHARED" = 1 ]; then
+    echo "$device_id" >> "$WORK_DIR/devices"
+    continue
+  fi
+  "$SLING" --no-tls -h 127.0.0.1 -p "$BENCH_PORT" -i "$device_id" -H "$SINTER_HOST" \
+    -m "$BENCH_MAX_RUNS" $SLING_ARGS > "$WORK_DIR/sling-$i.log" 2>&1 &
+  PIDS+=($!)
+done
+if [ "$BENCH_SHARED" = 1 ]; then
+  "$SLING" --no-tls -h 127.0.0.1 -p "$BENCH_PORT" -d "$WORK_DIR/devices" -H "$SINTER_HOST" \
+    -m "$BENCH_MAX_RUNS" $SLING_ARGS > "$WORK_DIR/sling.log" 2>&1 &
+  PIDS+=($!)
+fi
+
+run_workload() {
+  local workload="$1"
+  local program="$2"
+  local args=(-h 127.0.0.1 -p "$BENCH_PORT" -w "$workload" -n "$BENCH_COUNT" -c "$BENCH_CONCURRENCY" -l "$BENCH_LABEL")
+  if [ -n "$program" ]; then
+    args+=(-f "$WORK_DIR/$program.svm")
+  fi
+  "$LOADGEN" "${args[@]}" "${DEVICE_IDS[@]}" | tee -a "$BENCH_OUTPUT"
+}
+
+run_workload ping
+run_workload run trivial
+run_workload run print
+run_workload run prompt
+run_workload stop spin
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Runs every program in bench/corpus through sinter_host --bench, printing one
+# line of JSON per program.
+#
+# Usage: run_corpus.sh <sinter_host>
+#
+# Tunables, from the environment:
+#   BENCH_ITERATIONS  Runs of each program; defaults to 100
+#   BENCH_OUTPUT      File to append results to; defaults to corpus_results.jsonl
+#   BENCH_HEAP_SIZE   Sinter heap in bytes for each run; defaults to the host's own
+#   BENCH_SVM_DIR     Directory of precompiled programs; otherwise they are compiled with SVMC
+#   SVMC              The SVML compiler from js-slang; defaults to svmc
+
+fatal_error() {
+  >&2 echo $1
+  exit 1
+}
+
+if [ $# -ne 1 ]; then
+  fatal_error "Usage: $0 <sinter_host>"
+fi
+
+SINTER_HOST="$1"
+BENCH_DIR="$(cd "$(dirname "$0")" && pwd)"
+BENCH_ITERATIONS="${BENCH_ITERATIONS:-100}"
+BENCH_OUTPUT="${BENCH_OUTPUT:-corpus_results.jsonl}"
+SVMC="${SVMC:-svmc}"
+
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+set -o pipefail
+status=0
+for source in "$BENCH_DIR"/corpus/*.js; do
+  program="$(basename "$source" .js)"
+  if [ -n "$BENCH_SVM_DIR" ]; then
+    cp "$BENCH_SVM_DIR/$program.svm" "$WORK_DIR/$program.svm" || fatal_error "Missing $BENCH_SVM_DIR/$program.svm"
+  else
+    "$SVMC" -o "$WORK_DIR/$program.svm" "$source" > /dev/null ||
+      fatal_error "Failed to compile $program.js; set SVMC, or BENCH_SVM_DIR to precompiled programs"
+  fi
+  "$SINTER_HOST" --bench "$BENCH_ITERATIONS" ${BENCH_HEAP_SIZE:+--heap-size "$BENCH_HEAP_SIZE"} "$WORK_DIR/$program.svm" | tee -a "$BENCH_OUTPUT" || status=1
+done
+exit $status
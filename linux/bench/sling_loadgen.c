@@ -0,0 +1,576 @@
+// Load generator for Sling daemons. Connects to an MQTT broker, drives one or
+// more devices with a workload, and prints the results as one line of JSON.
+//
+// Workloads:
+//   run    Run the program repeatedly, timing each run until the device is idle again
+//   stop   Run the program (which should not finish by itself), stop it once it is
+//          running, and time the stop
+//   ping   Ping the device repeatedly, timing each status reply
+//
+// Use a print-heavy program with the run workload to measure display delivery.
+// Runs that ask for input are answered straight away.
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+
+#include "../../common/sling_message.h"
+
+#define MAX_DEVICES 64
+#define MAX_CONCURRENCY 64
+
+enum workload {
+  workload_run,
+  workload_stop,
+  workload_ping
+};
+
+struct bench_run {
+  bool active;
+  sling_run_id_t id;
+  double sent_at;
+  double stop_sent_at;
+  double last_display_at;
+  bool seen_running;
+  bool seen_output;
+  bool seen_result;
+};
+
+struct bench_device {
+  const char *id;
+  char *topic_run;
+  char *topic_stop;
+  char *topic_ping;
+  char *topic_input;
+  bool ready;
+  bool ping_pending;
+  double ping_sent_at;
+  struct bench_run runs[MAX_CONCURRENCY];
+  size_t active_runs;
+};
+
+struct samples {
+  double *values;
+  size_t count;
+  size_t capacity;
+};
+
+static struct {
+  enum workload workload;
+  const char *workload_name;
+  struct bench_device devices[MAX_DEVICES];
+  size_t device_count;
+  size_t concurrency;
+  unsigned long total;
+  unsigned long started;
+  unsigned long completed;
+  unsigned long errors;
+  unsigned long prompts;
+  char *program;
+  size_t program_size;
+  uint32_t next_message_id;
+
+  struct samples first_output;
+  struct samples result;
+  struct samples complete;
+  struct samples stop;
+  struct samples ping;
+  struct samples display_gap;
+  unsigned long display_messages;
+  unsigned long display_bytes;
+  double first_display_at;
+  double last_display_at;
+} bench;
+
+static struct mosquitto *mosq;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sample(struct samples *s, double value) {
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 256;
+    s->values = realloc(s->values, s->capacity * sizeof(*s->values));
+    if (!s->values) {
+      fputs("Out of memory\n", stderr);
+      exit(1);
+    }
+  }
+  s->values[s->count++] = value;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static void print_samples(const char *name, struct samples *s) {
+  if (s->count == 0) {
+    printf(",\"%s\":null", name);
+    return;
+  }
+  qsort(s->values, s->count, sizeof(*s->values), compare_doubles);
+  double sum = 0;
+  for (size_t i = 0; i < s->count; ++i) {
+    sum += s->values[i];
+  }
+  // nearest-rank percentiles, in microseconds
+  printf(",\"%s\":{\"count\":%zu,\"mean\":%.0f,\"p50\":%.0f,\"p99\":%.0f,\"max\":%.0f}", name, s->count,
+         sum / s->count * 1e6, s->values[(s->count - 1) / 2] * 1e6, s->values[(s->count * 99 - 1) / 100] * 1e6,
+         s->values[s->count - 1] * 1e6);
+}
+
+static void publish(const char *topic, const void *payload, size_t size) {
+  int res = mosquitto_publish(mosq, NULL, topic, size, payload, 1, false);
+  if (res != MOSQ_ERR_SUCCESS) {
+    fprintf(stderr, "Publish failed: %s\n", mosquitto_strerror(res));
+    exit(1);
+  }
+}
+
+static struct bench_device *find_device(const char *topic, const char **type) {
+  for (size_t i = 0; i < bench.device_count; ++i) {
+    const size_t length = strlen(bench.devices[i].id);
+    if (!strncmp(topic, bench.devices[i].id, length) && topic[length] == '/') {
+      *type = topic + length + 1;
+      return bench.devices + i;
+    }
+  }
+  return NULL;
+}
+
+// Runs are matched by run ID if the device sends one, or else by being the only one
+static struct bench_run *find_run(struct bench_device *device, const sling_run_id_t *run_id) {
+  for (size_t i = 0; i < bench.concurrency; ++i) {
+    struct bench_run *run = device->runs + i;
+    if (run->active && (!run_id || run->id == *run_id)) {
+      return run;
+    }
+  }
+  return NULL;
+}
+
+static bool read_run_id(const unsigned char *payload, size_t size, size_t offset, sling_run_id_t *run_id) {
+  if (size < offset + sizeof(*run_id)) {
+    return false;
+  }
+  memcpy(run_id, payload + offset, sizeof(*run_id));
+  return true;
+}
+
+static void start_run(struct bench_device *device) {
+  struct bench_run *run = NULL;
+  for (size_t i = 0; i < bench.concurrency && !run; ++i) {
+    if (!device->runs[i].active) {
+      run = device->runs + i;
+    }
+  }
+
+  *run = (struct bench_run){.active = true, .id = bench.next_message_id++, .sent_at = now()};
+  ++device->active_runs;
+  ++bench.started;
+
+  // the run ID defaults to the message number of the run message
+  memcpy(bench.program, &run->id, sizeof(run->id));
+  publish(device->topic_run, bench.program, bench.program_size);
+}
+
+static void finish_run(struct bench_device *device, struct bench_run *run) {
+  const double t = now();
+  if (run->seen_running || run->seen_output) {
+    sample(&bench.complete, t - run->sent_at);
+    if (run->stop_sent_at) {
+      sample(&bench.stop, t - run->stop_sent_at);
+    }
+  } else {
+    // the device turned it away
+    ++bench.errors;
+  }
+  run->active = false;
+  --device->active_runs;
+  ++bench.completed;
+}
+
+static void answer_prompt(struct bench_device *device, const struct bench_run *run) {
+  static const char response[] = "1";
+  unsigned char payload[sizeof(struct sling_message_display) + sizeof(response) + sizeof(sling_run_id_t)];
+  struct sling_message_display *input = (struct sling_message_display *) payload;
+  input->message_counter = bench.next_message_id++;
+  input->display_type = sling_message_display_type_prompt_response;
+  input->data_type = SLING_DISPLAY_DATA_STRING;
+  input->string_length = sizeof(response) - 1;
+  memcpy(input->string, response, sizeof(response));
+  memcpy(input->string + sizeof(response), &run->id, sizeof(run->id));
+  ++bench.prompts;
+  publish(device->topic_input, payload, bench.concurrency > 1 ? sizeof(payload) : sizeof(payload) - sizeof(run->id));
+}
+
+static void handle_status(struct bench_device *device, const unsigned char *payload, size_t size) {
+  if (size < sizeof(struct sling_message_status)) {
+    return;
+  }
+  uint16_t status;
+  memcpy(&status, payload + 4, sizeof(status));
+  // for a prompt, the run ID follows the prompt string
+  size_t run_id_offset = sizeof(struct sling_message_status);
+  if (status == sling_message_status_type_prompt) {
+    uint32_t prompt_length;
+    if (size < sizeof(struct sling_message_status_prompt)) {
+      return;
+    }
+    memcpy(&prompt_length, payload + 6, sizeof(prompt_length));
+    run_id_offset = sizeof(struct sling_message_status_prompt) + (size_t) prompt_length + 1;
+  }
+  sling_run_id_t run_id;
+  const bool has_run_id = read_run_id(payload, size, run_id_offset, &run_id);
+
+  if (!has_run_id && device->ping_pending) {
+    device->ping_pending = false;
+    if (device->ready) {
+      sample(&bench.ping, now() - device->ping_sent_at);
+      ++bench.completed;
+    }
+    device->ready = true;
+    return;
+  }
+
+  struct bench_run *run = find_run(device, has_run_id ? &run_id : NULL);
+  if (!run) {
+    return;
+  }
+  if (status != sling_message_status_type_idle) {
+    if (!run->seen_running && bench.workload == workload_stop) {
+      sling_run_id_t stop[2] = {bench.next_message_id++, run->id};
+      run->stop_sent_at = now();
+      publish(device->topic_stop, stop, bench.concurrency > 1 ? sizeof(stop) : sizeof(stop[0]));
+    }
+    run->seen_running = true;
+    if (status == sling_message_status_type_prompt) {
+      answer_prompt(device, run);
+    }
+  } else {
+    finish_run(device, run);
+  }
+}
+
+static void handle_display(struct bench_device *device, const unsigned char *payload, size_t size) {
+  if (size < sizeof(struct sling_message_display_flush)) {
+    return;
+  }
+
+  uint16_t display_type;
+  memcpy(&display_type, payload + 4, sizeof(display_type));
+  if (display_type == sling_message_display_type_batch) {
+    uint16_t record_count;
+    memcpy(&record_count, payload + 6, sizeof(record_count));
+    size_t offset = sizeof(struct sling_message_display_batch);
+    for (uint16_t i = 0; i < record_count && offset + sizeof(uint16_t) <= size; ++i) {
+      uint16_t record_size;
+      memcpy(&record_size, payload + offset, sizeof(record_size));
+      offset += sizeof(record_size);
+      if (offset + record_size > size) {
+        break;
+      }
+      handle_display(device, payload + offset, record_size);
+      offset += record_size;
+    }
+    return;
+  }
+
+  // the run ID, if any, follows the fixed part and the string
+  size_t end = sizeof(struct sling_message_display_flush);
+  if (display_type != sling_message_display_type_flush) {
+    struct sling_message_display message;
+    if (size < sizeof(message)) {
+      return;
+    }
+    memcpy(&message, payload, sizeof(message));
+    end = sizeof(message);
+    if (message.data_type == 6 || message.data_type == 7) {
+      end += message.string_length + 1;
+    }
+  }
+  sling_run_id_t run_id;
+  const bool has_run_id = read_run_id(payload, size, end, &run_id);
+  struct bench_run *run = find_run(device, has_run_id ? &run_id : NULL);
+  if (!run) {
+    return;
+  }
+
+  const double t = now();
+  ++bench.display_messages;
+  bench.display_bytes += size;
+  if (!bench.first_display_at) {
+    bench.first_display_at = t;
+  }
+  bench.last_display_at = t;
+
+  if (!run->seen_output) {
+    run->seen_output = true;
+    sample(&bench.first_output, t - run->sent_at);
+  } else {
+    sample(&bench.display_gap, t - run->last_display_at);
+  }
+  run->last_display_at = t;
+
+  const uint16_t base_type = display_type & 0xff;
+  if (!run->seen_result && (base_type == sling_message_display_type_result ||
+                            (base_type == sling_message_display_type_error &&
+                             (display_type & sling_message_display_type_self_flushing)))) {
+    run->seen_result = true;
+    sample(&bench.result, t - run->sent_at);
+  }
+}
+
+static void on_message(struct mosquitto *m, void *obj, const struct mosquitto_message *message) {
+  (void) m; (void) obj;
+  const char *type;
+  struct bench_device *device = find_device(message->topic, &type);
+  if (!device || message->payloadlen < 4) {
+    return;
+  }
+
+  if (!strcmp(type, SLING_OUTTOPIC_STATUS)) {
+    handle_status(device, message->payload, message->payloadlen);
+  } else if (!strcmp(type, SLING_OUTTOPIC_DISPLAY)) {
+    handle_display(device, message->payload, message->payloadlen);
+  }
+}
+
+static void ping(struct bench_device *device) {
+  uint32_t message_id = bench.next_message_id++;
+  device->ping_pending = true;
+  device->ping_sent_at = now();
+  publish(device->topic_ping, &message_id, sizeof(message_id));
+}
+
+static void on_connect(struct mosquitto *m, void *obj, int ret) {
+  (void) obj;
+  if (ret) {
+    fprintf(stderr, "Failed to connect: %d\n", ret);
+    exit(1);
+  }
+  for (size_t i = 0; i < bench.device_count; ++i) {
+    char topic[256];
+    snprintf(topic, sizeof(topic), "%s/+", bench.devices[i].id);
+    mosquitto_subscribe(m, NULL, topic, 1);
+  }
+}
+
+// Issues more requests, up to the concurrency limit. Returns false once everything is done
+static bool drive(void) {
+  bool all_ready = true;
+  for (size_t i = 0; i < bench.device_count; ++i) {
+    all_ready = all_ready && bench.devices[i].ready;
+  }
+  if (!all_ready) {
+    return true;
+  }
+
+  for (size_t i = 0; i < bench.device_count; ++i) {
+    struct bench_device *device = bench.devices + i;
+    if (bench.workload == workload_ping) {
+      if (!device->ping_pending && bench.started < bench.total) {
+        ++bench.started;
+        ping(device);
+      }
+      continue;
+    }
+    while (device->active_runs < bench.concurrency && bench.started < bench.total) {
+      start_run(device);
+    }
+  }
+  return bench.completed < bench.total;
+}
+
+static char *read_file(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  long length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  // room for the message number in front
+  char *buf = malloc(length + 4);
+  if (!buf || fread(buf + 4, 1, length, f) != (size_t) length) {
+    perror(path);
+    exit(1);
+  }
+  fclose(f);
+  *size = length + 4;
+  return buf;
+}
+
+static void print_usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s <options> <device id>...\n\n%s", argv0,
+    "  -h, --host:         The hostname of the MQTT broker; defaults to localhost\n"
+    "  -p, --port:         The port of the MQTT broker; defaults to 1883\n"
+    "  -w, --workload:     run, stop or ping; defaults to run\n"
+    "  -f, --program:      Compiled SVML program to run\n"
+    "  -n, --count:        Total number of runs or pings; defaults to 100\n"
+    "  -c, --concurrency:  Runs in progress at once per device; needs --max-runs on the daemon if more than 1\n"
+    "  -t, --timeout:      Give up after this many seconds; defaults to 60\n"
+    "  -l, --label:        Included in the results as is, to tell runs apart\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *host = "localhost";
+  int port = 1883;
+  const char *program_path = NULL;
+  const char *label = "";
+  double timeout = 60;
+  bench.workload_name = "run";
+  bench.total = 100;
+  bench.concurrency = 1;
+
+  static struct option long_options[] = {
+    {"host",        required_argument, 0, 'h'},
+    {"port",        required_argument, 0, 'p'},
+    {"workload",    required_argument, 0, 'w'},
+    {"program",     required_argument, 0, 'f'},
+    {"count",       required_argument, 0, 'n'},
+    {"concurrency", required_argument, 0, 'c'},
+    {"timeout",     required_argument, 0, 't'},
+    {"label",       required_argument, 0, 'l'},
+    {0,             0,                 0, 0  }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h:p:w:f:n:c:t:l:", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'h': host = optarg; break;
+    case 'p': port = atoi(optarg); break;
+    case 'w': bench.workload_name = optarg; break;
+    case 'f': program_path = optarg; break;
+    case 'n': bench.total = strtoul(optarg, NULL, 0); break;
+    case 'c': bench.concurrency = strtoul(optarg, NULL, 0); break;
+    case 't': timeout = atof(optarg); break;
+    case 'l': label = optarg; break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!strcmp(bench.workload_name, "run")) {
+    bench.workload = workload_run;
+  } else if (!strcmp(bench.workload_name, "stop")) {
+    bench.workload = workload_stop;
+  } else if (!strcmp(bench.workload_name, "ping")) {
+    bench.workload = workload_ping;
+  } else {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (bench.workload != workload_ping && !program_path) {
+    fputs("No program specified.\n", stderr);
+    return 1;
+  }
+  if (optind >= argc || argc - optind > MAX_DEVICES || bench.concurrency < 1 || bench.concurrency > MAX_CONCURRENCY) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  for (int i = optind; i < argc; ++i) {
+    struct bench_device *device = bench.devices + bench.device_count++;
+    device->id = argv[i];
+    device->topic_run = sling_topic(device->id, SLING_INTOPIC_RUN);
+    device->topic_stop = sling_topic(device->id, SLING_INTOPIC_STOP);
+    device->topic_ping = sling_topic(device->id, SLING_INTOPIC_PING);
+    device->topic_input = sling_topic(device->id, SLING_INTOPIC_INPUT);
+  }
+  if (program_path) {
+    bench.program = read_file(program_path, &bench.program_size);
+  }
+
+  srand(time(NULL) ^ getpid());
+  bench.next_message_id = rand();
+
+  mosquitto_lib_init();
+  mosq = mosquitto_new(NULL, true, NULL);
+  if (!mosq) {
+    fputs("Mosquitto instance initialisation failed.\n", stderr);
+    return 1;
+  }
+  mosquitto_connect_callback_set(mosq, on_connect);
+  mosquitto_message_callback_set(mosq, on_message);
+  // don't let the client library become the bottleneck
+  mosquitto_max_inflight_messages_set(mosq, 0);
+  if (mosquitto_connect(mosq, host, port, 30) != MOSQ_ERR_SUCCESS) {
+    fprintf(stderr, "Failed to connect to %s:%d\n", host, port);
+    return 1;
+  }
+
+  // ping until every device has answered, so we know they are up and subscribed
+  const double deadline = now() + timeout;
+  double last_ping = 0;
+  double start = 0;
+  bool timed_out = false;
+  while (true) {
+    if (now() > deadline) {
+      timed_out = true;
+      break;
+    }
+    bool all_ready = true;
+    for (size_t i = 0; i < bench.device_count; ++i) {
+      all_ready = all_ready && bench.devices[i].ready;
+    }
+    if (all_ready && !start) {
+      start = now();
+    } else if (!all_ready && now() - last_ping > 0.5) {
+      last_ping = now();
+      for (size_t i = 0; i < bench.device_count; ++i) {
+        if (!bench.devices[i].ready) {
+          ping(bench.devices + i);
+        }
+      }
+    }
+    if (all_ready && !drive()) {
+      break;
+    }
+    int res = mosquitto_loop(mosq, 10, 1);
+    if (res != MOSQ_ERR_SUCCESS) {
+      fprintf(stderr, "Mosquitto: %s\n", mosquitto_strerror(res));
+      return 1;
+    }
+  }
+  const double elapsed = start ? now() - start : 0;
+  const double display_elapsed = bench.last_display_at - bench.first_display_at;
+
+  const char *program_name = program_path ? program_path : "";
+  if (strrchr(program_name, '/')) {
+    program_name = strrchr(program_name, '/') + 1;
+  }
+  printf("{\"label\":\"%s\",\"workload\":\"%s\",\"program\":\"%s\",\"devices\":%zu,\"concurrency\":%zu", label,
+         bench.workload_name, program_name, bench.device_count, bench.concurrency);
+  printf(",\"requested\":%lu,\"completed\":%lu,\"errors\":%lu,\"timed_out\":%s,\"elapsed_s\":%.3f", bench.total,
+         bench.completed, bench.errors, timed_out ? "true" : "false", elapsed);
+  printf(",\"per_second\":%.1f,\"prompts\":%lu", elapsed > 0 ? bench.completed / elapsed : 0, bench.prompts);
+  printf(",\"display_messages\":%lu,\"display_bytes\":%lu,\"display_messages_per_second\":%.1f",
+         bench.display_messages, bench.display_bytes,
+         display_elapsed > 0 ? bench.display_messages / display_elapsed : 0);
+  print_samples("run_to_first_output_us", &bench.first_output);
+  print_samples("run_to_result_us", &bench.result);
+  print_samples("run_to_idle_us", &bench.complete);
+  print_samples("stop_to_idle_us", &bench.stop);
+  print_samples("ping_to_status_us", &bench.ping);
+  print_samples("display_gap_us", &bench.display_gap);
+  printf("}\n");
+
+  mosquitto_destroy(mosq);
+  mosquitto_lib_cleanup();
+  return timed_out ? 2 : 0;
+}
@@ -3,8 +3,11 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
+#include "../../common/sling_message.h"
+
 enum child_exit {
   child_exit_normal = 0,
   child_exit_unknown_error = 1,
@@ -15,4 +18,34 @@ enum child_exit {
 
 #define IPC_FD 998
 
+#define IPC_DISPLAY_BUF_SIZE 0x1000
+// The host splits longer output into fragments, so no IPC message is larger than this
+#define IPC_MESSAGE_MAX (sizeof(struct sling_message_display) + IPC_DISPLAY_BUF_SIZE)
+
+// Sent by the daemon on IPC_FD to start the run, together with (SCM_RIGHTS) a
+// sealed memfd holding the program and, if ring_size is not 0, the IPC ring's
+// memfd, data eventfd and space eventfd, in that order
+struct ipc_run_request {
+  uint32_t program_size;
+  uint32_t ring_size;
+  uint32_t heap_size;
+  uint32_t heap_mode;
+};
+
+#define IPC_HEAP_SIZE_DEFAULT 0x400000
+#define IPC_HEAP_SIZE_MIN 0x10000
+#define IPC_HEAP_SIZE_MAX 0x40000000
+
+// How the host backs the Sinter heap. It is always reserved up front, but only
+// committed as the program touches it unless prefaulted
+enum ipc_heap_mode {
+  ipc_heap_mode_lazy = 0,
+  // Commit it all before the run, so the run takes no page faults on it
+  ipc_heap_mode_prefault = 1,
+  // Lazily, but in transparent huge pages where possible, for fewer TLB misses
+  ipc_heap_mode_hugepage = 2,
+};
+
+#define IPC_RUN_REQUEST_MAX_FDS 4
+
 #endif
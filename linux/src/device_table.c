@@ -0,0 +1,58 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device_table.h"
+
+// FNV-1a
+static uint32_t hash_id(const char *id, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ (unsigned char) id[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Returns the entry holding id, or the empty entry where it would go
+static struct device_table_entry *find_entry(const struct device_table *table, const char *id, size_t length,
+                                             uint32_t hash) {
+  for (size_t slot = hash & table->mask; ; slot = (slot + 1) & table->mask) {
+    struct device_table_entry *entry = table->entries + slot;
+    if (!entry->id
+        || (entry->hash == hash && entry->length == length && !memcmp(entry->id, id, length))) {
+      return entry;
+    }
+  }
+}
+
+bool device_table_init(struct device_table *table, size_t count) {
+  size_t capacity = 8;
+  while (capacity < count * 2) {
+    capacity <<= 1;
+  }
+  table->entries = calloc(capacity, sizeof(*table->entries));
+  table->mask = capacity - 1;
+  return table->entries != NULL;
+}
+
+bool device_table_add(struct device_table *table, const char *id, size_t index) {
+  const size_t length = strlen(id);
+  const uint32_t hash = hash_id(id, length);
+  struct device_table_entry *entry = find_entry(table, id, length, hash);
+  if (entry->id) {
+    return false;
+  }
+  *entry = (struct device_table_entry){.id = id, .length = length, .hash = hash, .index = index};
+  return true;
+}
+
+bool device_table_find(const struct device_table *table, const char *id, size_t length, size_t *index) {
+  const struct device_table_entry *entry = find_entry(table, id, length, hash_id(id, length));
+  if (!entry->id) {
+    return false;
+  }
+  *index = entry->index;
+  return true;
+}
@@ -0,0 +1,38 @@
+#ifndef SLING_LINUX_DEVICE_TABLE_H
+#define SLING_LINUX_DEVICE_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The device IDs a daemon serves, each mapped to its index, so an incoming
+// topic finds its device in O(1) however many there are.
+//
+// An open addressing hash table with linear probing, sized when created at
+// least twice the number of IDs. IDs are not copied, so must outlive it.
+
+struct device_table_entry {
+  // NULL if empty
+  const char *id;
+  size_t length;
+  uint32_t hash;
+  size_t index;
+};
+
+struct device_table {
+  struct device_table_entry *entries;
+  // A power of 2, minus 1
+  size_t mask;
+};
+
+// Returns false if out of memory
+bool device_table_init(struct device_table *table, size_t count);
+
+// Returns false if id is already in the table
+bool device_table_add(struct device_table *table, const char *id, size_t index);
+
+// Looks up the device ID that is the first length bytes of id, which need not
+// be null-terminated. Returns false if it is not in the table
+bool device_table_find(const struct device_table *table, const char *id, size_t length, size_t *index);
+
+#endif
@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ipc_ring.h"
+
+// marks the unused space at the end of the ring when a record does not fit there
+#define IPC_RING_PADDING UINT32_MAX
+
+static inline uint32_t record_size(uint32_t length) {
+  return (sizeof(uint32_t) + length + 3) & ~(uint32_t) 3;
+}
+
+static void ring_doorbell(int efd) {
+  uint64_t one = 1;
+  ssize_t unused = write(efd, &one, sizeof(one));
+  (void) unused;
+}
+
+bool ipc_ring_map(struct ipc_ring *ring, int memfd, uint32_t capacity) {
+  void *mapping = mmap(NULL, IPC_RING_HEADER_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  ring->header = mapping;
+  ring->data = (unsigned char *) mapping + IPC_RING_HEADER_SIZE;
+  ring->capacity = capacity;
+  ring->memfd = memfd;
+  return true;
+}
+
+void ipc_ring_reset(struct ipc_ring *ring) {
+  atomic_store(&ring->header->head, 0);
+  atomic_store(&ring->header->tail, 0);
+  atomic_store(&ring->header->consumer_waiting, 1);
+  atomic_store(&ring->header->producer_waiting, 0);
+}
+
+static void advance_head(struct ipc_ring *ring, uint32_t head) {
+  struct ipc_ring_header *header = ring->header;
+  atomic_store(&header->head, head);
+  if (atomic_load(&header->producer_waiting) && atomic_exchange(&header->producer_waiting, 0)) {
+    ring_doorbell(ring->space_efd);
+  }
+}
+
+static bool wait_for_space(struct ipc_ring *ring, uint32_t tail, uint32_t needed) {
+  struct ipc_ring_header *header = ring->header;
+  while (ring->capacity - (tail - atomic_load_explicit(&header->head, memory_order_acquire)) < needed) {
+    atomic_store(&header->producer_waiting, 1);
+    if (ring->capacity - (tail - atomic_load(&header->head)) >= needed) {
+      atomic_store(&header->producer_waiting, 0);
+      break;
+    }
+    uint64_t count;
+    if (read(ring->space_efd, &count, sizeof(count)) == -1 && errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ipc_ring_writev(struct ipc_ring *ring, const struct iovec *iov, int iovcnt) {
+  size_t length = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    length += iov[i].iov_len;
+  }
+  if (length > IPC_MESSAGE_MAX) {
+    return false;
+  }
+
+  struct ipc_ring_header *header = ring->header;
+  const uint32_t total = record_size(length);
+  uint32_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+  uint32_t offset = tail & (ring->capacity - 1);
+  const uint32_t to_end = ring->capacity - offset;
+  if (!wait_for_space(ring, tail, total <= to_end ? total : to_end + total)) {
+    return false;
+  }
+
+  if (total > to_end) {
+    const uint32_t padding = IPC_RING_PADDING;
+    memcpy(ring->data + offset, &padding, sizeof(padding));
+    tail += to_end;
+    offset = 0;
+  }
+
+  const uint32_t length32 = length;
+  unsigned char *out = ring->data + offset;
+  memcpy(out, &length32, sizeof(length32));
+  out += sizeof(length32);
+  for (int i = 0; i < iovcnt; ++i) {
+    memcpy(out, iov[i].iov_base, iov[i].iov_len);
+    out += iov[i].iov_len;
+  }
+
+  atomic_store(&header->tail, tail + total);
+  if (atomic_load(&header->consumer_waiting) && atomic_exchange(&header->consumer_waiting, 0)) {
+    ring_doorbell(ring->data_efd);
+  }
+  return true;
+}
+
+int ipc_ring_peek(struct ipc_ring *ring, void **record, uint32_t *size) {
+  struct ipc_ring_header *header = ring->header;
+  uint32_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+  const uint32_t tail = atomic_load_explicit(&header->tail, memory_order_acquire);
+  while (head != tail) {
+    const uint32_t offset = head & (ring->capacity - 1);
+    uint32_t length;
+    memcpy(&length, ring->data + offset, sizeof(length));
+    if (length == IPC_RING_PADDING) {
+      head += ring->capacity - offset;
+      advance_head(ring, head);
+      continue;
+    }
+
+    // the host can write anything here, so check the record is sane before using it
+    if (length > IPC_MESSAGE_MAX || tail - head < record_size(length) ||
+        offset + record_size(length) > ring->capacity) {
+      return -1;
+    }
+    *record = ring->data + offset + sizeof(length);
+    *size = length;
+    return 1;
+  }
+  return 0;
+}
+
+void ipc_ring_consume(struct ipc_ring *ring, uint32_t size) {
+  advance_head(ring, atomic_load_explicit(&ring->header->head, memory_order_relaxed) + record_size(size));
+}
+
+bool ipc_ring_prepare_wait(struct ipc_ring *ring) {
+  struct ipc_ring_header *header = ring->header;
+  atomic_store(&header->consumer_waiting, 1);
+  if (atomic_load(&header->tail) != atomic_load(&header->head)) {
+    atomic_store(&header->consumer_waiting, 0);
+    return false;
+  }
+  return true;
+}
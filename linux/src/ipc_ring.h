@@ -0,0 +1,54 @@
+#ifndef SLING_LINUX_IPC_RING_H
+#define SLING_LINUX_IPC_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+// A single-producer single-consumer ring of IPC messages in shared memory.
+//
+// The host (producer) appends records without any system calls unless the
+// daemon (consumer) has said it is about to sleep, in which case the host
+// rings the data eventfd once. Likewise, when the ring is full, the host
+// sleeps on the space eventfd until the daemon has consumed some records.
+
+struct ipc_ring_header {
+  _Atomic uint32_t head;
+  _Atomic uint32_t consumer_waiting;
+  char head_padding[56];
+  _Atomic uint32_t tail;
+  _Atomic uint32_t producer_waiting;
+  char tail_padding[56];
+};
+
+#define IPC_RING_HEADER_SIZE sizeof(struct ipc_ring_header)
+#define IPC_RING_MIN_SIZE 0x8000
+
+struct ipc_ring {
+  struct ipc_ring_header *header;
+  unsigned char *data;
+  uint32_t capacity;
+  int memfd;
+  int data_efd;
+  int space_efd;
+};
+
+// Maps the ring in the given memfd; capacity must be a power of two
+bool ipc_ring_map(struct ipc_ring *ring, int memfd, uint32_t capacity);
+void ipc_ring_reset(struct ipc_ring *ring);
+
+// Producer side; blocks while the ring is full
+bool ipc_ring_writev(struct ipc_ring *ring, const struct iovec *iov, int iovcnt);
+
+// Consumer side. Returns 1 and the next record if there is one, 0 if the ring
+// is empty, and -1 if the ring is corrupt
+int ipc_ring_peek(struct ipc_ring *ring, void **record, uint32_t *size);
+void ipc_ring_consume(struct ipc_ring *ring, uint32_t size);
+// Returns true if the ring is empty and the producer will ring the data
+// eventfd when it next writes
+bool ipc_ring_prepare_wait(struct ipc_ring *ring);
+
+#endif
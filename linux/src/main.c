@@ -1,4 +1,6 @@
+#include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,255 +11,1804 @@
 #include <getopt.h>
 #include <signal.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <mosquitto.h>
 
+#include "../../common/sling_lz4.h"
 #include "../../common/sling_message.h"
+#include "common.h"
+#include "device_table.h"
+#include "ipc_ring.h"
+#include "message_dedup.h"
+#include "metrics.h"
+#include "output_governor.h"
+#include "program_cache.h"
+#include "publish_queue.h"
+#include "replay_journal.h"
+#include "run_limits.h"
 
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 
 typedef enum sling_message_status_type device_status_t;
 
-struct sling_config {
-  const char *host;
-  const char *device_id;
-  const char *server_ca_path;
-  const char *server_ca_dir;
-  const char *client_key_path;
-  const char *client_cert_path;
-  const char *sinter_host_path;
-  const char *program_path;
+struct sling_host {
+  pid_t pid;
+  int ipcfd;
+  // 0 if the host is not in a cgroup of its own
+  unsigned long cgroup_index;
+};
 
-  int port;
+#define WARM_POOL_MAX 8
+
+struct sling_device;
+
+// A program being run by a Sinter host
+struct sling_run {
+  // The device the run was sent to
+  struct sling_device *device;
+  sling_run_id_t id;
+  // 0 if this slot is free
+  pid_t host_pid;
+  int ipcfd;
+  unsigned long cgroup_index;
+
+  // Carries output from the host instead of ipcfd, if enabled
+  struct ipc_ring ipc_ring;
+
+  // The prompt the host is waiting for a response to, or NULL
+  char *prompt;
+  struct timespec prompt_time;
+  // The wall-clock limit does not count time spent waiting for input
+  long prompt_remaining_ms;
+
+  // Why the host might exit other than finishing the program
+  bool stop_requested;
+  bool timed_out;
+  bool output_killed;
+  struct timespec deadline;
+
+  // Display messages dropped while throttled or over the output budget, not yet owned up to
+  unsigned long dropped_displays;
+  struct output_governor output_governor;
+  // Dropping the rest of a line of output, up to and including its flush
+  bool dropping_line;
+
+  // Flush bookkeeping is per run, as display messages of concurrent runs interleave
+  uint32_t display_start_counter;
+  uint32_t last_flush_counter;
+
+  struct timespec start_time;
+  bool is_warm;
+  bool has_output;
+  // The client can read compressed display bodies
+  bool compress_display;
+
+  // Output handled, and wakeups taken to handle it
+  unsigned long ipc_messages;
+  unsigned long ipc_wakeups;
+};
+
+#define RUNS_MAX 256
+
+// A device ID we serve. Each has its own topics, message numbering, runs and
+// dedup state; the broker connection, warm pool and program cache are shared
+struct sling_device {
+  const char *id;
 
   // Precomputed topic names
 
   char *outtopic_status;
   char *outtopic_display;
   char *outtopic_hello;
+  char *outtopic_cache_miss;
+  char *outtopic_exit;
+  char *outtopic_metrics;
+  char *outtopic_replay_gap;
 
   char *intopic_run;
+  char *intopic_run_cached;
   char *intopic_stop;
   char *intopic_ping;
   char *intopic_input;
-
-  size_t intopic_index;
+  char *intopic_replay;
 
   device_status_t status;
-  pid_t host_pid;
+  uint32_t message_counter;
+  // Of the hello we last sent
+  uint32_t nonce;
+
+  // This device's max_runs slots of config.runs
+  struct sling_run *runs;
+  size_t run_count;
+
+  // Display messages waiting to be published together, if batching is enabled
+  struct sling_message_display_batch *display_batch;
+  size_t display_batch_size;
+  struct timespec display_batch_deadline;
+
+  // Client messages seen recently, to drop repeat deliveries
+  struct message_dedup dedup;
+
+  // Messages published recently, to publish again for clients that missed them, if enabled
+  struct replay_journal journal;
+};
+
+#define DEVICES_MAX 4096
+
+struct run_options {
+  bool has_run_id;
+  sling_run_id_t run_id;
+  bool has_heap_size;
+  uint32_t heap_size;
+  bool is_compressed;
+  uint32_t uncompressed_size;
+  bool accept_compressed_display;
+  bool has_output_limits;
+  struct output_limits output_limits;
+};
+
+// What to do with output from Sinter hosts while too much is waiting to be published
+enum overflow_policy {
+  // Stop reading it, so the hosts block until there is room
+  overflow_policy_block,
+  // Drop standard output, and say how much was dropped once there is room
+  overflow_policy_drop,
+  // Kill runs that produce standard output
+  overflow_policy_kill
+};
+
+// Largest program we will decompress a run payload into
+#define COMPRESSED_PROGRAM_MAX 0x1000000
+
+struct sling_config {
+  const char *host;
+  const char *device_id;
+  // File of more device IDs to serve, if set
+  const char *devices_path;
+  // The MQTT client ID; defaults to the first device ID
+  const char *client_id;
+  const char *server_ca_path;
+  const char *server_ca_dir;
+  const char *client_key_path;
+  const char *client_cert_path;
+  const char *sinter_host_path;
+  const char *program_path;
+
+  int port;
+  bool use_tls;
+  bool debug_log;
+
+  // Looked up by the device ID in each topic
+  struct sling_device *devices;
+  size_t device_count;
+  struct device_table device_table;
+
   int epollfd;
-  int ipcfd;
 
-  FILE *urandom;
+  // Slots for programs running at once, max_runs per device, grouped by device;
+  // run IDs trail our messages if there is more than one per device
+  struct sling_run *runs;
+  size_t max_runs;
+  size_t run_slot_count;
+  // Runs in progress across all devices
+  size_t run_count;
+
+  // Each run slot gets its own ring of ipc_ring_size bytes, if enabled, set up
+  // when the slot first runs something, so idle devices cost no rings
+  bool use_ipc_ring;
+  size_t ipc_ring_size;
+
+  // Sinter heap for runs that don't ask for a size, and the most they can ask for
+  size_t heap_size;
+  size_t max_heap_size;
+  enum ipc_heap_mode heap_mode;
+
+  // Display string bodies at least this long are compressed for runs that accept it;
+  // 0 to turn compression off altogether
+  size_t compress_threshold;
+
+  struct run_limits limits;
+  // Wall-clock limit per run, or 0 for none
+  long time_limit_ms;
+  // Runs may ask for stricter output limits, but not looser ones
+  struct output_limits output_limits;
+
+  // Publishes not yet acknowledged by the broker
+  struct publish_queue publish_queue;
+  // Output from Sinter hosts is throttled per overflow_policy once publish_queue holds
+  // queue_high bytes, until it is back down to queue_low; 0 for no limit
+  size_t queue_high;
+  size_t queue_low;
+  enum overflow_policy overflow_policy;
+  bool throttled;
+  struct timespec throttle_start;
+  // IPC FDs are out of the epoll set, under overflow_policy_block
+  bool ipc_paused;
+
+  // Served to anyone who connects, if set
+  const char *metrics_socket_path;
+  int metrics_listenfd;
+  // Also published on <device id>/metrics this often, if nonzero
+  long metrics_interval_ms;
+  struct timespec metrics_deadline;
+
+  // Preallocated buffers to receive up to ipc_batch_size datagrams from ipcfd at once
+  size_t ipc_batch_size;
+  struct mmsghdr *ipc_batch;
+
+  // Hosts started ahead of time, waiting for a run request
+  struct sling_host warm_pool[WARM_POOL_MAX];
+  size_t warm_pool_size;
+  size_t warm_pool_count;
+
+  // Display messages are held to be published together, if batching is enabled
+  size_t display_batch_bytes;
+  long display_batch_ms;
+  // Devices with a batch pending
+  size_t pending_display_batches;
 
-  uint32_t message_counter;
-  uint32_t display_start_counter;
-  uint32_t last_flush_counter;
+  FILE *urandom;
 
-// MUST BE POWER OF 2
-#define LAST_MESSAGE_ID_BUF_SIZE 4
+  // How long devices remember client messages
+  unsigned long dedup_window_s;
 
-  uint32_t last_message_ids[4];
-  size_t last_message_id_index;
+  // Directory of a replay journal per device, if set
+  const char *journal_dir;
+  size_t journal_size;
 };
 
 enum main_loop_epoll_type {
   main_loop_epoll_mosq,
   main_loop_epoll_child,
-  main_loop_epoll_ipc
+  main_loop_epoll_ipc,
+  main_loop_epoll_ipc_ring,
+  main_loop_epoll_metrics
 };
 
-static void main_loop_epoll_add(enum main_loop_epoll_type type, int fd);
-static void send_status(void);
-static void send_hello_if_zero(void);
-static void change_status(device_status_t new_status);
+static void main_loop_epoll_add(enum main_loop_epoll_type type, size_t run_index, int fd);
+static void main_loop_epoll_del(int fd);
+static void setup_ipc_ring(struct ipc_ring *ring, size_t size);
+static void send_status(struct sling_device *device);
+static void send_run_status(struct sling_device *device, sling_run_id_t run_id, device_status_t status);
+static void send_prompt_status(const struct sling_run *run);
+static void handle_input(struct sling_device *device, const char *payload, size_t size);
+static void send_cache_miss(struct sling_device *device, const uint8_t *hash, sling_run_id_t run_id);
+static void send_hello_if_zero(struct sling_device *device);
+static void handle_replay(struct sling_device *device, const void *payload, size_t size);
 
 static struct mosquitto *mosq;
 static struct sling_config config;
 
-#define fatal_error(...) do { fprintf(stderr, __VA_ARGS__); _Exit(1); } while (0)
+#define fatal_error(...) do { fprintf(stderr, __VA_ARGS__); _Exit(1); } while (0)
+
+#define fatal_errno(msg) do { perror(msg); _Exit(1); } while (0)
+
+static void check_mosq(int error) {
+  switch (error) {
+  case MOSQ_ERR_SUCCESS:
+    return;
+  case MOSQ_ERR_ERRNO:
+    perror("Mosquitto");
+    _Exit(1);
+  default:
+    eprintf("Mosquitto: %s\n", mosquitto_strerror(error));
+    _Exit(1);
+  }
+}
+
+static int check_posix(int result, const char *msg) {
+  if (result == -1) {
+    fatal_errno(msg);
+  }
+  return result;
+}
+
+static int check_posix_nonblock(int result, const char *msg) {
+  if (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    fatal_errno(msg);
+  }
+  return result;
+}
+
+static void print_usage(char *argv0) {
+  eprintf("Usage: %s <options>\n\n%s", argv0,
+    "  -v, --debug:                         Log verbosely\n"
+    "  -h, --host, SLING_HOST:              The hostname of the MQTT server\n"
+    "  -p, --port, SLING_PORT:              The port of the MQTT server; defaults to 8883, or 1883 without TLS\n"
+    "  -n, --no-tls, SLING_NO_TLS:          Connect to the MQTT server without TLS, e.g. to a local broker for benchmarking\n"
+    "  -i, --device-id, SLING_DEVICE_ID:    The device ID\n"
+    "  -d, --devices, SLING_DEVICES:        Path to a file of more device IDs to serve over the same connection, one per line;\n"
+    "                                       blank lines and lines starting with # are skipped\n"
+    "  -l, --client-id, SLING_CLIENT_ID:    The MQTT client ID; defaults to the first device ID\n"
+    "  -s, --server-ca, SLING_CA:           Path to the CA issuing the MQTT server's TLS certificate, in PEM format\n"
+    "  -k, --client-key, SLING_KEY:         Path to the private key for the client's TLS certificate, in PEM format\n"
+    "  -c, --client-cert, SLING_CERT:       Path to the client's TLS certificate, in PEM format\n"
+    "  -H, --sinter-host, SINTER_HOST_PATH: Path to the Sinter host, or ./sinter_host by default\n"
+    "  -P, --program, SLING_PROGRAM_PATH:   Path at which to also save received programs, for debugging; not saved by default\n"
+    "  -w, --warm-pool, SLING_WARM_POOL:    Number of Sinter hosts to keep started ahead of runs (max 8), or 0 (the default) to start one per run\n"
+    "  -C, --cache-size, SLING_CACHE_SIZE:  Total size in bytes of recently run programs to keep for run_cached, or 0 to disable; defaults to 4 MiB\n"
+    "  -R, --ipc-ring, SLING_IPC_RING:      Size in bytes of a shared memory ring to carry output from Sinter hosts (min 32 KiB), or 0 (the default) to use datagrams\n"
+    "  -I, --ipc-batch, SLING_IPC_BATCH:    Maximum number of datagrams to receive from a Sinter host per wakeup (max 1024); defaults to 32\n"
+    "  -m, --max-runs, SLING_MAX_RUNS:      Maximum number of programs each device may run at once (max 256), or 0 for one per\n"
+    "                                       CPU core; defaults to 1\n"
+    "  -g, --cgroup, SLING_CGROUP:          Path to a cgroup v2 directory delegated to Sling, in which to put each Sinter host in a cgroup of its own\n"
+    "  -q, --cpu-quota, SLING_CPU_QUOTA:    Percentage of one CPU each run may use; needs --cgroup\n"
+    "  -u, --cpu-time, SLING_CPU_TIME:      CPU time in seconds each run may use\n"
+    "  -M, --memory-limit, SLING_MEMORY_LIMIT:\n"
+    "                                       Memory in bytes each run may use (address space, without --cgroup)\n"
+    "  -T, --time-limit, SLING_TIME_LIMIT:  Wall-clock time in milliseconds each run may take\n"
+    "  -X, --metrics-socket, SLING_METRICS_SOCKET:\n"
+    "                                       Path of a Unix socket on which to serve metrics in the Prometheus text format\n"
+    "  -x, --metrics-interval, SLING_METRICS_INTERVAL:\n"
+    "                                       Publish metrics on <device id>/metrics every this many seconds, or 0 (the default) to not;\n"
+    "                                       with several devices, on the topic of the first\n"
+    "  -b, --display-batch-bytes, SLING_DISPLAY_BATCH_BYTES:\n"
+    "                                       Publish display messages in batches of up to this many bytes, or 0 (the default) to publish each separately\n"
+    "  -B, --display-batch-ms, SLING_DISPLAY_BATCH_MS:\n"
+    "                                       Maximum time in milliseconds to hold a display message for batching; defaults to 20\n"
+  );
+  // split to stay within the string length C compilers must support
+  eprintf("%s",
+    "  -e, --heap-size, SLING_HEAP_SIZE:    Sinter heap in bytes for runs that don't ask for a size; defaults to 4 MiB\n"
+    "  -E, --max-heap-size, SLING_MAX_HEAP_SIZE:\n"
+    "                                       Most Sinter heap in bytes a run may ask for (max 1 GiB); defaults to 64 MiB\n"
+    "  -j, --heap-mode, SLING_HEAP_MODE:    lazy (the default) to commit the heap as it is used, prefault to commit it all\n"
+    "                                       before the run, or hugepage to use transparent huge pages where possible\n"
+    "  -z, --compress-threshold, SLING_COMPRESS_THRESHOLD:\n"
+    "                                       Accept compressed programs, and compress display strings at least this many bytes\n"
+    "                                       long for runs that accept it; 0 (the default) turns compression off\n"
+    "  -Q, --queue-high, SLING_QUEUE_HIGH:  Bytes of unacknowledged MQTT publishes at which to throttle output from runs;\n"
+    "                                       defaults to 1 MiB, or 0 for no limit\n"
+    "  -L, --queue-low, SLING_QUEUE_LOW:    Bytes of unacknowledged MQTT publishes at which to lift throttling; defaults to half of --queue-high\n"
+    "  -O, --overflow-policy, SLING_OVERFLOW_POLICY:\n"
+    "                                       While throttled, block (the default) to stop reading output from Sinter hosts,\n"
+    "                                       drop to discard their standard output, or kill to end runs that print\n"
+    "  -r, --output-rate, SLING_OUTPUT_RATE:\n"
+    "                                       Bytes of standard output per second each run may send before repeated lines are\n"
+    "                                       collapsed and others dropped\n"
+    "  -N, --output-rate-messages, SLING_OUTPUT_RATE_MESSAGES:\n"
+    "                                       Display messages of standard output per second each run may send, as above\n"
+    "  -o, --output-max, SLING_OUTPUT_MAX:  Bytes of standard output each run may send in all; the rest is cut off\n"
+    "  -D, --dedup-window, SLING_DEDUP_WINDOW:\n"
+    "                                       Seconds for which to remember client message IDs, to drop repeat deliveries;\n"
+    "                                       defaults to 60\n"
+    "  -J, --journal-dir, SLING_JOURNAL_DIR:\n"
+    "                                       Directory in which to keep a journal of each device's recent messages, for clients\n"
+    "                                       to fetch again after missing some; kept across restarts. Not kept by default\n"
+    "  -K, --journal-size, SLING_JOURNAL_SIZE:\n"
+    "                                       Size in bytes of each device's journal (min 64 KiB); defaults to 1 MiB\n"
+    "\n"
+    "Options can be passed in via environment variables. Command line options override environment variables.\n"
+    "\n"
+    "Limits default to 0, meaning unlimited.\n"
+    "\n"
+    "When specifying a boolean as an environment variable, specify 1 for true.\n"
+  );
+}
+
+static const char *heap_mode_name(enum ipc_heap_mode mode) {
+  switch (mode) {
+  case ipc_heap_mode_lazy:
+    return "lazy";
+  case ipc_heap_mode_prefault:
+    return "prefault";
+  case ipc_heap_mode_hugepage:
+    return "hugepage";
+  }
+  return "lazy";
+}
+
+static void spawn_host(struct sling_host *host) {
+  // so the host can set up the default heap before it has a run
+  char heap_size[24];
+  snprintf(heap_size, sizeof(heap_size), "%zu", config.heap_size);
+  int sv[2];
+  check_posix(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv), "socketpair");
+  host->cgroup_index = run_limits_create_cgroup();
+
+  pid_t child_pid = check_posix(fork(), "fork");
+  if (child_pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    dup2(sv[1], IPC_FD);
+    close(sv[0]);
+    close(sv[1]);
+    run_limits_enter(host->cgroup_index);
+
+    check_posix(
+      execl(config.sinter_host_path, config.sinter_host_path, "--from-sling", "--heap-size", heap_size,
+        "--heap-mode", heap_mode_name(config.heap_mode), (char *) NULL),
+      "exec sinter host");
+
+    _Exit(1);
+  }
+
+  close(sv[1]);
+  host->pid = child_pid;
+  host->ipcfd = sv[0];
+  fcntl(host->ipcfd, F_SETFL, O_NONBLOCK);
+}
+
+static void fill_warm_pool(void) {
+  while (config.warm_pool_count < config.warm_pool_size) {
+    spawn_host(&config.warm_pool[config.warm_pool_count++]);
+  }
+}
+
+static bool take_warm_host(struct sling_host *host) {
+  if (config.warm_pool_count == 0) {
+    return false;
+  }
+  // take the oldest host, as it is the most likely to have finished starting up
+  *host = config.warm_pool[0];
+  memmove(config.warm_pool, config.warm_pool + 1, --config.warm_pool_count * sizeof(*config.warm_pool));
+  return true;
+}
+
+static bool remove_warm_host(pid_t pid) {
+  for (size_t i = 0; i < config.warm_pool_count; ++i) {
+    if (config.warm_pool[i].pid == pid) {
+      close(config.warm_pool[i].ipcfd);
+      run_limits_remove_cgroup(config.warm_pool[i].cgroup_index);
+      config.warm_pool[i] = config.warm_pool[--config.warm_pool_count];
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// 64-bit, as a 32-bit long holds only 35 minutes of microseconds
+static int64_t elapsed_us(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static void set_deadline(struct timespec *deadline, long ms) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  // in seconds and the rest, so a 32-bit long does not overflow
+  deadline->tv_sec += ms / 1000;
+  deadline->tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L) {
+    ++deadline->tv_sec;
+    deadline->tv_nsec -= 1000000000L;
+  } else if (deadline->tv_nsec < 0) {
+    // a prompt may leave a run less than no time
+    --deadline->tv_sec;
+    deadline->tv_nsec += 1000000000L;
+  }
+}
+
+// Rounds up, so that waiting this long means the deadline has passed
+static long ms_until(const struct timespec *deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (deadline->tv_sec - now.tv_sec) * 1000L + (deadline->tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+}
+
+static void log_run_start_latency(struct sling_run *run) {
+  if (run->has_output) {
+    return;
+  }
+  run->has_output = true;
+  metrics_observe_us(metrics_first_display_latency, elapsed_us(&run->start_time));
+  if (config.debug_log) {
+    eprintf("Run %08x start latency (%s host): %lld us\n", run->id, run->is_warm ? "warm" : "cold",
+      (long long) elapsed_us(&run->start_time));
+  }
+}
+
+static int make_program_fd(const char *program, size_t program_size) {
+  int fd = check_posix(memfd_create("sling-program", MFD_CLOEXEC | MFD_ALLOW_SEALING), "memfd_create");
+  for (size_t written = 0; written < program_size; ) {
+    written += check_posix(write(fd, program + written, program_size - written), "program memfd write");
+  }
+  // the host maps the program directly, so make sure it cannot change under it
+  check_posix(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL),
+    "program memfd seal");
+  return fd;
+}
+
+static void save_program_file(const char *program, size_t program_size) {
+  FILE *program_file = fopen(config.program_path, "w");
+  if (!program_file) {
+    check_posix(-1, "program file fopen");
+  }
+  if (!fwrite(program, program_size, 1, program_file)) {
+    fatal_error("Failed to write program file");
+  }
+  check_posix(fclose(program_file), "program file fclose");
+}
+
+static bool send_run_request(struct sling_host *host, struct sling_run *run, int program_fd, size_t program_size,
+                             uint32_t heap_size) {
+  if (config.use_ipc_ring && !run->ipc_ring.header) {
+    setup_ipc_ring(&run->ipc_ring, config.ipc_ring_size);
+    if (!config.ipc_paused) {
+      main_loop_epoll_add(main_loop_epoll_ipc_ring, run - config.runs, run->ipc_ring.data_efd);
+    }
+  }
+  struct ipc_run_request request = {
+    .program_size = program_size,
+    .ring_size = config.use_ipc_ring ? run->ipc_ring.capacity : 0,
+    .heap_size = heap_size,
+    .heap_mode = config.heap_mode
+  };
+  int fds[IPC_RUN_REQUEST_MAX_FDS] = { program_fd };
+  size_t fd_count = 1;
+  if (config.use_ipc_ring) {
+    ipc_ring_reset(&run->ipc_ring);
+    fds[fd_count++] = run->ipc_ring.memfd;
+    fds[fd_count++] = run->ipc_ring.data_efd;
+    fds[fd_count++] = run->ipc_ring.space_efd;
+  }
+
+  struct iovec iov = { .iov_base = &request, .iov_len = sizeof(request) };
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = CMSG_SPACE(fd_count * sizeof(int))
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+
+  return sendmsg(host->ipcfd, &msg, 0) != -1;
+}
+
+static struct sling_run *find_run(struct sling_device *device, sling_run_id_t run_id) {
+  for (size_t i = 0; i < config.max_runs; ++i) {
+    if (device->runs[i].host_pid > 0 && device->runs[i].id == run_id) {
+      return device->runs + i;
+    }
+  }
+  return NULL;
+}
+
+// Returns a free slot for a new run, or NULL if the run cannot start now
+static struct sling_run *claim_run(struct sling_device *device, sling_run_id_t run_id) {
+  if (device->run_count < config.max_runs && !find_run(device, run_id)) {
+    for (size_t i = 0; i < config.max_runs; ++i) {
+      if (device->runs[i].host_pid <= 0) {
+        return device->runs + i;
+      }
+    }
+  }
+
+  // tell the client what happened to its run instead
+  if (config.max_runs == 1) {
+    send_status(device);
+  } else {
+    send_run_status(device, run_id,
+      find_run(device, run_id) ? sling_message_status_type_running : sling_message_status_type_idle);
+  }
+  return NULL;
+}
+
+static void begin_run_program(struct sling_run *run, sling_run_id_t run_id, int program_fd, size_t program_size,
+                              const struct run_options *options) {
+  struct sling_host host;
+  run->is_warm = take_warm_host(&host);
+  if (run->is_warm && !send_run_request(&host, run, program_fd, program_size, options->heap_size)) {
+    // the host died while waiting; start a fresh one instead
+    kill(host.pid, SIGKILL);
+    close(host.ipcfd);
+    waitpid(host.pid, NULL, 0);
+    run_limits_remove_cgroup(host.cgroup_index);
+    run->is_warm = false;
+  }
+  if (!run->is_warm) {
+    spawn_host(&host);
+    if (!send_run_request(&host, run, program_fd, program_size, options->heap_size)) {
+      check_posix(-1, "send run request");
+    }
+  }
+
+  metrics_count(metrics_runs_started, 1);
+  metrics_observe_us(metrics_host_ready_latency, elapsed_us(&run->start_time));
+
+  run->id = run_id;
+  run->host_pid = host.pid;
+  run->ipcfd = host.ipcfd;
+  run->cgroup_index = host.cgroup_index;
+  run->stop_requested = run->timed_out = run->output_killed = false;
+  run->dropped_displays = 0;
+  struct output_limits output_limits = config.output_limits;
+  if (options->has_output_limits) {
+    output_limits.bytes_per_second =
+      output_limit_min(output_limits.bytes_per_second, options->output_limits.bytes_per_second);
+    output_limits.messages_per_second =
+      output_limit_min(output_limits.messages_per_second, options->output_limits.messages_per_second);
+    output_limits.max_bytes = output_limit_min(output_limits.max_bytes, options->output_limits.max_bytes);
+  }
+  output_governor_init(&run->output_governor, &output_limits, monotonic_ns());
+  run->dropping_line = false;
+  if (config.time_limit_ms) {
+    set_deadline(&run->deadline, config.time_limit_ms);
+  }
+  run->display_start_counter = run->last_flush_counter = 0;
+  run->has_output = false;
+  run->compress_display = options->accept_compressed_display && config.compress_threshold;
+  run->ipc_messages = run->ipc_wakeups = 0;
+  ++run->device->run_count;
+  ++config.run_count;
+  send_run_status(run->device, run_id, sling_message_status_type_running);
+  if (!config.ipc_paused) {
+    main_loop_epoll_add(main_loop_epoll_ipc, run - config.runs, run->ipcfd);
+  }
+
+  fill_warm_pool();
+}
+
+// Strips the run header, if any, off the front of a run payload
+static bool parse_run_header(const char **program, size_t *program_size, struct run_options *options) {
+  struct sling_run_header header;
+  if (*program_size < sizeof(header)) {
+    return true;
+  }
+  memcpy(&header, *program, sizeof(header));
+  if (header.magic != SLING_RUN_HEADER_MAGIC) {
+    return true;
+  }
+  if (header.header_size < sizeof(header) || header.header_size > *program_size) {
+    return false;
+  }
+
+  for (size_t offset = sizeof(header); offset + sizeof(struct sling_run_option) <= header.header_size; ) {
+    struct sling_run_option option;
+    memcpy(&option, *program + offset, sizeof(option));
+    const char *value = *program + offset + sizeof(option);
+    offset += sizeof(option) + option.length;
+    if (offset > header.header_size) {
+      return false;
+    }
+
+    switch ((enum sling_run_option_type) option.type) {
+    case sling_run_option_run_id:
+      if (option.length != sizeof(options->run_id)) {
+        return false;
+      }
+      memcpy(&options->run_id, value, sizeof(options->run_id));
+      options->has_run_id = true;
+      break;
+    case sling_run_option_heap_size:
+      if (option.length != sizeof(options->heap_size)) {
+        return false;
+      }
+      memcpy(&options->heap_size, value, sizeof(options->heap_size));
+      options->has_heap_size = true;
+      break;
+    case sling_run_option_compressed_program:
+      if (option.length != sizeof(options->uncompressed_size)) {
+        return false;
+      }
+      memcpy(&options->uncompressed_size, value, sizeof(options->uncompressed_size));
+      options->is_compressed = true;
+      break;
+    case sling_run_option_accept_compressed_display:
+      options->accept_compressed_display = true;
+      break;
+    case sling_run_option_output_limits: {
+      struct sling_run_option_output_limits limits;
+      if (option.length != sizeof(limits)) {
+        return false;
+      }
+      memcpy(&limits, value, sizeof(limits));
+      options->output_limits = (struct output_limits){
+        .bytes_per_second = limits.bytes_per_second,
+        .messages_per_second = limits.messages_per_second,
+        .max_bytes = limits.max_bytes,
+      };
+      options->has_output_limits = true;
+      break;
+    }
+    default:
+      // options we don't know about are safe to ignore
+      break;
+    }
+  }
+
+  *program += header.header_size;
+  *program_size -= header.header_size;
+  return true;
+}
+
+static uint64_t cpu_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns the decompressed program, to be freed by the caller, or NULL if it is malformed
+static char *decompress_program(const char *program, size_t program_size, uint32_t uncompressed_size) {
+  if (!config.compress_threshold || uncompressed_size > COMPRESSED_PROGRAM_MAX) {
+    return NULL;
+  }
+  char *decompressed = malloc(uncompressed_size ? uncompressed_size : 1);
+  if (!decompressed) {
+    fatal_error("Out of memory\n");
+  }
+
+  const uint64_t start = cpu_time_ns();
+  const bool ok = sling_lz4_decompress(program, program_size, decompressed, uncompressed_size);
+  metrics_count(metrics_decompress_cpu_ns, cpu_time_ns() - start);
+  metrics_count(metrics_decompress_input_bytes, program_size);
+  if (!ok) {
+    free(decompressed);
+    return NULL;
+  }
+  metrics_count(metrics_decompress_output_bytes, uncompressed_size);
+  return decompressed;
+}
+
+static void start_program(struct sling_device *device, const char *program, size_t program_size,
+                          sling_run_id_t run_id, const struct run_options *options) {
+  struct sling_run *run = claim_run(device, run_id);
+  if (!run) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &run->start_time);
+
+  if (config.program_path) {
+    save_program_file(program, program_size);
+  }
+
+  uint8_t hash[SLING_PROGRAM_HASH_SIZE];
+  program_cache_hash(program, program_size, hash);
+  size_t cached_size;
+  int program_fd = program_cache_get(hash, &cached_size);
+  if (program_fd != -1) {
+    begin_run_program(run, run_id, program_fd, cached_size, options);
+    return;
+  }
+
+  program_fd = make_program_fd(program, program_size);
+  begin_run_program(run, run_id, program_fd, program_size, options);
+  program_cache_put(hash, program_fd, program_size);
+}
+
+static void run_program(struct sling_device *device, const char *program, size_t program_size,
+                        sling_run_id_t run_id) {
+  metrics_count(metrics_runs_received, 1);
+  struct run_options options = {0};
+  if (!parse_run_header(&program, &program_size, &options)) {
+    eprintf("Ignoring run with a malformed header\n");
+    return;
+  }
+  if (options.has_run_id) {
+    run_id = options.run_id;
+  }
+  if (!options.has_heap_size) {
+    options.heap_size = config.heap_size;
+  } else if (options.heap_size < IPC_HEAP_SIZE_MIN) {
+    options.heap_size = IPC_HEAP_SIZE_MIN;
+  } else if (options.heap_size > config.max_heap_size) {
+    options.heap_size = config.max_heap_size;
+  }
+
+  if (!options.is_compressed) {
+    start_program(device, program, program_size, run_id, &options);
+    return;
+  }
+
+  // hashed and cached decompressed, so run_cached names the same program either way
+  char *decompressed = decompress_program(program, program_size, options.uncompressed_size);
+  if (!decompressed) {
+    eprintf("Ignoring run with a compressed program we cannot decompress\n");
+    return;
+  }
+  start_program(device, decompressed, options.uncompressed_size, run_id, &options);
+  free(decompressed);
+}
+
+static void run_cached_program(struct sling_device *device, const uint8_t *hash, sling_run_id_t run_id) {
+  metrics_count(metrics_runs_received, 1);
+  struct sling_run *run = claim_run(device, run_id);
+  if (!run) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &run->start_time);
+
+  size_t program_size;
+  int program_fd = program_cache_get(hash, &program_size);
+  if (program_fd == -1) {
+    send_cache_miss(device, hash, run_id);
+    return;
+  }
+
+  // there is nowhere to give run header options in run_cached
+  struct run_options options = { .heap_size = config.heap_size };
+  begin_run_program(run, run_id, program_fd, program_size, &options);
+}
+
+static void stop_program(struct sling_device *device, const sling_run_id_t *run_id) {
+  bool stopped = false;
+  for (size_t i = 0; i < config.max_runs; ++i) {
+    struct sling_run *run = device->runs + i;
+    if (run->host_pid > 0 && (!run_id || run->id == *run_id)) {
+      kill(run->host_pid, SIGTERM);
+      run->stop_requested = stopped = true;
+    }
+  }
+
+  if (stopped) {
+    return;
+  }
+  if (run_id && config.max_runs > 1) {
+    send_run_status(device, *run_id, sling_message_status_type_idle);
+  } else {
+    send_status(device);
+  }
+}
+
+// Takes output from Sinter hosts out of the main loop, or puts it back
+static void set_ipc_paused(bool paused) {
+  config.ipc_paused = paused;
+  for (size_t i = 0; i < config.run_slot_count; ++i) {
+    struct sling_run *run = config.runs + i;
+    if (run->host_pid > 0 && run->ipcfd != -1) {
+      if (paused) {
+        main_loop_epoll_del(run->ipcfd);
+      } else {
+        main_loop_epoll_add(main_loop_epoll_ipc, i, run->ipcfd);
+      }
+    }
+    if (run->ipc_ring.header) {
+      if (paused) {
+        main_loop_epoll_del(run->ipc_ring.data_efd);
+      } else {
+        main_loop_epoll_add(main_loop_epoll_ipc_ring, i, run->ipc_ring.data_efd);
+      }
+    }
+  }
+}
+
+static void update_backpressure(void) {
+  if (!config.queue_high) {
+    return;
+  }
+
+  if (!config.throttled && config.publish_queue.bytes >= config.queue_high) {
+    config.throttled = true;
+    clock_gettime(CLOCK_MONOTONIC, &config.throttle_start);
+    if (config.overflow_policy == overflow_policy_block) {
+      set_ipc_paused(true);
+    }
+    if (config.debug_log) {
+      eprintf("Throttling output: %zu bytes waiting to be published\n", config.publish_queue.bytes);
+    }
+  } else if (config.throttled && config.publish_queue.bytes <= config.queue_low) {
+    config.throttled = false;
+    metrics_count(metrics_throttled_ns, elapsed_us(&config.throttle_start) * 1000);
+    if (config.ipc_paused) {
+      set_ipc_paused(false);
+    }
+    if (config.debug_log) {
+      eprintf("Throttling lifted after %lld us\n", (long long) elapsed_us(&config.throttle_start));
+    }
+  }
+}
+
+static void publish(const char *topic, size_t size, const void *payload) {
+  int mid;
+  check_mosq(mosquitto_publish(mosq, &mid, topic, size, payload, 1, false));
+  metrics_count(metrics_mqtt_publishes, 1);
+  metrics_count(metrics_mqtt_publish_bytes, size);
+  if (!publish_queue_push(&config.publish_queue, mid, size)) {
+    fatal_error("Out of memory\n");
+  }
+  update_backpressure();
+}
+
+static const char *device_topic(const struct sling_device *device, enum replay_journal_topic topic) {
+  switch (topic) {
+  case replay_journal_topic_hello:
+    return device->outtopic_hello;
+  case replay_journal_topic_status:
+    return device->outtopic_status;
+  case replay_journal_topic_display:
+    return device->outtopic_display;
+  case replay_journal_topic_cache_miss:
+    return device->outtopic_cache_miss;
+  case replay_journal_topic_exit:
+    return device->outtopic_exit;
+  case replay_journal_topic_count:
+    break;
+  }
+  return NULL;
+}
+
+// Publishes a message that takes up message numbers, keeping it in the journal if enabled
+static void publish_numbered(struct sling_device *device, enum replay_journal_topic topic, size_t size, const void *payload) {
+  if (device->journal.header) {
+    replay_journal_append(&device->journal, topic, payload, size);
+  }
+  publish(device_topic(device, topic), size, payload);
+}
+
+static void on_publish(struct mosquitto *mosq, void *obj, int mid) {
+  (void) mosq; (void) obj;
+  publish_queue_ack(&config.publish_queue, mid);
+  update_backpressure();
+}
+
+static void on_log(struct mosquitto *mosq, void *obj, int level, const char *message) {
+  (void) mosq; (void) obj;
+  eprintf("[%d]: %s\n", level, message);
+}
+
+static void on_connect(struct mosquitto *mosq, void *obj, int ret) {
+  (void) obj;
+  if (ret) {
+    fatal_error("Failed to connect: %d\n", ret);
+  }
+
+  for (size_t i = 0; i < config.device_count; ++i) {
+    struct sling_device *device = config.devices + i;
+    send_hello_if_zero(device);
+    send_status(device);
+    mosquitto_subscribe(mosq, NULL, device->intopic_run, 1);
+    mosquitto_subscribe(mosq, NULL, device->intopic_run_cached, 1);
+    mosquitto_subscribe(mosq, NULL, device->intopic_stop, 1);
+    mosquitto_subscribe(mosq, NULL, device->intopic_ping, 1);
+    mosquitto_subscribe(mosq, NULL, device->intopic_input, 1);
+    if (device->journal.header) {
+      mosquitto_subscribe(mosq, NULL, device->intopic_replay, 1);
+    }
+  }
+}
+
+static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message) {
+  (void) mosq; (void) obj;
+  // topics are <device id>/<message type>, and message types have no / in them
+  const char *type = strrchr(message->topic, '/');
+  size_t device_index;
+  if (!type || message->payloadlen < 4
+      || !device_table_find(&config.device_table, message->topic, type - message->topic, &device_index)) {
+    return;
+  }
+  struct sling_device *device = config.devices + device_index;
+  ++type;
+
+  const uint32_t message_id = *(uint32_t *)message->payload;
+  switch (message_dedup_check(&device->dedup, message_id, monotonic_ns())) {
+  case message_dedup_duplicate:
+    metrics_count(metrics_dedup_hits, 1);
+    return;
+  case message_dedup_new_evicted:
+    metrics_count(metrics_dedup_evictions, 1);
+    // fall through
+  case message_dedup_new:
+    metrics_count(metrics_dedup_misses, 1);
+    break;
+  }
+
+  // a run ID may trail run_cached and stop; runs are otherwise named by their message ID
+  sling_run_id_t run_id = message_id;
+  if (!strcmp(type, SLING_INTOPIC_RUN)) {
+    run_program(device, (const char *)message->payload + 4, message->payloadlen - 4, run_id);
+  } else if (!strcmp(type, SLING_INTOPIC_RUN_CACHED)) {
+    const size_t size = sizeof(struct sling_message_run_cached);
+    if ((size_t) message->payloadlen >= size) {
+      if ((size_t) message->payloadlen >= size + sizeof(run_id)) {
+        memcpy(&run_id, (const char *) message->payload + size, sizeof(run_id));
+      }
+      run_cached_program(device, ((const struct sling_message_run_cached *) message->payload)->program_hash, run_id);
+    }
+  } else if (!strcmp(type, SLING_INTOPIC_STOP)) {
+    if (message->payloadlen >= 8) {
+      memcpy(&run_id, (const char *) message->payload + 4, sizeof(run_id));
+      stop_program(device, &run_id);
+    } else {
+      stop_program(device, NULL);
+    }
+  } else if (!strcmp(type, SLING_INTOPIC_PING)) {
+    send_status(device);
+    for (size_t i = 0; i < config.max_runs; ++i) {
+      struct sling_run *run = device->runs + i;
+      if (run->host_pid > 0 && run->prompt) {
+        send_prompt_status(run);
+      } else if (run->host_pid > 0 && config.max_runs > 1) {
+        send_run_status(device, run->id, sling_message_status_type_running);
+      }
+    }
+  } else if (!strcmp(type, SLING_INTOPIC_INPUT)) {
+    handle_input(device, message->payload, message->payloadlen);
+  } else if (!strcmp(type, SLING_INTOPIC_REPLAY)) {
+    handle_replay(device, message->payload, message->payloadlen);
+  }
+}
+
+// A message from a host, plus the run ID we may append
+#define DISPLAY_MESSAGE_MAX (IPC_MESSAGE_MAX + sizeof(sling_run_id_t))
+
+static void flush_display_batch(struct sling_device *device) {
+  struct sling_message_display_batch *batch = device->display_batch;
+  if (!batch || batch->record_count == 0) {
+    return;
+  }
+
+  if (batch->record_count == 1) {
+    // not worth the batch header
+    uint16_t record_size;
+    memcpy(&record_size, batch->records, sizeof(record_size));
+    publish_numbered(device, replay_journal_topic_display, record_size, batch->records + sizeof(record_size));
+  } else {
+    publish_numbered(device, replay_journal_topic_display, device->display_batch_size, batch);
+  }
+  batch->record_count = 0;
+  device->display_batch_size = sizeof(*batch);
+  --config.pending_display_batches;
+}
+
+static void publish_display(struct sling_device *device, const void *message, size_t size, bool urgent) {
+  struct sling_message_display_batch *batch = device->display_batch;
+  if (!batch || size > DISPLAY_MESSAGE_MAX) {
+    flush_display_batch(device);
+    publish_numbered(device, replay_journal_topic_display, size, message);
+    return;
+  }
+
+  if (batch->record_count == 0) {
+    batch->message_counter = ((const struct sling_message_display *) message)->message_counter;
+    set_deadline(&device->display_batch_deadline, config.display_batch_ms);
+    ++config.pending_display_batches;
+  }
+
+  const uint16_t record_size = size;
+  char *out = (char *) batch + device->display_batch_size;
+  memcpy(out, &record_size, sizeof(record_size));
+  memcpy(out + sizeof(record_size), message, size);
+  device->display_batch_size += sizeof(record_size) + size;
+  ++batch->record_count;
+
+  if (urgent || device->display_batch_size >= config.display_batch_bytes || batch->record_count == UINT16_MAX) {
+    flush_display_batch(device);
+  }
+}
+
+// Returns the time in milliseconds until the next pending batch is due, or -1 if there is none
+static long flush_display_batches_if_due(void) {
+  long next_ms = -1;
+  for (size_t i = 0; config.pending_display_batches && i < config.device_count; ++i) {
+    struct sling_device *device = config.devices + i;
+    if (!device->display_batch || device->display_batch->record_count == 0) {
+      continue;
+    }
+
+    long remaining_ms = ms_until(&device->display_batch_deadline);
+    if (remaining_ms <= 0) {
+      flush_display_batch(device);
+    } else if (next_ms < 0 || remaining_ms < next_ms) {
+      next_ms = remaining_ms;
+    }
+  }
+  return next_ms;
+}
+
+static void setup_display_batch(struct sling_device *device) {
+  // room for one more message past the threshold, plus its length
+  device->display_batch = malloc(sizeof(*device->display_batch) + config.display_batch_bytes + sizeof(uint16_t) + DISPLAY_MESSAGE_MAX);
+  if (!device->display_batch) {
+    fatal_error("Failed to allocate display batch.\n");
+  }
+  device->display_batch->message_type = sling_message_display_type_batch;
+  device->display_batch->record_count = 0;
+  device->display_batch_size = sizeof(*device->display_batch);
+}
+
+static uint32_t device_capabilities(void) {
+  return (program_cache_enabled() ? sling_capability_program_cache : 0)
+    | (config.max_runs > 1 ? sling_capability_concurrent_runs : 0)
+    | (config.compress_threshold ? sling_capability_compression : 0)
+    | (config.journal_dir ? sling_capability_replay : 0);
+}
+
+static struct sling_message_hello make_hello(const struct sling_device *device) {
+  return (struct sling_message_hello) {
+    .message_counter = 0,
+    .nonce = device->nonce,
+    .capabilities = device_capabilities()
+  };
+}
+
+static void send_hello_if_zero(struct sling_device *device) {
+  if (device->message_counter != 0) {
+    return;
+  }
+  device->message_counter++;
+  fread(&device->nonce, sizeof(device->nonce), 1, config.urandom);
+  if (device->journal.header) {
+    replay_journal_reset(&device->journal, device->nonce);
+  }
+  const struct sling_message_hello payload = make_hello(device);
+  publish_numbered(device, replay_journal_topic_hello, sizeof(payload), &payload);
+}
+
+// Publishes payload, followed by run_id if we run several programs at once
+static void publish_with_run_id(struct sling_device *device, enum replay_journal_topic topic,
+    void *payload, size_t size, sling_run_id_t run_id) {
+  if (config.max_runs == 1) {
+    publish_numbered(device, topic, size, payload);
+    return;
+  }
+
+  char with_run_id[DISPLAY_MESSAGE_MAX];
+  memcpy(with_run_id, payload, size);
+  memcpy(with_run_id + size, &run_id, sizeof(run_id));
+  publish_numbered(device, topic, size + sizeof(run_id), with_run_id);
+}
+
+static void send_status(struct sling_device *device) {
+  send_hello_if_zero(device);
+  flush_display_batch(device);
+  struct sling_message_status publish_payload = {
+    .message_counter = device->message_counter++,
+    .status = device->status
+  };
+  publish_numbered(device, replay_journal_topic_status, sizeof(publish_payload), &publish_payload);
+}
+
+static void send_run_status(struct sling_device *device, sling_run_id_t run_id, device_status_t status) {
+  device->status = device->run_count ? sling_message_status_type_running : sling_message_status_type_idle;
+  if (config.max_runs == 1) {
+    send_status(device);
+    return;
+  }
+
+  send_hello_if_zero(device);
+  flush_display_batch(device);
+  struct sling_message_status publish_payload = {
+    .message_counter = device->message_counter++,
+    .status = status
+  };
+  publish_with_run_id(device, replay_journal_topic_status, &publish_payload, sizeof(publish_payload), run_id);
+}
+
+static void send_prompt_status(const struct sling_run *run) {
+  struct sling_device *device = run->device;
+  send_hello_if_zero(device);
+  flush_display_batch(device);
+  char buffer[DISPLAY_MESSAGE_MAX];
+  struct sling_message_status_prompt *payload = (struct sling_message_status_prompt *) buffer;
+  const size_t length = strlen(run->prompt);
+  payload->message_counter = device->message_counter++;
+  payload->status = sling_message_status_type_prompt;
+  payload->prompt_string_length = length;
+  memcpy(payload->prompt_string, run->prompt, length + 1);
+  publish_with_run_id(device, replay_journal_topic_status, payload, sizeof(*payload) + length + 1, run->id);
+}
+
+// The host blocks reading its IPC socket until we send it the response
+static void begin_prompt(struct sling_run *run, const struct sling_message_display *request, size_t size) {
+  const size_t max_length = size - sizeof(*request);
+  const size_t length = request->string_length < max_length ? request->string_length : max_length;
+  free(run->prompt);
+  run->prompt = strndup(request->string, length);
+  if (!run->prompt) {
+    fatal_error("Out of memory\n");
+  }
+  clock_gettime(CLOCK_MONOTONIC, &run->prompt_time);
+  if (config.time_limit_ms) {
+    run->prompt_remaining_ms = ms_until(&run->deadline);
+  }
+  send_prompt_status(run);
+}
+
+static void end_prompt(struct sling_run *run) {
+  free(run->prompt);
+  run->prompt = NULL;
+  if (config.time_limit_ms) {
+    set_deadline(&run->deadline, run->prompt_remaining_ms);
+  }
+}
+
+static void handle_input(struct sling_device *device, const char *payload, size_t size) {
+  const struct sling_message_display *input = (const struct sling_message_display *) payload;
+  if (size < sizeof(*input) + 1 || input->display_type != sling_message_display_type_prompt_response
+    || input->data_type != SLING_DISPLAY_DATA_STRING || input->string_length > size - sizeof(*input) - 1) {
+    return;
+  }
+
+  // as with stop, the run ID trails for devices running several programs at once
+  struct sling_run *run = device->runs;
+  const size_t run_id_offset = sizeof(*input) + input->string_length + 1;
+  if (config.max_runs > 1) {
+    sling_run_id_t run_id;
+    if (size < run_id_offset + sizeof(run_id)) {
+      return;
+    }
+    memcpy(&run_id, payload + run_id_offset, sizeof(run_id));
+    run = find_run(device, run_id);
+  }
+  if (!run || run->host_pid <= 0 || !run->prompt) {
+    return;
+  }
+
+  // with the null terminator, so an empty response is not mistaken for the socket closing
+  size_t length = input->string_length;
+  if (length > IPC_DISPLAY_BUF_SIZE - 1) {
+    length = IPC_DISPLAY_BUF_SIZE - 1;
+  }
+  char response[IPC_DISPLAY_BUF_SIZE];
+  memcpy(response, input->string, length);
+  response[length] = '\0';
+  if (send(run->ipcfd, response, length + 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1 && config.debug_log) {
+    eprintf("Run %08x: failed to send input: %s\n", run->id, strerror(errno));
+  }
+
+  const int64_t latency_us = elapsed_us(&run->prompt_time);
+  metrics_observe_us(metrics_prompt_latency, latency_us);
+  if (config.debug_log) {
+    eprintf("Run %08x: input arrived %lld us after the prompt\n", run->id, (long long) latency_us);
+  }
+  end_prompt(run);
+  send_run_status(device, run->id, sling_message_status_type_running);
+}
+
+static uint32_t saturate_u32(int64_t value) {
+  return value < 0 ? 0 : value > UINT32_MAX ? UINT32_MAX : (uint32_t) value;
+}
+
+static uint32_t timeval_us(const struct timeval *tv) {
+  return saturate_u32((int64_t) tv->tv_sec * 1000000 + tv->tv_usec);
+}
+
+static enum sling_exit_reason exit_reason(const struct sling_run *run, int status, const struct rusage *usage) {
+  if (run->timed_out) {
+    return sling_exit_reason_time_limit;
+  }
+  if (run->output_killed) {
+    return sling_exit_reason_output_limit;
+  }
+  if (run_limits_oom_killed(run->cgroup_index)) {
+    return sling_exit_reason_memory_limit;
+  }
+  if (config.limits.memory_bytes && WIFEXITED(status) && WEXITSTATUS(status) == child_exit_malloc_fail) {
+    // without a cgroup, the limit is on address space, so a heap too big for it cannot be mapped
+    return sling_exit_reason_memory_limit;
+  }
+  if (WIFSIGNALED(status) && config.limits.cpu_seconds && (WTERMSIG(status) == SIGXCPU
+      || (unsigned long) (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) >= config.limits.cpu_seconds)) {
+    return sling_exit_reason_cpu_limit;
+  }
+  if (run->stop_requested) {
+    return sling_exit_reason_stopped;
+  }
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    return sling_exit_reason_finished;
+  }
+  return sling_exit_reason_crashed;
+}
+
+static void send_exit(const struct sling_run *run, int status, const struct rusage *usage) {
+  struct sling_device *device = run->device;
+  send_hello_if_zero(device);
+  flush_display_batch(device);
+  struct sling_message_exit publish_payload = {
+    .message_counter = device->message_counter++,
+    .reason = exit_reason(run, status, usage),
+    .exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : WIFSIGNALED(status) ? -WTERMSIG(status) : 0,
+    .wall_time_us = saturate_u32(elapsed_us(&run->start_time)),
+    .user_time_us = timeval_us(&usage->ru_utime),
+    .system_time_us = timeval_us(&usage->ru_stime),
+    .max_rss_kib = saturate_u32(usage->ru_maxrss),
+    .minor_faults = saturate_u32(usage->ru_minflt),
+    .major_faults = saturate_u32(usage->ru_majflt),
+    .voluntary_context_switches = saturate_u32(usage->ru_nvcsw),
+    .involuntary_context_switches = saturate_u32(usage->ru_nivcsw)
+  };
+  publish_with_run_id(device, replay_journal_topic_exit, &publish_payload, sizeof(publish_payload), run->id);
+}
+
+static void send_cache_miss(struct sling_device *device, const uint8_t *hash, sling_run_id_t run_id) {
+  send_hello_if_zero(device);
+  flush_display_batch(device);
+  struct sling_message_cache_miss publish_payload = {
+    .message_counter = device->message_counter++
+  };
+  memcpy(publish_payload.program_hash, hash, SLING_PROGRAM_HASH_SIZE);
+  publish_with_run_id(device, replay_journal_topic_cache_miss, &publish_payload, sizeof(publish_payload), run_id);
+}
+
+static void replay_message(void *ctx, enum replay_journal_topic topic, const void *payload, size_t size) {
+  const struct sling_device *device = ctx;
+  publish(device_topic(device, topic), size, payload);
+}
+
+// Publishes again what a client missed, from the message number it asks for
+static void handle_replay(struct sling_device *device, const void *payload, size_t size) {
+  if (!device->journal.header || size < sizeof(struct sling_message_replay)) {
+    return;
+  }
+  metrics_count(metrics_replay_requests, 1);
+  if (device->message_counter == 0) {
+    send_hello_if_zero(device);
+    return;
+  }
+  // batched messages are only journaled once published
+  flush_display_batch(device);
+
+  struct sling_message_replay request;
+  memcpy(&request, payload, sizeof(request));
+  if (request.nonce != device->nonce) {
+    // the client is behind a restart it did not see; all it has is stale, so start it over
+    const struct sling_message_hello hello = make_hello(device);
+    publish(device->outtopic_hello, sizeof(hello), &hello);
+    request.starting_id = 1;
+  }
+
+  const uint32_t oldest_id = replay_journal_oldest(&device->journal);
+  if ((int32_t) (oldest_id - request.starting_id) > 0) {
+    const struct sling_message_replay_gap gap = {.oldest_id = oldest_id};
+    publish(device->outtopic_replay_gap, sizeof(gap), &gap);
+  }
+  metrics_count(metrics_replayed_messages,
+    replay_journal_replay(&device->journal, request.starting_id, replay_message, device));
+}
+
+// Returns the message to send in place of a display message with a long string or
+// array body: a compressed copy in out, or the message itself if compression does not help
+static char *compress_display(char *message, size_t *size, char *out) {
+  const struct sling_message_display *display = (const struct sling_message_display *) message;
+  struct sling_message_display_compressed *compressed = (struct sling_message_display_compressed *) out;
+  // compressed must come out smaller, even with its longer header
+  const size_t header_growth = sizeof(*compressed) - sizeof(*display);
+  if (*size < sizeof(*display)
+      || (display->display_type & 0xff) == sling_message_display_type_flush
+      || (display->data_type != SLING_DISPLAY_DATA_STRING && display->data_type != SLING_DISPLAY_DATA_ARRAY)
+      || display->string_length < config.compress_threshold || display->string_length <= header_growth
+      || display->string_length > *size - sizeof(*display)) {
+    return message;
+  }
+
+  const uint64_t start = cpu_time_ns();
+  const size_t compressed_length = sling_lz4_compress(display->string, display->string_length, compressed->data,
+    display->string_length - header_growth);
+  metrics_count(metrics_compress_cpu_ns, cpu_time_ns() - start);
+  metrics_count(metrics_compress_input_bytes, display->string_length);
+  if (!compressed_length) {
+    metrics_count(metrics_compress_output_bytes, display->string_length);
+    return message;
+  }
+  metrics_count(metrics_compress_output_bytes, compressed_length);
+
+  compressed->message_counter = display->message_counter;
+  compressed->display_type = display->display_type;
+  compressed->data_type = display->data_type | SLING_DISPLAY_DATA_COMPRESSED;
+  compressed->string_length = display->string_length;
+  compressed->compressed_length = compressed_length;
+  *size = sizeof(*compressed) + compressed_length;
+  return out;
+}
+
+static void publish_ipc_display(struct sling_run *run, char *buffer, size_t size) {
+  struct sling_device *device = run->device;
+  struct sling_message_display *to_send = (struct sling_message_display *) buffer;
+  send_hello_if_zero(device);
+  to_send->message_counter = device->message_counter;
+  if (to_send->display_type == sling_message_display_type_flush) {
+    if (run->display_start_counter >= to_send->message_counter) {
+      // skip empty flush
+      return;
+    }
+    struct sling_message_display_flush *to_send_flush = (struct sling_message_display_flush *) buffer;
+    to_send_flush->starting_id = run->display_start_counter;
+    run->last_flush_counter = to_send->message_counter;
+    size = sizeof(*to_send_flush);
+  } else if (run->display_start_counter <= run->last_flush_counter) {
+    run->display_start_counter = to_send->message_counter;
+  }
+
+  if (to_send->display_type & sling_message_display_type_self_flushing) {
+    run->last_flush_counter = to_send->message_counter;
+  }
 
-#define fatal_errno(msg) do { perror(msg); _Exit(1); } while (0)
+  char compressed[DISPLAY_MESSAGE_MAX];
+  if (run->compress_display) {
+    buffer = compress_display(buffer, &size, compressed);
+  }
 
-static void check_mosq(int error) {
-  switch (error) {
-  case MOSQ_ERR_SUCCESS:
+  const uint16_t display_type = to_send->display_type & 0xff;
+  const bool urgent = display_type == sling_message_display_type_flush
+    || display_type == sling_message_display_type_result || display_type == sling_message_display_type_error;
+  ++device->message_counter;
+  if (config.max_runs == 1) {
+    publish_display(device, buffer, size, urgent);
     return;
-  case MOSQ_ERR_ERRNO:
-    perror("Mosquitto");
-    _Exit(1);
-  default:
-    eprintf("Mosquitto: %s\n", mosquitto_strerror(error));
-    _Exit(1);
   }
+
+  char with_run_id[DISPLAY_MESSAGE_MAX];
+  memcpy(with_run_id, buffer, size);
+  memcpy(with_run_id + size, &run->id, sizeof(run->id));
+  publish_display(device, with_run_id, size + sizeof(run->id), urgent);
 }
 
-static int check_posix(int result, const char *msg) {
-  if (result == -1) {
-    fatal_errno(msg);
+// Sends a line of our own about the run's output, as standard error. Only call this between lines
+__attribute__((format(printf, 2, 3))) static void send_notice(struct sling_run *run, const char *format, ...) {
+  char buffer[DISPLAY_MESSAGE_MAX];
+  struct sling_message_display *notice = (struct sling_message_display *) buffer;
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(notice->string, sizeof(buffer) - sizeof(*notice), format, args);
+  va_end(args);
+  notice->display_type = sling_message_display_type_error | sling_message_display_type_self_flushing;
+  notice->data_type = SLING_DISPLAY_DATA_STRING;
+  notice->string_length = length;
+  publish_ipc_display(run, buffer, sizeof(*notice) + length + 1);
+}
+
+// Tells the client how much output was dropped while publishing was throttled or over budget
+static void send_drop_marker(struct sling_run *run) {
+  if (run->dropped_displays) {
+    send_notice(run, "[%lu display messages dropped]", run->dropped_displays);
+    run->dropped_displays = 0;
   }
-  return result;
 }
 
-static int check_posix_nonblock(int result, const char *msg) {
-  if (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-    fatal_errno(msg);
+static void send_repeat_marker(struct sling_run *run) {
+  const unsigned long repeats = output_governor_take_repeats(&run->output_governor);
+  if (repeats) {
+    metrics_count(metrics_output_repeats, repeats);
+    send_notice(run, "[previous line repeated %lu times]", repeats);
   }
-  return result;
 }
 
-static void print_usage(char *argv0) {
-  eprintf("Usage: %s <options>\n\n%s", argv0,
-    "  -v, --debug:                         Log verbosely\n"
-    "  -h, --host, SLING_HOST:              The hostname of the MQTT server\n"
-    "  -p, --port, SLING_PORT:              The port of the MQTT server; defaults to 8883\n"
-    "  -i, --device-id, SLING_DEVICE_ID:    The device ID\n"
-    "  -s, --server-ca, SLING_CA:           Path to the CA issuing the MQTT server's TLS certificate, in PEM format\n"
-    "  -k, --client-key, SLING_KEY:         Path to the private key for the client's TLS certificate, in PEM format\n"
-    "  -c, --client-cert, SLING_CERT:       Path to the client's TLS certificate, in PEM format\n"
-    "  -H, --sinter-host, SINTER_HOST_PATH: Path to the Sinter host, or ./sinter_host by default\n"
-    "  -P, --program, SLING_PROGRAM_PATH:   Path to the location at which to save received programs, or ./program.svm by default\n"
-    "\n"
-    "Options can be passed in via environment variables. Command line options override environment variables.\n"
-    "\n"
-    "When specifying a boolean as an environment variable, specify 1 for true.\n"
-  );
+// Ends the line being published where it is, so the part that got through shows
+static void cut_line(struct sling_run *run) {
+  char buffer[sizeof(struct sling_message_display)] = {0};
+  ((struct sling_message_display *) buffer)->display_type = sling_message_display_type_flush;
+  publish_ipc_display(run, buffer, sizeof(struct sling_message_display_flush));
+}
+
+// Applies the run's output limits. Returns whether to publish the message
+static bool govern_output(struct sling_run *run, const char *buffer, size_t size) {
+  const struct sling_message_display *message = (const struct sling_message_display *) buffer;
+  if (run->dropping_line) {
+    run->dropping_line = message->display_type != sling_message_display_type_flush;
+    return false;
+  }
+
+  const bool is_output = (message->display_type & 0xff) == sling_message_display_type_output;
+  const bool at_line_start = run->display_start_counter <= run->last_flush_counter;
+  if (!is_output) {
+    if (at_line_start && message->display_type != sling_message_display_type_flush) {
+      // e.g. the result ends a run of repeated lines
+      send_repeat_marker(run);
+    }
+    return true;
+  }
+
+  const bool is_complete = message->display_type & sling_message_display_type_self_flushing;
+  enum output_verdict verdict;
+  if (at_line_start) {
+    // the message counter is yet to be filled in, so leave it out of the comparison
+    verdict = output_governor_line(&run->output_governor, monotonic_ns(),
+      buffer + sizeof(message->message_counter), size - sizeof(message->message_counter), is_complete);
+  } else {
+    // e.g. more of a long string, or of a streamed list
+    verdict = output_governor_fragment(&run->output_governor, monotonic_ns(), size);
+    if (verdict != output_verdict_send) {
+      cut_line(run);
+    }
+  }
+  switch (verdict) {
+  case output_verdict_send:
+    send_repeat_marker(run);
+    return true;
+  case output_verdict_repeat:
+    return false;
+  case output_verdict_drop:
+    send_repeat_marker(run);
+    ++run->dropped_displays;
+    metrics_count(metrics_output_rate_limited, 1);
+    break;
+  case output_verdict_truncate:
+    send_repeat_marker(run);
+    send_drop_marker(run);
+    send_notice(run, "[output truncated after %lu bytes]", (unsigned long) run->output_governor.total_bytes);
+    metrics_count(metrics_output_truncated, 1);
+    break;
+  case output_verdict_truncated:
+    break;
+  }
+  run->dropping_line = !is_complete;
+  return false;
 }
 
-static void begin_run_program(const char *program, size_t program_size) {
-  if (config.status != sling_message_status_type_idle) {
-    send_status();
+static void handle_ipc_message(struct sling_run *run, char *buffer, size_t size) {
+  if (size < sizeof(struct sling_message_display_flush)) {
+    // sanity check - skip if message is smaller than expected
     return;
   }
 
-  FILE *program_file = fopen(config.program_path, "w");
-  if (!program_file) {
-    check_posix(-1, "program file fopen");
+  log_run_start_latency(run);
+  ++run->ipc_messages;
+  metrics_count(metrics_ipc_messages, 1);
+  metrics_count(metrics_ipc_bytes, size);
+
+  if (((const struct sling_message_display *) buffer)->display_type == sling_message_display_type_prompt
+    && size >= sizeof(struct sling_message_display)) {
+    begin_prompt(run, (const struct sling_message_display *) buffer, size);
+    return;
   }
-  if (!fwrite(program, program_size, 1, program_file)) {
-    fatal_error("Failed to write program file");
+
+  // Under the block policy, the host is not read from while throttled, so only
+  // output that was already queued gets here. Results, errors and flushes always go through
+  const struct sling_message_display *message = (const struct sling_message_display *) buffer;
+  if (config.throttled && config.overflow_policy != overflow_policy_block
+    && (message->display_type & 0xff) == sling_message_display_type_output) {
+    ++run->dropped_displays;
+    metrics_count(metrics_display_dropped, 1);
+    if (config.overflow_policy == overflow_policy_kill && !run->output_killed) {
+      run->output_killed = true;
+      kill(run->host_pid, SIGKILL);
+    }
+    return;
+  }
+  if (!govern_output(run, buffer, size)) {
+    return;
+  }
+  if (!config.throttled && run->display_start_counter <= run->last_flush_counter) {
+    send_drop_marker(run);
   }
-  check_posix(fclose(program_file), "program file fclose");
 
-  int sv[2];
-  check_posix(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv), "socketpair");
+  publish_ipc_display(run, buffer, size);
+}
 
-  pid_t child_pid = check_posix(fork(), "fork");
-  if (child_pid == 0) {
-    prctl(PR_SET_PDEATHSIG, SIGKILL);
-    dup2(sv[1], 998);
-    close(sv[0]);
-    close(sv[1]);
+// Maximum number of records to handle per wakeup, so a chatty host cannot starve the MQTT connection
+#define IPC_RING_DRAIN_MAX 256
 
-    check_posix(
-      execl(config.sinter_host_path,
-        config.sinter_host_path, "--from-sling", config.program_path, (char *) NULL),
-      "exec sinter host");
+// Returns the number of datagrams received
+static int drain_ipc_socket(struct sling_run *run) {
+  int received = check_posix_nonblock(
+    recvmmsg(run->ipcfd, config.ipc_batch, config.ipc_batch_size, MSG_DONTWAIT, NULL), "ipc recvmmsg");
+  if (received <= 0) {
+    return 0;
+  }
 
-    _Exit(1);
-  } else if (child_pid > 0) {
-    close(sv[1]);
+  ++run->ipc_wakeups;
+  for (int i = 0; i < received; ++i) {
+    struct mmsghdr *message = config.ipc_batch + i;
+    if (message->msg_hdr.msg_flags & MSG_TRUNC) {
+      // the host never sends more than IPC_MESSAGE_MAX at once
+      eprintf("Dropping oversized IPC message\n");
+      continue;
+    }
+    handle_ipc_message(run, message->msg_hdr.msg_iov->iov_base, message->msg_len);
+  }
+  return received;
+}
 
-    config.host_pid = child_pid;
-    config.ipcfd = sv[0];
-    fcntl(config.ipcfd, F_SETFL, O_NONBLOCK);
-    change_status(sling_message_status_type_running);
-    main_loop_epoll_add(main_loop_epoll_ipc, config.ipcfd);
-  } else {
-    fatal_errno("fork");
-    change_status(sling_message_status_type_idle);
+static void setup_ipc_batch(void) {
+  config.ipc_batch = calloc(config.ipc_batch_size, sizeof(*config.ipc_batch));
+  struct iovec *iovs = calloc(config.ipc_batch_size, sizeof(*iovs));
+  char *buffers = malloc(config.ipc_batch_size * IPC_MESSAGE_MAX);
+  if (!config.ipc_batch || !iovs || !buffers) {
+    fatal_error("Failed to allocate IPC buffers.\n");
+  }
+
+  for (size_t i = 0; i < config.ipc_batch_size; ++i) {
+    iovs[i].iov_base = buffers + i * IPC_MESSAGE_MAX;
+    iovs[i].iov_len = IPC_MESSAGE_MAX;
+    config.ipc_batch[i].msg_hdr.msg_iov = iovs + i;
+    config.ipc_batch[i].msg_hdr.msg_iovlen = 1;
   }
 }
 
-static void stop_program(void) {
-  if (config.status == sling_message_status_type_idle || config.host_pid <= 0) {
-    send_status();
-    return;
+static void drain_ipc_ring(struct sling_run *run, size_t max_records) {
+  struct ipc_ring *ring = &run->ipc_ring;
+  uint64_t count;
+  check_posix_nonblock(read(ring->data_efd, &count, sizeof(count)), "ipc ring eventfd read");
+  ++run->ipc_wakeups;
+
+  for (size_t handled = 0; ; ) {
+    void *record;
+    uint32_t size;
+    int peekres = ipc_ring_peek(ring, &record, &size);
+    if (peekres == -1) {
+      eprintf("Sinter host corrupted the IPC ring\n");
+      if (run->host_pid > 0) {
+        kill(run->host_pid, SIGKILL);
+      }
+      return;
+    } else if (peekres == 0) {
+      if (ipc_ring_prepare_wait(ring)) {
+        return;
+      }
+      continue;
+    }
+
+    if (handled++ == max_records || (config.ipc_paused && max_records != SIZE_MAX)) {
+      // come back to the rest after servicing everything else, or once unpaused
+      uint64_t one = 1;
+      check_posix(write(ring->data_efd, &one, sizeof(one)), "ipc ring eventfd write");
+      return;
+    }
+    // the host can still write to the ring, so only ever check and use a copy
+    static char copy[IPC_MESSAGE_MAX];
+    memcpy(copy, record, size);
+    ipc_ring_consume(ring, size);
+    handle_ipc_message(run, copy, size);
+  }
+}
+
+static void setup_ipc_ring(struct ipc_ring *ring, size_t size) {
+  uint32_t capacity = IPC_RING_MIN_SIZE;
+  while (capacity < size && capacity < (1u << 30)) {
+    capacity <<= 1;
   }
 
-  kill(config.host_pid, SIGTERM);
+  int memfd = check_posix(memfd_create("sling-ipc-ring", MFD_CLOEXEC), "memfd_create");
+  check_posix(ftruncate(memfd, IPC_RING_HEADER_SIZE + capacity), "ipc ring ftruncate");
+  if (!ipc_ring_map(ring, memfd, capacity)) {
+    fatal_errno("ipc ring mmap");
+  }
+  ring->data_efd = check_posix(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), "eventfd");
+  // the host blocks on this one, so it must not be non-blocking
+  ring->space_efd = check_posix(eventfd(0, EFD_CLOEXEC), "eventfd");
 }
 
-static void on_log(struct mosquitto *mosq, void *obj, int level, const char *message) {
-  (void) mosq; (void) obj;
-  eprintf("[%d]: %s\n", level, message);
+static void setup_runs(size_t ipc_ring_size) {
+  config.run_slot_count = config.device_count * config.max_runs;
+  config.runs = calloc(config.run_slot_count, sizeof(*config.runs));
+  if (!config.runs) {
+    fatal_error("Failed to allocate runs.\n");
+  }
+  config.use_ipc_ring = ipc_ring_size != 0;
+  config.ipc_ring_size = ipc_ring_size;
+  for (size_t i = 0; i < config.device_count; ++i) {
+    config.devices[i].runs = config.runs + i * config.max_runs;
+  }
+  for (size_t i = 0; i < config.run_slot_count; ++i) {
+    config.runs[i].device = config.devices + i / config.max_runs;
+    config.runs[i].ipcfd = -1;
+  }
 }
 
-static void on_connect(struct mosquitto *mosq, void *obj, int ret) {
-  (void) obj;
-  if (ret) {
-    fatal_error("Failed to connect: %d\n", ret);
+static void finish_run(struct sling_run *run, int status, const struct rusage *usage) {
+  // the host is gone, so this is the last of its output
+  if (run->ipc_ring.header) {
+    drain_ipc_ring(run, SIZE_MAX);
   }
+  while (drain_ipc_socket(run) > 0) {
+    // keep going until the socket is empty
+  }
+  if (run->display_start_counter <= run->last_flush_counter) {
+    send_repeat_marker(run);
+  }
+  send_drop_marker(run);
 
-  send_hello_if_zero();
-  send_status();
-  mosquitto_subscribe(mosq, NULL, config.intopic_run, 1);
-  mosquitto_subscribe(mosq, NULL, config.intopic_stop, 1);
-  mosquitto_subscribe(mosq, NULL, config.intopic_ping, 1);
-  mosquitto_subscribe(mosq, NULL, config.intopic_input, 1);
+  log_run_start_latency(run);
+  if (config.debug_log && run->ipc_wakeups) {
+    eprintf("Run %08x: handled %lu IPC messages in %lu wakeups (%.1f per wakeup)\n", run->id,
+      run->ipc_messages, run->ipc_wakeups, (double) run->ipc_messages / run->ipc_wakeups);
+  }
+  if (config.debug_log) {
+    eprintf("Run %08x: %.3f s user, %.3f s system, %ld KiB max RSS\n", run->id,
+      usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+      usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6, usage->ru_maxrss);
+  }
+  metrics_observe_us(metrics_run_duration, elapsed_us(&run->start_time));
+  if (run->prompt) {
+    end_prompt(run);
+  }
+  send_exit(run, status, usage);
+  run_limits_remove_cgroup(run->cgroup_index);
+  close(run->ipcfd);
+  run->ipcfd = -1;
+  run->host_pid = 0;
+  --run->device->run_count;
+  --config.run_count;
+  send_run_status(run->device, run->id, sling_message_status_type_idle);
 }
 
-static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message) {
-  (void) mosq; (void) obj;
-  // hack: the 4 topics we subscribe to all start with <device id>/, and then
-  // the first letters of the message types are unique, so we only check those
-  if (config.intopic_index >= strlen(message->topic) || message->payloadlen < 4) {
-    return;
+// Kills runs past the time limit. Returns the time in milliseconds until the next deadline, or -1 if there is none
+static long kill_overdue_runs(void) {
+  if (!config.time_limit_ms) {
+    return -1;
   }
 
-  const uint32_t message_id = *(uint32_t *)message->payload;
-  for (size_t i = 0; i < LAST_MESSAGE_ID_BUF_SIZE; ++i) {
-    if (message_id == config.last_message_ids[i]) {
-      return;
+  long next_ms = -1;
+  for (size_t i = 0; i < config.run_slot_count; ++i) {
+    struct sling_run *run = config.runs + i;
+    if (run->host_pid <= 0 || run->timed_out || run->prompt) {
+      continue;
+    }
+    long remaining_ms = ms_until(&run->deadline);
+    if (remaining_ms <= 0) {
+      kill(run->host_pid, SIGKILL);
+      run->timed_out = true;
+    } else if (next_ms < 0 || remaining_ms < next_ms) {
+      next_ms = remaining_ms;
     }
   }
-  config.last_message_ids[config.last_message_id_index] = message_id;
-  config.last_message_id_index = (config.last_message_id_index + 1) & (LAST_MESSAGE_ID_BUF_SIZE - 1);
+  return next_ms;
+}
 
-  switch (message->topic[config.intopic_index]) {
-  case 'r': // run
-    begin_run_program((const char *)message->payload + 4, message->payloadlen - 4);
-    break;
-  case 's': // stop
-    stop_program();
-    break;
-  case 'p': // ping
-    send_status();
-    break;
-  case 'i': // input
-    // TODO
-    break;
-  }
+static char *format_metrics(size_t *size) {
+  metrics_set(metrics_runs_active, config.run_count);
+  metrics_set(metrics_warm_hosts, config.warm_pool_count);
+  metrics_set(metrics_mqtt_inflight, config.publish_queue.count);
+  metrics_set(metrics_mqtt_inflight_bytes, config.publish_queue.bytes);
+  metrics_set(metrics_throttled, config.throttled);
+  metrics_set(metrics_devices, config.device_count);
+  return metrics_format(size);
 }
 
-static void send_hello_if_zero(void) {
-  if (config.message_counter != 0) {
-    return;
+static void serve_metrics(void) {
+  int fd;
+  while ((fd = accept4(config.metrics_listenfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+    size_t size;
+    char *text = format_metrics(&size);
+    if (text) {
+      // best effort; a reader too slow to take it all at once gets a truncated copy
+      send(fd, text, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+      free(text);
+    }
+    close(fd);
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    perror("metrics accept");
   }
-  config.message_counter++;
-  uint32_t payload[2] = { 0 };
-  fread(payload + 1, sizeof(uint32_t), 1, config.urandom);
-  check_mosq(mosquitto_publish(mosq, NULL, config.outtopic_hello, sizeof(payload), payload, 1, false));
 }
 
-static void send_status(void) {
-  send_hello_if_zero();
-  struct sling_message_status publish_payload = {
-    .message_counter = config.message_counter++,
-    .status = config.status
-  };
-  check_mosq(mosquitto_publish(mosq, NULL, config.outtopic_status, sizeof(publish_payload), &publish_payload, 1, false));
+static void setup_metrics_socket(void) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(config.metrics_socket_path) >= sizeof(addr.sun_path)) {
+    fatal_error("Metrics socket path too long.\n");
+  }
+  strcpy(addr.sun_path, config.metrics_socket_path);
+  unlink(config.metrics_socket_path);
+
+  config.metrics_listenfd = check_posix(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0), "metrics socket");
+  check_posix(bind(config.metrics_listenfd, (struct sockaddr *) &addr, sizeof(addr)), "metrics bind");
+  check_posix(listen(config.metrics_listenfd, 8), "metrics listen");
 }
 
-static void change_status(device_status_t new_state) {
-  config.status = new_state;
-  send_status();
+// Returns the time in milliseconds until metrics are next due to be published, or -1 if they are not published
+static long publish_metrics_if_due(void) {
+  if (!config.metrics_interval_ms) {
+    return -1;
+  }
+
+  long remaining_ms = ms_until(&config.metrics_deadline);
+  if (remaining_ms > 0) {
+    return remaining_ms;
+  }
+
+  size_t size;
+  char *text = format_metrics(&size);
+  if (text) {
+    // not numbered, so clients that do not care can ignore it entirely
+    publish(config.devices[0].outtopic_metrics, size, text);
+    free(text);
+  }
+  set_deadline(&config.metrics_deadline, config.metrics_interval_ms);
+  return config.metrics_interval_ms;
 }
 
 static int main_loop_make_sigchldfd(void) {
@@ -268,25 +1819,30 @@ static int main_loop_make_sigchldfd(void) {
   return check_posix(signalfd(-1, &sigchldmask, SFD_CLOEXEC | SFD_NONBLOCK), "signalfd");
 }
 
-static void main_loop_epoll_add(enum main_loop_epoll_type type, int fd) {
+// The low byte of the epoll data is the type; the rest is the index of the run, if any
+static void main_loop_epoll_add(enum main_loop_epoll_type type, size_t run_index, int fd) {
   struct epoll_event ev = {
     .events = EPOLLIN,
     .data = {
-      .u32 = type
+      .u32 = type | run_index << 8
     }
   };
 
   check_posix(epoll_ctl(config.epollfd, EPOLL_CTL_ADD, fd, &ev), "epoll_ctl");
 }
 
+static void main_loop_epoll_del(int fd) {
+  check_posix(epoll_ctl(config.epollfd, EPOLL_CTL_DEL, fd, NULL), "epoll_ctl");
+}
+
 static int main_loop(void) {
-  size_t buffer_size = 0x4000;
+  const size_t buffer_size = 0x100;
   char *buffer = malloc(buffer_size);
   if (!buffer) {
     fatal_error("Failed to allocate buffer.");
   }
 
-  const size_t max_events = 3;
+  const size_t max_events = 16;
   struct epoll_event events[max_events];
 
   const int mosqfd = mosquitto_socket(mosq),
@@ -298,110 +1854,278 @@ static int main_loop(void) {
     fatal_error("Failed to get mosquitto FD.");
   }
 
-  main_loop_epoll_add(main_loop_epoll_mosq, mosqfd);
-  main_loop_epoll_add(main_loop_epoll_child, sigchldfd);
+  main_loop_epoll_add(main_loop_epoll_mosq, 0, mosqfd);
+  main_loop_epoll_add(main_loop_epoll_child, 0, sigchldfd);
+  if (config.metrics_listenfd != -1) {
+    main_loop_epoll_add(main_loop_epoll_metrics, 0, config.metrics_listenfd);
+  }
+  set_deadline(&config.metrics_deadline, config.metrics_interval_ms);
+
+  fill_warm_pool();
 
   while (1) {
-    int nfds = check_posix(epoll_wait(config.epollfd, events, max_events, 1000), "epoll_wait");
+    long timeout_ms = 1000;
+    const long due_ms[] = { flush_display_batches_if_due(), kill_overdue_runs(), publish_metrics_if_due() };
+    for (size_t i = 0; i < sizeof(due_ms) / sizeof(*due_ms); ++i) {
+      if (due_ms[i] >= 0 && due_ms[i] < timeout_ms) {
+        timeout_ms = due_ms[i];
+      }
+    }
+    int nfds = check_posix(epoll_wait(config.epollfd, events, max_events, timeout_ms), "epoll_wait");
     for (int n = 0; n < nfds; ++n) {
       struct epoll_event *ev = events + n;
-      switch (ev->data.u32) {
+      struct sling_run *run = config.runs + (ev->data.u32 >> 8);
+      switch ((enum main_loop_epoll_type) (ev->data.u32 & 0xff)) {
       case main_loop_epoll_mosq: {
         check_mosq(mosquitto_loop_read(mosq, 1));
         break;
       }
 
       case main_loop_epoll_ipc: {
-        ssize_t recv_size = check_posix_nonblock(recv(config.ipcfd, buffer, 0, MSG_PEEK | MSG_TRUNC), "ipc recv");
-        if (recv_size == -1) {
-          continue;
-        }
-
-        if ((size_t) recv_size > buffer_size) {
-          buffer_size = recv_size;
-          buffer = realloc(buffer, recv_size);
-          if (!buffer) {
-            fatal_error("Failed to allocate buffer.");
-          }
-        }
-
-        recv_size = check_posix(recv(config.ipcfd, buffer, buffer_size, 0), "ipc recv");
-        if (recv_size == -1 || (size_t)recv_size < sizeof(struct sling_message_display_flush)) {
-          // sanity check - skip if recv failed or message is smaller than expected
-          continue;
-        }
-
-        struct sling_message_display *to_send = (struct sling_message_display *) buffer;
-        send_hello_if_zero();
-        to_send->message_counter = config.message_counter;
-        if (to_send->display_type == sling_message_display_type_flush) {
-          if (config.display_start_counter >= to_send->message_counter) {
-            // skip empty flush
-            continue;
-          }
-          struct sling_message_display_flush *to_send_flush = (struct sling_message_display_flush *) buffer;
-          to_send_flush->starting_id = config.display_start_counter;
-          config.last_flush_counter = to_send->message_counter;
-          recv_size = sizeof(*to_send_flush);
-        } else if (config.display_start_counter <= config.last_flush_counter) {
-          config.display_start_counter = to_send->message_counter;
+        if (run->ipcfd != -1 && !config.ipc_paused) {
+          // otherwise, the run finished or output was paused earlier in this batch of events
+          drain_ipc_socket(run);
         }
+        break;
+      }
 
-        if (to_send->display_type & sling_message_display_type_self_flushing) {
-          config.last_flush_counter = to_send->message_counter;
+      case main_loop_epoll_ipc_ring: {
+        if (!config.ipc_paused) {
+          drain_ipc_ring(run, IPC_RING_DRAIN_MAX);
         }
+        break;
+      }
 
-        ++config.message_counter;
-        check_mosq(mosquitto_publish(mosq, NULL, config.outtopic_display, recv_size, buffer, 1, false));
+      case main_loop_epoll_metrics: {
+        serve_metrics();
         break;
       }
 
       case main_loop_epoll_child: {
-        if (recv(config.ipcfd, buffer, 0, MSG_PEEK | MSG_TRUNC) > 0) {
-          // don't handle the child exit yet
-          break;
-        }
-
         while (read(sigchldfd, buffer, buffer_size) >= 0) {
           // do nothing, just clear it
         }
-        while (waitpid(-1, NULL, WNOHANG) > 0) {
-          // TODO check the pid perhaps
-          // (now we just clean up the child i guess)
+        bool run_finished = false;
+        pid_t pid;
+        int status;
+        struct rusage usage;
+        while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+          bool was_run = false;
+          for (size_t i = 0; i < config.run_slot_count; ++i) {
+            if (config.runs[i].host_pid == pid) {
+              finish_run(config.runs + i, status, &usage);
+              was_run = run_finished = true;
+              break;
+            }
+          }
+          if (!was_run) {
+            // a warm host died before it was used; it is replaced when the next run starts
+            remove_warm_host(pid);
+          }
+        }
+        if (run_finished) {
+          fill_warm_pool();
         }
-        close(config.ipcfd);
-        config.ipcfd = -1;
-        change_status(sling_message_status_type_idle);
         break;
       }
 
       }
     }
 
+    flush_display_batches_if_due();
     check_mosq(mosquitto_loop_write(mosq, 1));
     check_mosq(mosquitto_loop_misc(mosq));
   }
 }
 
+static bool parse_heap_mode(const char *name, enum ipc_heap_mode *mode) {
+  if (!strcmp(name, "lazy")) {
+    *mode = ipc_heap_mode_lazy;
+  } else if (!strcmp(name, "prefault")) {
+    *mode = ipc_heap_mode_prefault;
+  } else if (!strcmp(name, "hugepage")) {
+    *mode = ipc_heap_mode_hugepage;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool parse_overflow_policy(const char *name, enum overflow_policy *policy) {
+  if (!strcmp(name, "block")) {
+    *policy = overflow_policy_block;
+  } else if (!strcmp(name, "drop")) {
+    *policy = overflow_policy_drop;
+  } else if (!strcmp(name, "kill")) {
+    *policy = overflow_policy_kill;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 static int read_env_int(const char *name, int def) {
   const char *val = getenv(name);
   return val ? atoi(val) : def;
 }
 
+static unsigned long read_env_ulong(const char *name, unsigned long def) {
+  const char *val = getenv(name);
+  return val ? strtoul(val, NULL, 0) : def;
+}
+
+// Appends the device IDs in path, one per line, to ids. Blank lines and lines starting with # are skipped
+static void read_device_ids(const char *path, const char ***ids, size_t *count) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    check_posix(-1, "devices file fopen");
+  }
+
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t length;
+  while ((length = getline(&line, &line_size, file)) != -1) {
+    char *start = line, *end = line + length;
+    while (start < end && isspace((unsigned char) *start)) {
+      ++start;
+    }
+    while (end > start && isspace((unsigned char) end[-1])) {
+      --end;
+    }
+    if (start == end || *start == '#') {
+      continue;
+    }
+    *end = '\0';
+
+    const char **grown = realloc(*ids, (*count + 1) * sizeof(**ids));
+    char *id = strdup(start);
+    if (!grown || !id) {
+      fatal_error("Out of memory\n");
+    }
+    *ids = grown;
+    (*ids)[(*count)++] = id;
+  }
+  if (ferror(file)) {
+    fatal_errno("devices file read");
+  }
+  free(line);
+  fclose(file);
+}
+
+// Opens <journal dir>/<device ID>.journal, with / and % in the ID escaped. If it
+// holds a session, the device carries on with it rather than saying hello again
+static void setup_journal(struct sling_device *device) {
+  const size_t dir_length = strlen(config.journal_dir);
+  char *path = malloc(dir_length + 3 * strlen(device->id) + sizeof("/.journal"));
+  if (!path) {
+    fatal_error("Out of memory\n");
+  }
+  char *out = path + dir_length;
+  memcpy(path, config.journal_dir, dir_length);
+  *out++ = '/';
+  for (const char *in = device->id; *in; ++in) {
+    if (*in == '/' || *in == '%') {
+      out += sprintf(out, "%%%02X", (unsigned char) *in);
+    } else {
+      *out++ = *in;
+    }
+  }
+  strcpy(out, ".journal");
+
+  if (!replay_journal_open(&device->journal, path, config.journal_size, device_capabilities())) {
+    fatal_errno(path);
+  }
+  free(path);
+  replay_journal_session(&device->journal, &device->nonce, &device->message_counter);
+}
+
+static void setup_devices(const char **ids, size_t count) {
+  config.devices = calloc(count, sizeof(*config.devices));
+  if (!config.devices || !device_table_init(&config.device_table, count)) {
+    fatal_error("Failed to allocate devices.\n");
+  }
+  config.device_count = count;
+
+  for (size_t i = 0; i < count; ++i) {
+    struct sling_device *device = config.devices + i;
+    device->id = ids[i];
+    if (!*device->id || strpbrk(device->id, "+#")) {
+      fatal_error("Invalid device ID %s.\n", device->id);
+    }
+    if (!device_table_add(&config.device_table, device->id, i)) {
+      fatal_error("Device ID %s given more than once.\n", device->id);
+    }
+
+    device->status = sling_message_status_type_idle;
+    if (!message_dedup_init(&device->dedup, config.dedup_window_s * 1000000000ULL)) {
+      fatal_error("Failed to allocate devices.\n");
+    }
+    if (config.display_batch_bytes) {
+      setup_display_batch(device);
+    }
+
+    device->outtopic_display = sling_topic(device->id, SLING_OUTTOPIC_DISPLAY);
+    device->outtopic_status = sling_topic(device->id, SLING_OUTTOPIC_STATUS);
+    device->outtopic_hello = sling_topic(device->id, SLING_OUTTOPIC_HELLO);
+    device->outtopic_cache_miss = sling_topic(device->id, SLING_OUTTOPIC_CACHE_MISS);
+    device->outtopic_exit = sling_topic(device->id, SLING_OUTTOPIC_EXIT);
+    device->outtopic_metrics = sling_topic(device->id, SLING_OUTTOPIC_METRICS);
+    device->outtopic_replay_gap = sling_topic(device->id, SLING_OUTTOPIC_REPLAY_GAP);
+
+    device->intopic_input = sling_topic(device->id, SLING_INTOPIC_INPUT);
+    device->intopic_ping = sling_topic(device->id, SLING_INTOPIC_PING);
+    device->intopic_run = sling_topic(device->id, SLING_INTOPIC_RUN);
+    device->intopic_run_cached = sling_topic(device->id, SLING_INTOPIC_RUN_CACHED);
+    device->intopic_stop = sling_topic(device->id, SLING_INTOPIC_STOP);
+    device->intopic_replay = sling_topic(device->id, SLING_INTOPIC_REPLAY);
+
+    if (config.journal_dir) {
+      setup_journal(device);
+    }
+  }
+}
+
 int main(int argc, char *argv[]) {
-  bool debug_log = false;
-  config.status = sling_message_status_type_idle;
-  config.ipcfd = config.epollfd = -1;
+  config.epollfd = config.metrics_listenfd = -1;
   config.host = getenv("SLING_HOST");
   config.port = read_env_int("SLING_PORT", 0);
+  config.use_tls = !read_env_int("SLING_NO_TLS", 0);
   config.device_id = getenv("SLING_DEVICE_ID");
+  config.devices_path = getenv("SLING_DEVICES");
+  config.client_id = getenv("SLING_CLIENT_ID");
   config.server_ca_path = getenv("SLING_CA");
   config.server_ca_dir = getenv("SLING_CA_DIR");
   config.client_key_path = getenv("SLING_KEY");
   config.client_cert_path = getenv("SLING_CERT");
   config.sinter_host_path = getenv("SINTER_HOST_PATH");
   config.program_path = getenv("SLING_PROGRAM_PATH");
-  config.message_counter = config.last_flush_counter = config.display_start_counter = 0;
+  config.warm_pool_size = read_env_int("SLING_WARM_POOL", 0);
+  size_t cache_size = read_env_int("SLING_CACHE_SIZE", 0x400000);
+  size_t ipc_ring_size = read_env_int("SLING_IPC_RING", 0);
+  config.ipc_batch_size = read_env_int("SLING_IPC_BATCH", 32);
+  config.display_batch_bytes = read_env_int("SLING_DISPLAY_BATCH_BYTES", 0);
+  config.display_batch_ms = read_env_int("SLING_DISPLAY_BATCH_MS", 20);
+  config.heap_size = read_env_ulong("SLING_HEAP_SIZE", IPC_HEAP_SIZE_DEFAULT);
+  config.max_heap_size = read_env_ulong("SLING_MAX_HEAP_SIZE", 0x4000000);
+  const char *heap_mode = getenv("SLING_HEAP_MODE");
+  config.compress_threshold = read_env_ulong("SLING_COMPRESS_THRESHOLD", 0);
+  config.queue_high = read_env_ulong("SLING_QUEUE_HIGH", 0x100000);
+  config.queue_low = read_env_ulong("SLING_QUEUE_LOW", SIZE_MAX);
+  const char *overflow_policy = getenv("SLING_OVERFLOW_POLICY");
+  config.output_limits.bytes_per_second = read_env_ulong("SLING_OUTPUT_RATE", 0);
+  config.output_limits.messages_per_second = read_env_ulong("SLING_OUTPUT_RATE_MESSAGES", 0);
+  config.output_limits.max_bytes = read_env_ulong("SLING_OUTPUT_MAX", 0);
+  config.dedup_window_s = read_env_ulong("SLING_DEDUP_WINDOW", 60);
+  config.journal_dir = getenv("SLING_JOURNAL_DIR");
+  config.journal_size = read_env_ulong("SLING_JOURNAL_SIZE", 0x100000);
+  config.max_runs = read_env_int("SLING_MAX_RUNS", 1);
+  config.limits.cgroup_path = getenv("SLING_CGROUP");
+  config.limits.cpu_percent = read_env_ulong("SLING_CPU_QUOTA", 0);
+  config.limits.cpu_seconds = read_env_ulong("SLING_CPU_TIME", 0);
+  config.limits.memory_bytes = read_env_ulong("SLING_MEMORY_LIMIT", 0);
+  config.time_limit_ms = read_env_int("SLING_TIME_LIMIT", 0);
+  config.metrics_socket_path = getenv("SLING_METRICS_SOCKET");
+  config.metrics_interval_ms = read_env_int("SLING_METRICS_INTERVAL", 0) * 1000L;
 
   while (1) {
     static struct option long_options[] = {
@@ -409,25 +2133,58 @@ int main(int argc, char *argv[]) {
       {"port",        required_argument, 0, 'p' },
       {"program",     required_argument, 0, 'P' },
       // {"use-tls",     no_argument,       0, 't' },
+      {"no-tls",      no_argument,       0, 'n' },
       {"device-id",   required_argument, 0, 'i' },
+      {"devices",     required_argument, 0, 'd' },
+      {"client-id",   required_argument, 0, 'l' },
       {"server-ca",   required_argument, 0, 's' },
       {"ca-dir",      required_argument, 0, 'S' },
       {"client-key",  required_argument, 0, 'k' },
       {"client-cert", required_argument, 0, 'c' },
       {"sinter-host", required_argument, 0, 'H' },
+      {"warm-pool",   required_argument, 0, 'w' },
+      {"cache-size",  required_argument, 0, 'C' },
+      {"ipc-ring",    required_argument, 0, 'R' },
+      {"ipc-batch",   required_argument, 0, 'I' },
+      {"max-runs",    required_argument, 0, 'm' },
+      {"cgroup",      required_argument, 0, 'g' },
+      {"cpu-quota",   required_argument, 0, 'q' },
+      {"cpu-time",    required_argument, 0, 'u' },
+      {"memory-limit", required_argument, 0, 'M' },
+      {"time-limit",  required_argument, 0, 'T' },
+      {"metrics-socket",   required_argument, 0, 'X' },
+      {"metrics-interval", required_argument, 0, 'x' },
+      {"display-batch-bytes", required_argument, 0, 'b' },
+      {"display-batch-ms",    required_argument, 0, 'B' },
+      {"heap-size",           required_argument, 0, 'e' },
+      {"max-heap-size",       required_argument, 0, 'E' },
+      {"heap-mode",           required_argument, 0, 'j' },
+      {"compress-threshold",  required_argument, 0, 'z' },
+      {"queue-high",          required_argument, 0, 'Q' },
+      {"queue-low",           required_argument, 0, 'L' },
+      {"overflow-policy",     required_argument, 0, 'O' },
+      {"output-rate",         required_argument, 0, 'r' },
+      {"output-rate-messages", required_argument, 0, 'N' },
+      {"output-max",          required_argument, 0, 'o' },
+      {"dedup-window",        required_argument, 0, 'D' },
+      {"journal-dir",         required_argument, 0, 'J' },
+      {"journal-size",        required_argument, 0, 'K' },
       {"debug",       no_argument,       0, 'v' },
       {"help",        no_argument,       0, 0   },
       {0,             0,                 0, 0   }
     };
 
-    int c = getopt_long(argc, argv, "P:H:h:p:i:s:k:c:v", long_options, NULL);
+    int c = getopt_long(argc, argv, "P:H:h:p:i:d:l:s:k:c:w:C:R:I:m:g:q:u:M:T:X:x:b:B:e:E:j:z:Q:L:O:r:N:o:D:J:K:nv", long_options, NULL);
     if (c == -1) {
       break;
     }
 
     switch (c) {
     case 'v':
-      debug_log = true;
+      config.debug_log = true;
+      break;
+    case 'n':
+      config.use_tls = false;
       break;
     case 'P':
       config.program_path = optarg;
@@ -435,6 +2192,87 @@ int main(int argc, char *argv[]) {
     case 'H':
       config.sinter_host_path = optarg;
       break;
+    case 'w':
+      config.warm_pool_size = atoi(optarg);
+      break;
+    case 'C':
+      cache_size = atoi(optarg);
+      break;
+    case 'R':
+      ipc_ring_size = atoi(optarg);
+      break;
+    case 'I':
+      config.ipc_batch_size = atoi(optarg);
+      break;
+    case 'm':
+      config.max_runs = atoi(optarg);
+      break;
+    case 'g':
+      config.limits.cgroup_path = optarg;
+      break;
+    case 'q':
+      config.limits.cpu_percent = strtoul(optarg, NULL, 0);
+      break;
+    case 'u':
+      config.limits.cpu_seconds = strtoul(optarg, NULL, 0);
+      break;
+    case 'M':
+      config.limits.memory_bytes = strtoul(optarg, NULL, 0);
+      break;
+    case 'T':
+      config.time_limit_ms = atoi(optarg);
+      break;
+    case 'X':
+      config.metrics_socket_path = optarg;
+      break;
+    case 'x':
+      config.metrics_interval_ms = atoi(optarg) * 1000L;
+      break;
+    case 'b':
+      config.display_batch_bytes = atoi(optarg);
+      break;
+    case 'B':
+      config.display_batch_ms = atoi(optarg);
+      break;
+    case 'e':
+      config.heap_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'E':
+      config.max_heap_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'j':
+      heap_mode = optarg;
+      break;
+    case 'z':
+      config.compress_threshold = strtoul(optarg, NULL, 0);
+      break;
+    case 'Q':
+      config.queue_high = strtoul(optarg, NULL, 0);
+      break;
+    case 'L':
+      config.queue_low = strtoul(optarg, NULL, 0);
+      break;
+    case 'O':
+      overflow_policy = optarg;
+      break;
+    case 'r':
+      config.output_limits.bytes_per_second = strtoul(optarg, NULL, 0);
+      break;
+    case 'N':
+      config.output_limits.messages_per_second = strtoul(optarg, NULL, 0);
+      break;
+    case 'o':
+      config.output_limits.max_bytes = strtoul(optarg, NULL, 0);
+      break;
+    case 'D':
+      config.dedup_window_s = strtoul(optarg, NULL, 0);
+      break;
+    case 'J':
+      config.journal_dir = optarg;
+      break;
+    case 'K':
+      config.journal_size = strtoul(optarg, NULL, 0);
+      break;
     case 'h':
       config.host = optarg;
       break;
@@ -444,6 +2282,12 @@ int main(int argc, char *argv[]) {
     case 'i':
       config.device_id = optarg;
       break;
+    case 'd':
+      config.devices_path = optarg;
+      break;
+    case 'l':
+      config.client_id = optarg;
+      break;
     case 's':
       config.server_ca_path = optarg;
       break;
@@ -468,15 +2312,15 @@ int main(int argc, char *argv[]) {
     eprintf("No hostname specified.\n");
     fail = true;
   }
-  if (!config.device_id) {
+  if (!config.device_id && !config.devices_path) {
     eprintf("No device ID specified.\n");
     fail = true;
   }
-  if (!config.client_key_path) {
+  if (config.use_tls && !config.client_key_path) {
     eprintf("No private key specified.\n");
     fail = true;
   }
-  if (!config.client_cert_path) {
+  if (config.use_tls && !config.client_cert_path) {
     eprintf("No certificate specified.\n");
     fail = true;
   }
@@ -486,27 +2330,93 @@ int main(int argc, char *argv[]) {
   if (!config.sinter_host_path) {
     config.sinter_host_path = "./sinter_host";
   }
-  if (!config.program_path) {
-    config.program_path = "program.svm";
+  if (heap_mode && !parse_heap_mode(heap_mode, &config.heap_mode)) {
+    eprintf("Unknown heap mode %s.\n", heap_mode);
+    fail = true;
+  }
+  if (overflow_policy && !parse_overflow_policy(overflow_policy, &config.overflow_policy)) {
+    eprintf("Unknown overflow policy %s.\n", overflow_policy);
+    fail = true;
   }
   if (fail) {
     return 1;
   }
 
   if (config.port == 0) {
-    config.port = 8883;
+    config.port = config.use_tls ? 8883 : 1883;
+  }
+
+  if (config.max_heap_size > IPC_HEAP_SIZE_MAX) {
+    config.max_heap_size = IPC_HEAP_SIZE_MAX;
+  }
+  if (config.heap_size < IPC_HEAP_SIZE_MIN) {
+    config.heap_size = IPC_HEAP_SIZE_MIN;
+  } else if (config.heap_size > IPC_HEAP_SIZE_MAX) {
+    config.heap_size = IPC_HEAP_SIZE_MAX;
+  }
+  if (config.max_heap_size < config.heap_size) {
+    config.max_heap_size = config.heap_size;
+  }
+  if (config.queue_low >= config.queue_high) {
+    config.queue_low = config.queue_high / 2;
+  }
+
+  if (config.warm_pool_size > WARM_POOL_MAX) {
+    config.warm_pool_size = WARM_POOL_MAX;
+  }
+
+  if (config.ipc_batch_size < 1) {
+    config.ipc_batch_size = 1;
+  } else if (config.ipc_batch_size > UIO_MAXIOV) {
+    config.ipc_batch_size = UIO_MAXIOV;
+  }
+
+  if (config.max_runs == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    config.max_runs = cpus > 0 ? (size_t) cpus : 1;
+  }
+  if (config.max_runs > RUNS_MAX) {
+    config.max_runs = RUNS_MAX;
   }
 
-  config.outtopic_display = sling_topic(config.device_id, SLING_OUTTOPIC_DISPLAY);
-  config.outtopic_status = sling_topic(config.device_id, SLING_OUTTOPIC_STATUS);
-  config.outtopic_hello = sling_topic(config.device_id, SLING_OUTTOPIC_HELLO);
+  if (config.journal_dir && !*config.journal_dir) {
+    config.journal_dir = NULL;
+  }
+  if (config.journal_size < REPLAY_JOURNAL_SIZE_MIN) {
+    config.journal_size = REPLAY_JOURNAL_SIZE_MIN;
+  }
 
-  config.intopic_input = sling_topic(config.device_id, SLING_INTOPIC_INPUT);
-  config.intopic_ping = sling_topic(config.device_id, SLING_INTOPIC_PING);
-  config.intopic_run = sling_topic(config.device_id, SLING_INTOPIC_RUN);
-  config.intopic_stop = sling_topic(config.device_id, SLING_INTOPIC_STOP);
+  // the device given on the command line comes first, so it names the connection by default
+  const char **device_ids = NULL;
+  size_t device_id_count = 0;
+  if (config.device_id) {
+    device_ids = malloc(sizeof(*device_ids));
+    if (!device_ids) {
+      fatal_error("Out of memory\n");
+    }
+    device_ids[device_id_count++] = config.device_id;
+  }
+  if (config.devices_path) {
+    read_device_ids(config.devices_path, &device_ids, &device_id_count);
+  }
+  if (device_id_count == 0) {
+    fatal_error("No device IDs in %s.\n", config.devices_path);
+  }
+  if (device_id_count > DEVICES_MAX) {
+    fatal_error("Too many device IDs; at most %d are supported.\n", DEVICES_MAX);
+  }
+  if (!config.client_id) {
+    config.client_id = device_ids[0];
+  }
 
-  config.intopic_index = strlen(config.device_id) + 1;
+  program_cache_init(cache_size);
+  run_limits_init(&config.limits);
+  if (config.metrics_socket_path) {
+    setup_metrics_socket();
+  }
+  setup_ipc_batch();
+  setup_devices(device_ids, device_id_count);
+  setup_runs(ipc_ring_size);
 
   config.urandom = fopen("/dev/urandom", "r");
   if (!config.urandom) {
@@ -515,18 +2425,21 @@ int main(int argc, char *argv[]) {
   setvbuf(config.urandom, NULL, _IONBF, 0);
 
   check_mosq(mosquitto_lib_init());
-  mosq = mosquitto_new(config.device_id, true, NULL);
+  mosq = mosquitto_new(config.client_id, true, NULL);
   if (!mosq) {
     fatal_error("Mosquitto instance initialisation failed.\n");
   }
-  if (debug_log) {
+  if (config.debug_log) {
     mosquitto_log_callback_set(mosq, on_log);
   }
   mosquitto_connect_callback_set(mosq, on_connect);
   mosquitto_message_callback_set(mosq, on_message);
-  mosquitto_tls_set(mosq, config.server_ca_path,
-                    config.server_ca_path ? NULL : config.server_ca_dir, config.client_cert_path,
-                    config.client_key_path, NULL);
+  mosquitto_publish_callback_set(mosq, on_publish);
+  if (config.use_tls) {
+    mosquitto_tls_set(mosq, config.server_ca_path,
+                      config.server_ca_path ? NULL : config.server_ca_dir, config.client_cert_path,
+                      config.client_key_path, NULL);
+  }
   check_mosq(mosquitto_connect(mosq, config.host, config.port, 30));
 
   main_loop();
@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "message_dedup.h"
+
+_Static_assert((MESSAGE_DEDUP_CAPACITY & (MESSAGE_DEDUP_CAPACITY - 1)) == 0,
+               "MESSAGE_DEDUP_CAPACITY must be a power of 2");
+_Static_assert((MESSAGE_DEDUP_INITIAL_CAPACITY & (MESSAGE_DEDUP_INITIAL_CAPACITY - 1)) == 0,
+               "MESSAGE_DEDUP_INITIAL_CAPACITY must be a power of 2");
+_Static_assert(MESSAGE_DEDUP_CAPACITY < UINT16_MAX, "slots must be able to hold an entry index");
+
+static inline size_t slot_mask(const struct message_dedup *dedup) {
+  return dedup->capacity * 2 - 1;
+}
+
+// Fibonacci hashing; IDs are random anyway, but need not be
+static inline size_t home_slot(const struct message_dedup *dedup, uint32_t id) {
+  return (id * 2654435769u) & slot_mask(dedup);
+}
+
+static inline uint32_t slot_id(const struct message_dedup *dedup, size_t slot) {
+  return dedup->entries[dedup->slots[slot] - 1].id;
+}
+
+// Returns the slot holding id, or the empty slot where it would go
+static size_t find_slot(const struct message_dedup *dedup, uint32_t id) {
+  const size_t mask = slot_mask(dedup);
+  size_t slot = home_slot(dedup, id);
+  while (dedup->slots[slot] && slot_id(dedup, slot) != id) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+// Empties a slot, moving later entries of its probe run back so none is cut off
+// from its home slot
+static void remove_slot(struct message_dedup *dedup, size_t hole) {
+  const size_t mask = slot_mask(dedup);
+  for (size_t slot = (hole + 1) & mask; dedup->slots[slot]; slot = (slot + 1) & mask) {
+    const size_t home = home_slot(dedup, slot_id(dedup, slot));
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      dedup->slots[hole] = dedup->slots[slot];
+      hole = slot;
+    }
+  }
+  dedup->slots[hole] = 0;
+}
+
+static void forget_oldest(struct message_dedup *dedup) {
+  remove_slot(dedup, find_slot(dedup, dedup->entries[dedup->head].id));
+  dedup->head = (dedup->head + 1) & (dedup->capacity - 1);
+  --dedup->count;
+}
+
+static bool allocate(struct message_dedup *dedup, size_t capacity) {
+  struct message_dedup_entry *entries = malloc(capacity * sizeof(*entries));
+  uint16_t *slots = calloc(capacity * 2, sizeof(*slots));
+  if (!entries || !slots) {
+    free(entries);
+    free(slots);
+    return false;
+  }
+  dedup->capacity = capacity;
+  dedup->entries = entries;
+  dedup->slots = slots;
+  return true;
+}
+
+// Doubles the capacity, keeping every ID in order. Returns false if out of memory
+static bool grow(struct message_dedup *dedup) {
+  const struct message_dedup old = *dedup;
+  if (!allocate(dedup, old.capacity * 2)) {
+    return false;
+  }
+  dedup->head = 0;
+  for (size_t i = 0; i < old.count; ++i) {
+    const struct message_dedup_entry entry = old.entries[(old.head + i) & (old.capacity - 1)];
+    dedup->entries[i] = entry;
+    dedup->slots[find_slot(dedup, entry.id)] = i + 1;
+  }
+  free(old.entries);
+  free(old.slots);
+  return true;
+}
+
+bool message_dedup_init(struct message_dedup *dedup, uint64_t window_ns) {
+  memset(dedup, 0, sizeof(*dedup));
+  dedup->window_ns = window_ns;
+  return allocate(dedup, MESSAGE_DEDUP_INITIAL_CAPACITY);
+}
+
+enum message_dedup_result message_dedup_check(struct message_dedup *dedup, uint32_t id, uint64_t now_ns) {
+  while (dedup->count && now_ns - dedup->entries[dedup->head].seen_ns >= dedup->window_ns) {
+    forget_oldest(dedup);
+  }
+
+  size_t slot = find_slot(dedup, id);
+  if (dedup->slots[slot]) {
+    return message_dedup_duplicate;
+  }
+
+  enum message_dedup_result result = message_dedup_new;
+  if (dedup->count == dedup->capacity) {
+    // short of memory, making room will do
+    if (dedup->capacity == MESSAGE_DEDUP_CAPACITY || !grow(dedup)) {
+      forget_oldest(dedup);
+      result = message_dedup_new_evicted;
+    }
+    // either way, the empty slot we found may have moved
+    slot = find_slot(dedup, id);
+  }
+
+  const size_t index = (dedup->head + dedup->count++) & (dedup->capacity - 1);
+  dedup->entries[index] = (struct message_dedup_entry){.id = id, .seen_ns = now_ns};
+  dedup->slots[slot] = index + 1;
+  return result;
+}
@@ -0,0 +1,54 @@
+#ifndef SLING_LINUX_MESSAGE_DEDUP_H
+#define SLING_LINUX_MESSAGE_DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The IDs of client messages seen in the last window_ns, to drop repeat
+// deliveries. Clients pick message IDs at random, so an ID seen again within
+// the window is the same message delivered twice.
+//
+// IDs are kept in a ring in the order they arrived, which makes expiring the
+// oldest O(1), and indexed by an open addressing hash table with linear
+// probing, which makes finding one O(1). Both start small and double as IDs
+// arrive faster, so a daemon serving many quiet devices keeps little for each.
+
+// Most IDs remembered at once. MUST BE POWER OF 2, and fit the slots below
+#define MESSAGE_DEDUP_CAPACITY 4096
+// IDs remembered at once before growing. MUST BE POWER OF 2
+#define MESSAGE_DEDUP_INITIAL_CAPACITY 32
+
+struct message_dedup_entry {
+  uint32_t id;
+  uint64_t seen_ns;
+};
+
+struct message_dedup {
+  uint64_t window_ns;
+
+  // A power of 2
+  size_t capacity;
+  struct message_dedup_entry *entries;
+  size_t head;
+  size_t count;
+
+  // Twice as many as entries, so probes stay short. 1 + the index into
+  // entries of the ID hashed here, or 0 if empty
+  uint16_t *slots;
+};
+
+enum message_dedup_result {
+  message_dedup_new,
+  // New, but remembering it meant forgetting an ID still in its window
+  message_dedup_new_evicted,
+  message_dedup_duplicate
+};
+
+// Returns false if out of memory
+bool message_dedup_init(struct message_dedup *dedup, uint64_t window_ns);
+
+// Checks whether id was seen within the window, remembering it if not
+enum message_dedup_result message_dedup_check(struct message_dedup *dedup, uint32_t id, uint64_t now_ns);
+
+#endif
@@ -0,0 +1,139 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "metrics.h"
+
+struct metric_info {
+  const char *name;
+  const char *help;
+};
+
+static const struct metric_info counter_info[metrics_counter_count] = {
+  [metrics_runs_received] = {"sling_runs_received_total", "Run requests received"},
+  [metrics_runs_started] = {"sling_runs_started_total", "Runs handed to a Sinter host"},
+  [metrics_ipc_messages] = {"sling_ipc_messages_total", "Messages received from Sinter hosts"},
+  [metrics_ipc_bytes] = {"sling_ipc_bytes_total", "Bytes received from Sinter hosts"},
+  [metrics_mqtt_publishes] = {"sling_mqtt_publishes_total", "MQTT messages published"},
+  [metrics_mqtt_publish_bytes] = {"sling_mqtt_publish_bytes_total", "MQTT payload bytes published"},
+  [metrics_dedup_hits] = {"sling_dedup_hits_total", "Duplicate client messages dropped"},
+  [metrics_dedup_misses] = {"sling_dedup_misses_total", "Client messages not seen before"},
+  [metrics_dedup_evictions] = {"sling_dedup_evictions_total",
+    "Client message IDs forgotten early to make room for newer ones"},
+  [metrics_replay_requests] = {"sling_replay_requests_total", "Requests from clients to replay messages they missed"},
+  [metrics_replayed_messages] = {"sling_replayed_messages_total", "Messages published again from replay journals"},
+  [metrics_compress_input_bytes] = {"sling_compress_input_bytes_total", "Display string bytes considered for compression"},
+  [metrics_compress_output_bytes] = {"sling_compress_output_bytes_total",
+    "Bytes sent for those strings, compressed or not"},
+  [metrics_compress_cpu_ns] = {"sling_compress_cpu_nanoseconds_total", "CPU time spent compressing"},
+  [metrics_decompress_input_bytes] = {"sling_decompress_input_bytes_total", "Compressed program bytes received"},
+  [metrics_decompress_output_bytes] = {"sling_decompress_output_bytes_total", "Program bytes they decompressed to"},
+  [metrics_decompress_cpu_ns] = {"sling_decompress_cpu_nanoseconds_total", "CPU time spent decompressing"},
+  [metrics_throttled_ns] = {"sling_throttled_nanoseconds_total", "Time spent with output from runs throttled"},
+  [metrics_display_dropped] = {"sling_display_dropped_total", "Display messages dropped while throttled"},
+  [metrics_output_repeats] = {"sling_output_repeats_total", "Repeated lines of output collapsed into one notice"},
+  [metrics_output_rate_limited] = {"sling_output_rate_limited_total", "Lines of output dropped over a run's budget"},
+  [metrics_output_truncated] = {"sling_output_truncated_total", "Runs whose output was cut off at the size limit"},
+};
+
+static const struct metric_info gauge_info[metrics_gauge_count] = {
+  [metrics_runs_active] = {"sling_runs_active", "Runs in progress"},
+  [metrics_warm_hosts] = {"sling_warm_hosts", "Sinter hosts waiting in the warm pool"},
+  [metrics_mqtt_inflight] = {"sling_mqtt_inflight", "MQTT publishes not yet acknowledged by the broker"},
+  [metrics_mqtt_inflight_bytes] = {"sling_mqtt_inflight_bytes", "Payload bytes of those publishes"},
+  [metrics_throttled] = {"sling_throttled", "Whether output from runs is throttled"},
+  [metrics_devices] = {"sling_devices", "Device IDs served by this daemon"},
+};
+
+static const struct metric_info histogram_info[metrics_histogram_count] = {
+  [metrics_host_ready_latency] = {"sling_host_ready_seconds",
+    "Time from receiving a run to handing it to a Sinter host"},
+  [metrics_first_display_latency] = {"sling_first_output_seconds",
+    "Time from receiving a run to the first message from its host"},
+  [metrics_run_duration] = {"sling_run_duration_seconds",
+    "Time from receiving a run to its host exiting"},
+  [metrics_prompt_latency] = {"sling_prompt_response_seconds",
+    "Time from a host asking for input to the response reaching it"},
+};
+
+// Upper bounds in microseconds, roughly 1-2.5-5 per decade from 100 us to 10 s
+static const int64_t bucket_bounds_us[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+  2500000, 5000000, 10000000
+};
+#define BUCKET_COUNT (sizeof(bucket_bounds_us) / sizeof(*bucket_bounds_us))
+
+struct histogram {
+  // Not cumulative; the last one is +Inf
+  uint64_t buckets[BUCKET_COUNT + 1];
+  uint64_t count;
+  uint64_t sum_us;
+};
+
+static uint64_t counters[metrics_counter_count];
+static int64_t gauges[metrics_gauge_count];
+static struct histogram histograms[metrics_histogram_count];
+
+void metrics_count(enum metrics_counter counter, uint64_t n) {
+  counters[counter] += n;
+}
+
+void metrics_set(enum metrics_gauge gauge, int64_t value) {
+  gauges[gauge] = value;
+}
+
+void metrics_observe_us(enum metrics_histogram histogram, int64_t us) {
+  struct histogram *h = histograms + histogram;
+  if (us < 0) {
+    us = 0;
+  }
+  size_t bucket = 0;
+  while (bucket < BUCKET_COUNT && us > bucket_bounds_us[bucket]) {
+    ++bucket;
+  }
+  ++h->buckets[bucket];
+  ++h->count;
+  h->sum_us += us;
+}
+
+static void format_header(FILE *out, const struct metric_info *info, const char *type) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help, info->name, type);
+}
+
+char *metrics_format(size_t *size) {
+  char *buf = NULL;
+  FILE *out = open_memstream(&buf, size);
+  if (!out) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < metrics_counter_count; ++i) {
+    format_header(out, counter_info + i, "counter");
+    fprintf(out, "%s %" PRIu64 "\n", counter_info[i].name, counters[i]);
+  }
+  for (size_t i = 0; i < metrics_gauge_count; ++i) {
+    format_header(out, gauge_info + i, "gauge");
+    fprintf(out, "%s %" PRId64 "\n", gauge_info[i].name, gauges[i]);
+  }
+  for (size_t i = 0; i < metrics_histogram_count; ++i) {
+    const struct histogram *h = histograms + i;
+    const char *name = histogram_info[i].name;
+    format_header(out, histogram_info + i, "histogram");
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b < BUCKET_COUNT; ++b) {
+      cumulative += h->buckets[b];
+      fprintf(out, "%s_bucket{le=\"%g\"} %" PRIu64 "\n", name, bucket_bounds_us[b] / 1e6, cumulative);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, h->count);
+    fprintf(out, "%s_sum %g\n", name, h->sum_us / 1e6);
+    fprintf(out, "%s_count %" PRIu64 "\n", name, h->count);
+  }
+
+  if (fclose(out) != 0) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
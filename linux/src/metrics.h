@@ -0,0 +1,60 @@
+#ifndef SLING_LINUX_METRICS_H
+#define SLING_LINUX_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum metrics_counter {
+  metrics_runs_received,
+  metrics_runs_started,
+  metrics_ipc_messages,
+  metrics_ipc_bytes,
+  metrics_mqtt_publishes,
+  metrics_mqtt_publish_bytes,
+  metrics_dedup_hits,
+  metrics_dedup_misses,
+  metrics_dedup_evictions,
+  metrics_replay_requests,
+  metrics_replayed_messages,
+  metrics_compress_input_bytes,
+  metrics_compress_output_bytes,
+  metrics_compress_cpu_ns,
+  metrics_decompress_input_bytes,
+  metrics_decompress_output_bytes,
+  metrics_decompress_cpu_ns,
+  metrics_throttled_ns,
+  metrics_display_dropped,
+  metrics_output_repeats,
+  metrics_output_rate_limited,
+  metrics_output_truncated,
+  metrics_counter_count
+};
+
+enum metrics_gauge {
+  metrics_runs_active,
+  metrics_warm_hosts,
+  metrics_mqtt_inflight,
+  metrics_mqtt_inflight_bytes,
+  metrics_throttled,
+  metrics_devices,
+  metrics_gauge_count
+};
+
+// Latencies, mostly measured from when the run message was received
+enum metrics_histogram {
+  metrics_host_ready_latency,
+  metrics_first_display_latency,
+  metrics_run_duration,
+  metrics_prompt_latency,
+  metrics_histogram_count
+};
+
+void metrics_count(enum metrics_counter counter, uint64_t n);
+void metrics_set(enum metrics_gauge gauge, int64_t value);
+void metrics_observe_us(enum metrics_histogram histogram, int64_t us);
+
+// Returns the metrics in the Prometheus text exposition format, to be freed by the caller,
+// or NULL if out of memory
+char *metrics_format(size_t *size);
+
+#endif
@@ -0,0 +1,98 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "output_governor.h"
+
+#define WINDOW_NS 1000000000ULL
+
+// FNV-1a
+static uint64_t hash_line(const void *line, size_t size) {
+  const unsigned char *bytes = line;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static bool over_budget(const struct output_governor *governor) {
+  const struct output_limits *limits = &governor->limits;
+  return (limits->bytes_per_second && governor->window_bytes >= limits->bytes_per_second)
+    || (limits->messages_per_second && governor->window_messages >= limits->messages_per_second);
+}
+
+void output_governor_init(struct output_governor *governor, const struct output_limits *limits,
+                          uint64_t now_ns) {
+  *governor = (struct output_governor){.limits = *limits, .window_start_ns = now_ns};
+}
+
+static void charge(struct output_governor *governor, size_t size) {
+  governor->window_bytes = size > UINT32_MAX - governor->window_bytes ? UINT32_MAX : governor->window_bytes + size;
+  if (governor->window_messages < UINT32_MAX) {
+    ++governor->window_messages;
+  }
+  governor->total_bytes += size;
+}
+
+// Checks max_bytes, and starts a new window if the last is over. Returns
+// output_verdict_send if size bytes may still be sent
+static enum output_verdict check_total(struct output_governor *governor, uint64_t now_ns, size_t size) {
+  if (governor->truncated) {
+    return output_verdict_truncated;
+  }
+  if (governor->limits.max_bytes && governor->total_bytes + size > governor->limits.max_bytes) {
+    governor->truncated = true;
+    return output_verdict_truncate;
+  }
+
+  if (now_ns - governor->window_start_ns >= WINDOW_NS) {
+    governor->window_start_ns = now_ns;
+    governor->window_bytes = governor->window_messages = 0;
+  }
+  return output_verdict_send;
+}
+
+enum output_verdict output_governor_fragment(struct output_governor *governor, uint64_t now_ns, size_t size) {
+  const enum output_verdict verdict = check_total(governor, now_ns, size);
+  if (verdict != output_verdict_send) {
+    return verdict;
+  }
+  if (over_budget(governor)) {
+    return output_verdict_drop;
+  }
+  charge(governor, size);
+  return output_verdict_send;
+}
+
+enum output_verdict output_governor_line(struct output_governor *governor, uint64_t now_ns,
+                                         const void *line, size_t size, bool is_complete) {
+  const enum output_verdict verdict = check_total(governor, now_ns, size);
+  if (verdict != output_verdict_send) {
+    return verdict;
+  }
+
+  const uint64_t hash = is_complete ? hash_line(line, size) : 0;
+  if (over_budget(governor)) {
+    if (is_complete && governor->has_last_line && governor->last_line_size == size
+        && governor->last_line_hash == hash) {
+      ++governor->repeats;
+      return output_verdict_repeat;
+    }
+    // a different line ends the run of repeats
+    governor->has_last_line = false;
+    return output_verdict_drop;
+  }
+
+  charge(governor, size);
+  governor->has_last_line = is_complete;
+  governor->last_line_hash = hash;
+  governor->last_line_size = size;
+  return output_verdict_send;
+}
+
+unsigned long output_governor_take_repeats(struct output_governor *governor) {
+  const unsigned long repeats = governor->repeats;
+  governor->repeats = 0;
+  return repeats;
+}
@@ -0,0 +1,71 @@
+#ifndef SLING_LINUX_OUTPUT_GOVERNOR_H
+#define SLING_LINUX_OUTPUT_GOVERNOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Limits on the standard output of a run. 0 means unlimited
+struct output_limits {
+  uint32_t bytes_per_second;
+  uint32_t messages_per_second;
+  // Over the whole run
+  uint32_t max_bytes;
+};
+
+// Budgets a run's standard output in one second windows. Once a window's
+// budget is spent, lines identical to the previous one are only counted, and
+// other lines are dropped, until the next window. Past max_bytes, everything is
+// dropped for the rest of the run.
+//
+// Lines are compared by a hash of the whole display message, excluding the
+// message counter. Only lines sent as one self-flushing message can be repeats.
+
+struct output_governor {
+  struct output_limits limits;
+
+  uint64_t window_start_ns;
+  uint32_t window_bytes;
+  uint32_t window_messages;
+  uint64_t total_bytes;
+  bool truncated;
+
+  // The last line let through, and how many times it was repeated since
+  bool has_last_line;
+  uint64_t last_line_hash;
+  size_t last_line_size;
+  unsigned long repeats;
+};
+
+enum output_verdict {
+  output_verdict_send,
+  // The same as the last line, and over budget; counted in repeats
+  output_verdict_repeat,
+  // Over budget
+  output_verdict_drop,
+  // This line would pass max_bytes; it and all output after it are dropped
+  output_verdict_truncate,
+  // Dropped, as max_bytes was passed earlier
+  output_verdict_truncated
+};
+
+void output_governor_init(struct output_governor *governor, const struct output_limits *limits,
+                          uint64_t now_ns);
+
+// Decides what to do with a display message that starts a line of output
+enum output_verdict output_governor_line(struct output_governor *governor, uint64_t now_ns,
+                                         const void *line, size_t size, bool is_complete);
+
+// Decides what to do with a later message of a line that was let through. It
+// cannot be a repeat, but is held to the budget and max_bytes all the same
+enum output_verdict output_governor_fragment(struct output_governor *governor, uint64_t now_ns, size_t size);
+
+// Returns the repeats of the last line not yet owned up to, and forgets them
+unsigned long output_governor_take_repeats(struct output_governor *governor);
+
+// The stricter of two limits, where 0 is unlimited
+static inline uint32_t output_limit_min(uint32_t a, uint32_t b) {
+  return !a ? b : !b ? a : a < b ? a : b;
+}
+
+#endif
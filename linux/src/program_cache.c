@@ -0,0 +1,86 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "program_cache.h"
+
+struct program_cache_entry {
+  uint8_t hash[SLING_PROGRAM_HASH_SIZE];
+  int fd;
+  size_t size;
+  uint64_t last_used;
+};
+
+static struct program_cache_entry entries[PROGRAM_CACHE_MAX_ENTRIES];
+static size_t entry_count = 0;
+static size_t total_bytes = 0;
+static size_t max_bytes = 0;
+static uint64_t use_counter = 0;
+
+void program_cache_init(size_t max_bytes_) {
+  max_bytes = max_bytes_;
+}
+
+bool program_cache_enabled(void) {
+  return max_bytes > 0;
+}
+
+void program_cache_hash(const void *program, size_t program_size,
+  uint8_t hash[SLING_PROGRAM_HASH_SIZE]) {
+  SHA256(program, program_size, hash);
+}
+
+static struct program_cache_entry *find_entry(const uint8_t hash[SLING_PROGRAM_HASH_SIZE]) {
+  for (size_t i = 0; i < entry_count; ++i) {
+    if (!memcmp(entries[i].hash, hash, SLING_PROGRAM_HASH_SIZE)) {
+      return entries + i;
+    }
+  }
+  return NULL;
+}
+
+static void evict_lru(void) {
+  size_t lru = 0;
+  for (size_t i = 1; i < entry_count; ++i) {
+    if (entries[i].last_used < entries[lru].last_used) {
+      lru = i;
+    }
+  }
+  close(entries[lru].fd);
+  total_bytes -= entries[lru].size;
+  entries[lru] = entries[--entry_count];
+}
+
+int program_cache_get(const uint8_t hash[SLING_PROGRAM_HASH_SIZE], size_t *program_size) {
+  struct program_cache_entry *entry = find_entry(hash);
+  if (!entry) {
+    return -1;
+  }
+  entry->last_used = ++use_counter;
+  *program_size = entry->size;
+  return entry->fd;
+}
+
+void program_cache_put(const uint8_t hash[SLING_PROGRAM_HASH_SIZE], int fd, size_t program_size) {
+  if (program_size > max_bytes || find_entry(hash)) {
+    close(fd);
+    return;
+  }
+
+  while (entry_count > 0 &&
+         (entry_count == PROGRAM_CACHE_MAX_ENTRIES || total_bytes + program_size > max_bytes)) {
+    evict_lru();
+  }
+
+  struct program_cache_entry *entry = entries + entry_count++;
+  memcpy(entry->hash, hash, SLING_PROGRAM_HASH_SIZE);
+  entry->fd = fd;
+  entry->size = program_size;
+  entry->last_used = ++use_counter;
+  total_bytes += program_size;
+}
@@ -0,0 +1,26 @@
+#ifndef SLING_LINUX_PROGRAM_CACHE_H
+#define SLING_LINUX_PROGRAM_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../common/sling_message.h"
+
+#define PROGRAM_CACHE_MAX_ENTRIES 16
+
+void program_cache_init(size_t max_bytes);
+bool program_cache_enabled(void);
+
+void program_cache_hash(const void *program, size_t program_size,
+  uint8_t hash[SLING_PROGRAM_HASH_SIZE]);
+
+// Returns the sealed memfd holding the program, or -1 if it is not cached.
+// The FD remains owned by the cache.
+int program_cache_get(const uint8_t hash[SLING_PROGRAM_HASH_SIZE], size_t *program_size);
+
+// Takes ownership of fd, evicting least recently used programs to make space.
+// The FD is closed immediately if the program cannot be cached.
+void program_cache_put(const uint8_t hash[SLING_PROGRAM_HASH_SIZE], int fd, size_t program_size);
+
+#endif
@@ -0,0 +1,50 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "publish_queue.h"
+
+#define PUBLISH_QUEUE_MIN_CAPACITY 64
+
+static inline struct publish_queue_entry *entry_at(struct publish_queue *queue, size_t index) {
+  return queue->entries + ((queue->head + index) & (queue->capacity - 1));
+}
+
+bool publish_queue_push(struct publish_queue *queue, int mid, size_t size) {
+  if (queue->used == queue->capacity) {
+    const size_t capacity = queue->capacity ? queue->capacity * 2 : PUBLISH_QUEUE_MIN_CAPACITY;
+    struct publish_queue_entry *entries = malloc(capacity * sizeof(*entries));
+    if (!entries) {
+      return false;
+    }
+    for (size_t i = 0; i < queue->used; ++i) {
+      entries[i] = *entry_at(queue, i);
+    }
+    free(queue->entries);
+    queue->entries = entries;
+    queue->head = 0;
+    queue->capacity = capacity;
+  }
+
+  *entry_at(queue, queue->used++) = (struct publish_queue_entry){.mid = mid, .size = size};
+  ++queue->count;
+  queue->bytes += size;
+  return true;
+}
+
+void publish_queue_ack(struct publish_queue *queue, int mid) {
+  for (size_t i = 0; i < queue->used; ++i) {
+    struct publish_queue_entry *entry = entry_at(queue, i);
+    if (entry->mid == mid) {
+      entry->mid = 0;
+      --queue->count;
+      queue->bytes -= entry->size;
+      break;
+    }
+  }
+
+  while (queue->used && queue->entries[queue->head].mid == 0) {
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    --queue->used;
+  }
+}
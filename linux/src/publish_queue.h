@@ -0,0 +1,38 @@
+#ifndef SLING_LINUX_PUBLISH_QUEUE_H
+#define SLING_LINUX_PUBLISH_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Publishes handed to libmosquitto that the broker has not acknowledged yet,
+// oldest first, so we know how much memory they hold.
+//
+// Acknowledgements mostly arrive in order, so finding one is usually O(1).
+// Those that arrive early are marked, and popped once everything before them is.
+
+struct publish_queue_entry {
+  // 0 once acknowledged; libmosquitto never uses 0 as a message ID
+  int mid;
+  size_t size;
+};
+
+struct publish_queue {
+  struct publish_queue_entry *entries;
+  size_t head;
+  // Entries in use, including those acknowledged out of order
+  size_t used;
+  // A power of 2
+  size_t capacity;
+
+  // Publishes not acknowledged yet, and their payload bytes
+  size_t count;
+  size_t bytes;
+};
+
+// Returns false if out of memory
+bool publish_queue_push(struct publish_queue *queue, int mid, size_t size);
+
+// Does nothing if mid is not in the queue
+void publish_queue_ack(struct publish_queue *queue, int mid);
+
+#endif
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../common/sling_message.h"
+#include "replay_journal.h"
+
+#define REPLAY_JOURNAL_MAGIC 0x4a524c53 // "SLRJ"
+#define REPLAY_JOURNAL_VERSION 1
+#define REPLAY_JOURNAL_HEADER_SIZE 64
+
+struct replay_journal_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  uint32_t capabilities;
+  uint32_t has_session;
+  uint32_t nonce;
+  // The message number after the last one kept
+  uint32_t next_id;
+  // Offsets into data, counted from when the session began, so they never wrap
+  // back; the ring holds [head, tail). A message is only kept once tail moves past it
+  _Atomic uint64_t head;
+  _Atomic uint64_t tail;
+};
+_Static_assert(sizeof(struct replay_journal_header) <= REPLAY_JOURNAL_HEADER_SIZE, "replay journal header too big");
+
+// Fills the rest of the ring after a message that would not fit before its end
+#define RECORD_SKIP 0xff
+
+// Each message is prefixed by one of these, and padded to 4 bytes. Messages do
+// not wrap around the end of the ring; the space they would not fit in is
+// skipped, marked by a RECORD_SKIP record if there is room for one
+struct record {
+  uint32_t size;
+  uint32_t first_id;
+  // Message numbers covered: more than 1 for a display batch
+  uint16_t count;
+  uint8_t topic;
+  uint8_t padding;
+};
+_Static_assert(sizeof(struct record) == 12, "Wrong record size");
+
+static size_t record_bytes(size_t size) {
+  return sizeof(struct record) + ((size + 3) & ~(size_t) 3);
+}
+
+static size_t bytes_to_end(const struct replay_journal *journal, uint64_t offset) {
+  return journal->capacity - offset % journal->capacity;
+}
+
+// Moves offset past any skipped space at the end of the ring. Returns the
+// record there, or NULL if offset reaches end
+static const struct record *record_at(const struct replay_journal *journal, uint64_t *offset, uint64_t end) {
+  while (*offset < end) {
+    const size_t remaining = bytes_to_end(journal, *offset);
+    const struct record *record = (const struct record *) (journal->data + *offset % journal->capacity);
+    if (remaining >= sizeof(*record) && record->topic != RECORD_SKIP) {
+      return record;
+    }
+    *offset += remaining;
+  }
+  return NULL;
+}
+
+// Whether the ring holds well-formed records only, as it may not if the file
+// was cut short or written by something else
+static bool is_consistent(const struct replay_journal *journal) {
+  const uint64_t tail = atomic_load(&journal->header->tail);
+  uint64_t offset = atomic_load(&journal->header->head);
+  if (tail < offset || tail - offset > journal->capacity) {
+    return false;
+  }
+  const struct record *record;
+  while ((record = record_at(journal, &offset, tail))) {
+    const size_t bytes = record_bytes(record->size);
+    if (record->topic >= replay_journal_topic_count || record->count == 0
+        || bytes > bytes_to_end(journal, offset) || tail - offset < bytes) {
+      return false;
+    }
+    offset += bytes;
+  }
+  return true;
+}
+
+bool replay_journal_open(struct replay_journal *journal, const char *path, size_t capacity, uint32_t capabilities) {
+  capacity &= ~(size_t) 3;
+  const size_t file_size = REPLAY_JOURNAL_HEADER_SIZE + capacity;
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || ((size_t) st.st_size != file_size && ftruncate(fd, file_size) == -1)) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return false;
+  }
+  void *mapping = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  const int error = errno;
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    errno = error;
+    return false;
+  }
+
+  journal->header = mapping;
+  journal->data = (unsigned char *) mapping + REPLAY_JOURNAL_HEADER_SIZE;
+  journal->capacity = capacity;
+
+  struct replay_journal_header *header = journal->header;
+  if (header->magic != REPLAY_JOURNAL_MAGIC || header->version != REPLAY_JOURNAL_VERSION
+      || header->capacity != capacity || header->capabilities != capabilities || !is_consistent(journal)) {
+    // what clients were told no longer holds, so they must start over
+    header->magic = REPLAY_JOURNAL_MAGIC;
+    header->version = REPLAY_JOURNAL_VERSION;
+    header->capacity = capacity;
+    header->capabilities = capabilities;
+    header->has_session = 0;
+    header->nonce = 0;
+    header->next_id = 0;
+    atomic_store(&header->head, 0);
+    atomic_store(&header->tail, 0);
+  }
+  return true;
+}
+
+bool replay_journal_session(const struct replay_journal *journal, uint32_t *nonce, uint32_t *next_id) {
+  if (!journal->header->has_session) {
+    return false;
+  }
+  *nonce = journal->header->nonce;
+  *next_id = journal->header->next_id;
+  return true;
+}
+
+void replay_journal_reset(struct replay_journal *journal, uint32_t nonce) {
+  struct replay_journal_header *header = journal->header;
+  atomic_store(&header->head, 0);
+  atomic_store(&header->tail, 0);
+  header->nonce = nonce;
+  header->next_id = 0;
+  header->has_session = 1;
+}
+
+static void evict_oldest(struct replay_journal *journal) {
+  const uint64_t tail = atomic_load(&journal->header->tail);
+  uint64_t head = atomic_load(&journal->header->head);
+  const struct record *record = record_at(journal, &head, tail);
+  atomic_store(&journal->header->head, record ? head + record_bytes(record->size) : tail);
+}
+
+void replay_journal_append(struct replay_journal *journal, enum replay_journal_topic topic,
+    const void *payload, size_t size) {
+  struct replay_journal_header *header = journal->header;
+  struct record record = {.size = size, .count = 1, .topic = topic};
+  memcpy(&record.first_id, payload, sizeof(record.first_id));
+  if (topic == replay_journal_topic_display && size >= sizeof(struct sling_message_display_batch)) {
+    const struct sling_message_display_batch *batch = payload;
+    if (batch->message_type == sling_message_display_type_batch && batch->record_count) {
+      record.count = batch->record_count;
+    }
+  }
+  header->next_id = record.first_id + record.count;
+
+  const size_t bytes = record_bytes(size);
+  uint64_t tail = atomic_load(&header->tail);
+  if (bytes > journal->capacity) {
+    // cannot be kept, and neither can anything older once there is a gap
+    atomic_store(&header->head, tail);
+    return;
+  }
+
+  const size_t remaining = bytes_to_end(journal, tail);
+  size_t skipped = remaining < bytes ? remaining : 0;
+  uint64_t head;
+  while (tail + skipped + bytes - (head = atomic_load(&header->head)) > journal->capacity) {
+    if (head == tail) {
+      // empty, yet too big to fit after the skip: start at the beginning of the ring
+      tail += skipped;
+      skipped = 0;
+      atomic_store(&header->head, tail);
+      atomic_store(&header->tail, tail);
+      break;
+    }
+    evict_oldest(journal);
+  }
+
+  if (skipped) {
+    if (skipped >= sizeof(struct record)) {
+      const struct record skip = {.size = skipped - sizeof(struct record), .topic = RECORD_SKIP};
+      memcpy(journal->data + tail % journal->capacity, &skip, sizeof(skip));
+    }
+    tail += skipped;
+  }
+  unsigned char *out = journal->data + tail % journal->capacity;
+  memcpy(out, &record, sizeof(record));
+  memcpy(out + sizeof(record), payload, size);
+  atomic_store(&header->tail, tail + bytes);
+}
+
+uint32_t replay_journal_oldest(const struct replay_journal *journal) {
+  uint64_t head = atomic_load(&journal->header->head);
+  const struct record *record = record_at(journal, &head, atomic_load(&journal->header->tail));
+  return record ? record->first_id : journal->header->next_id;
+}
+
+size_t replay_journal_replay(const struct replay_journal *journal, uint32_t starting_id,
+    replay_journal_fn fn, void *ctx) {
+  const uint64_t tail = atomic_load(&journal->header->tail);
+  uint64_t offset = atomic_load(&journal->header->head);
+  size_t count = 0;
+  const struct record *record;
+  while ((record = record_at(journal, &offset, tail))) {
+    // message numbers wrap, so compare by distance
+    if ((int32_t) (record->first_id + record->count - starting_id) > 0) {
+      fn(ctx, record->topic, record + 1, record->size);
+      ++count;
+    }
+    offset += record_bytes(record->size);
+  }
+  return count;
+}
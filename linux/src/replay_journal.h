@@ -0,0 +1,66 @@
+#ifndef SLING_LINUX_REPLAY_JOURNAL_H
+#define SLING_LINUX_REPLAY_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The numbered messages a device published recently, so a client that missed
+// some can have them again without running the program again.
+//
+// Messages are kept in a ring in a memory-mapped file, oldest first, each with
+// the range of message numbers it covers; the oldest are overwritten to make
+// room. The file outlives the daemon, so after a restart the device carries on
+// numbering where it left off, under the same hello nonce, and clients can
+// still fetch what they missed.
+
+// Which of the device's topics a message was published on
+enum replay_journal_topic {
+  replay_journal_topic_hello,
+  replay_journal_topic_status,
+  replay_journal_topic_display,
+  replay_journal_topic_cache_miss,
+  replay_journal_topic_exit,
+  replay_journal_topic_count
+};
+
+// Smallest journal worth keeping: room for a few of the largest display messages
+#define REPLAY_JOURNAL_SIZE_MIN 0x10000
+
+struct replay_journal_header;
+
+struct replay_journal {
+  // NULL if not open
+  struct replay_journal_header *header;
+  unsigned char *data;
+  // Bytes of data; a multiple of 4
+  size_t capacity;
+};
+
+typedef void (*replay_journal_fn)(void *ctx, enum replay_journal_topic topic, const void *payload, size_t size);
+
+// Opens the journal at path, creating it if need be. What it holds is kept
+// only if it was written with the same capacity and capabilities. Returns
+// false, with errno set, on failure
+bool replay_journal_open(struct replay_journal *journal, const char *path, size_t capacity, uint32_t capabilities);
+
+// Whether the journal holds a session to carry on with, and if so its hello
+// nonce and next message number
+bool replay_journal_session(const struct replay_journal *journal, uint32_t *nonce, uint32_t *next_id);
+
+// Forgets every message, for a new session under the given hello nonce
+void replay_journal_reset(struct replay_journal *journal, uint32_t nonce);
+
+// Keeps a numbered message, whose message number is its first 4 bytes
+void replay_journal_append(struct replay_journal *journal, enum replay_journal_topic topic,
+  const void *payload, size_t size);
+
+// The oldest message number still kept; the next to be published if none is
+uint32_t replay_journal_oldest(const struct replay_journal *journal);
+
+// Calls fn with every message kept that covers starting_id or a later message
+// number, oldest first. Returns how many there were
+size_t replay_journal_replay(const struct replay_journal *journal, uint32_t starting_id,
+  replay_journal_fn fn, void *ctx);
+
+#endif
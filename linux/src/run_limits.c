@@ -0,0 +1,141 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "run_limits.h"
+
+#define CPU_PERIOD_US 100000UL
+
+static struct run_limits limits;
+static unsigned long next_cgroup_index = 1;
+
+static void cgroup_file_path(char *buf, size_t size, unsigned long cgroup_index, const char *file) {
+  snprintf(buf, size, "%s/sinter-%lu%s%s", limits.cgroup_path, cgroup_index, file ? "/" : "", file ? file : "");
+}
+
+static bool write_file(const char *path, const char *contents) {
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  const size_t length = strlen(contents);
+  bool ok = write(fd, contents, length) == (ssize_t) length;
+  close(fd);
+  return ok;
+}
+
+void run_limits_init(const struct run_limits *new_limits) {
+  limits = *new_limits;
+  if (!limits.cgroup_path) {
+    if (limits.cpu_percent) {
+      fprintf(stderr, "Warning: a CPU quota needs a cgroup; ignoring it\n");
+    }
+    return;
+  }
+
+  // the controllers must be enabled for our children; this fails if we live in the cgroup ourselves
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/cgroup.subtree_control", limits.cgroup_path);
+  if ((limits.cpu_percent && !write_file(path, "+cpu")) || (limits.memory_bytes && !write_file(path, "+memory"))) {
+    perror("Warning: could not enable cgroup controllers");
+  }
+}
+
+bool run_limits_use_cgroup(void) {
+  return limits.cgroup_path != NULL;
+}
+
+unsigned long run_limits_create_cgroup(void) {
+  if (!limits.cgroup_path) {
+    return 0;
+  }
+
+  const unsigned long cgroup_index = next_cgroup_index++;
+  char path[PATH_MAX];
+  cgroup_file_path(path, sizeof(path), cgroup_index, NULL);
+  if (mkdir(path, 0755) == -1) {
+    perror("cgroup mkdir");
+    return 0;
+  }
+
+  char value[64];
+  if (limits.cpu_percent) {
+    cgroup_file_path(path, sizeof(path), cgroup_index, "cpu.max");
+    snprintf(value, sizeof(value), "%lu %lu", limits.cpu_percent * CPU_PERIOD_US / 100, CPU_PERIOD_US);
+    if (!write_file(path, value)) {
+      perror("cgroup cpu.max");
+    }
+  }
+  if (limits.memory_bytes) {
+    cgroup_file_path(path, sizeof(path), cgroup_index, "memory.max");
+    snprintf(value, sizeof(value), "%lu", limits.memory_bytes);
+    if (!write_file(path, value)) {
+      perror("cgroup memory.max");
+    }
+    // don't let it swap its way past the limit
+    cgroup_file_path(path, sizeof(path), cgroup_index, "memory.swap.max");
+    write_file(path, "0");
+  }
+  return cgroup_index;
+}
+
+void run_limits_enter(unsigned long cgroup_index) {
+  if (cgroup_index) {
+    char path[PATH_MAX];
+    cgroup_file_path(path, sizeof(path), cgroup_index, "cgroup.procs");
+    write_file(path, "0");
+  }
+
+  if (limits.cpu_seconds) {
+    // SIGXCPU at the soft limit, SIGKILL a second later
+    struct rlimit rlim = {.rlim_cur = limits.cpu_seconds, .rlim_max = limits.cpu_seconds + 1};
+    setrlimit(RLIMIT_CPU, &rlim);
+  }
+  if (limits.memory_bytes && !cgroup_index) {
+    struct rlimit rlim = {.rlim_cur = limits.memory_bytes, .rlim_max = limits.memory_bytes};
+    setrlimit(RLIMIT_AS, &rlim);
+  }
+}
+
+bool run_limits_oom_killed(unsigned long cgroup_index) {
+  if (!cgroup_index) {
+    return false;
+  }
+
+  char path[PATH_MAX];
+  cgroup_file_path(path, sizeof(path), cgroup_index, "memory.events");
+  FILE *events = fopen(path, "r");
+  if (!events) {
+    return false;
+  }
+  char key[32];
+  unsigned long count;
+  bool killed = false;
+  while (fscanf(events, "%31s %lu", key, &count) == 2) {
+    if (!strcmp(key, "oom_kill") && count > 0) {
+      killed = true;
+    }
+  }
+  fclose(events);
+  return killed;
+}
+
+void run_limits_remove_cgroup(unsigned long cgroup_index) {
+  if (!cgroup_index) {
+    return;
+  }
+
+  char path[PATH_MAX];
+  cgroup_file_path(path, sizeof(path), cgroup_index, NULL);
+  if (rmdir(path) == -1) {
+    perror("cgroup rmdir");
+  }
+}
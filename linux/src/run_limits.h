@@ -0,0 +1,35 @@
+#ifndef SLING_LINUX_RUN_LIMITS_H
+#define SLING_LINUX_RUN_LIMITS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Resource limits applied to each Sinter host. Zero means unlimited.
+struct run_limits {
+  // cgroup v2 directory delegated to us; each host gets a child cgroup in it.
+  // Without one, limits are applied with setrlimit where possible
+  const char *cgroup_path;
+  // Percentage of one CPU, only enforceable with cgroups
+  unsigned long cpu_percent;
+  // Total CPU time
+  unsigned long cpu_seconds;
+  unsigned long memory_bytes;
+};
+
+void run_limits_init(const struct run_limits *limits);
+bool run_limits_use_cgroup(void);
+
+// In the daemon, before forking: creates the cgroup for a new host and
+// returns its index, or 0 if cgroups are not in use
+unsigned long run_limits_create_cgroup(void);
+
+// In the forked child, before exec: moves us into the host's cgroup and sets rlimits
+void run_limits_enter(unsigned long cgroup_index);
+
+// Whether the kernel killed a process in the cgroup for running out of memory
+bool run_limits_oom_killed(unsigned long cgroup_index);
+
+// Removes the cgroup of a host that has exited
+void run_limits_remove_cgroup(unsigned long cgroup_index);
+
+#endif
@@ -1,5 +1,4 @@
-#include <inttypes.h>
-#include <stdarg.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -7,14 +6,24 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <getopt.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <sinter.h>
 
+#include "../../common/sling_format.h"
 #include "../../common/sling_sinter.h"
 #include "common.h"
+#include "ipc_ring.h"
+#include "sinter_host.h"
 
 #ifdef SLING_SINTERHOST_CUSTOM
 #include SLING_SINTERHOST_CUSTOM
@@ -22,15 +31,35 @@
 
 static bool from_sling = false;
 
-static char sinter_heap[0x400000];
+static char *sinter_heap = NULL;
+static size_t sinter_heap_size = IPC_HEAP_SIZE_DEFAULT;
+static enum ipc_heap_mode heap_mode = ipc_heap_mode_lazy;
 
-static char display_buf[0x1000];
+#define HUGE_PAGE_SIZE 0x200000
+
+static char display_buf[IPC_DISPLAY_BUF_SIZE];
 static size_t display_buf_index = 0;
 static bool display_buf_fragmented = false;
+// While an array result is streamed through the printers, its fragments are of this display type
+static bool streaming_result = false;
+static enum sling_message_display_type streaming_result_type;
+
+// The last response to sinter_host_prompt
+static char input_buf[IPC_DISPLAY_BUF_SIZE];
 
 static unsigned char *program = NULL;
 static size_t program_size = 0;
 
+static struct ipc_ring ipc_ring;
+static bool use_ipc_ring = false;
+
+static unsigned long bench_iterations = 0;
+static uint64_t bench_output_bytes = 0;
+
+// the heap is filled with this before each benchmark iteration, so we can tell
+// afterwards how much of it was touched
+#define BENCH_HEAP_FILL 0xa5
+
 static const char *fault_names[] = {"no fault",
                                     "out of memory",
                                     "type error",
@@ -46,86 +75,136 @@ static const char *fault_names[] = {"no fault",
                                     "uninitialised heap"};
 
 void print_result(sinter_value_t *result);
+void display_object_result(sinter_value_t *result, bool is_error);
 
-static void send_ipc_message(sinter_value_t *value, enum sling_message_display_type type) {
-  size_t message_size = 0;
-  struct sling_message_display *result_message =
-      sling_sinter_value_to_message(value, &message_size);
-  if (!result_message) {
-    _Exit(child_exit_malloc_fail);
+static void send_ipc(const struct iovec *iov, int iovcnt) {
+  if (use_ipc_ring) {
+    if (!ipc_ring_writev(&ipc_ring, iov, iovcnt)) {
+      _Exit(child_exit_ipc_fail);
+    }
+    return;
   }
-  result_message->display_type = type;
 
-  ssize_t sendres = send(IPC_FD, result_message, message_size, 0);
+  struct msghdr msg = {.msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt};
+  ssize_t sendres = sendmsg(IPC_FD, &msg, 0);
   if (sendres == -1) {
     _Exit(child_exit_ipc_fail);
   }
-  free(result_message);
+}
+
+static void send_ipc_display(struct sling_message_display *header, const char *body,
+                             size_t body_size, enum sling_message_display_type type) {
+  // the string body goes out straight from where it is, without copying
+  header->display_type = type;
+  struct iovec iov[2] = {{.iov_base = header, .iov_len = sizeof(*header)},
+                         {.iov_base = (char *)body, .iov_len = body_size}};
+  send_ipc(iov, body_size ? 2 : 1);
+}
+
+static void send_ipc_message(sinter_value_t *value, enum sling_message_display_type type) {
+  struct sling_message_display header = {0};
+  const char *body = NULL;
+  size_t body_size = 0;
+  sling_sinter_value_to_header(value, &header, &body, &body_size);
+  send_ipc_display(&header, body, body_size, type);
+}
+
+static void send_display_buf(enum sling_message_display_type type) {
+  display_buf[display_buf_index] = '\0';
+  struct sling_message_display header = {0};
+  const char *body = NULL;
+  size_t body_size = 0;
+  sling_sinter_string_to_header(display_buf, display_buf_index, &header, &body, &body_size);
+  if (streaming_result) {
+    header.data_type = sinter_type_array;
+  }
+  send_ipc_display(&header, body, body_size, type);
+  display_buf_index = 0;
 }
 
 static inline enum sling_message_display_type print_type(bool is_error) {
+  if (streaming_result) {
+    return streaming_result_type;
+  }
   return is_error ? sling_message_display_type_error : sling_message_display_type_output;
 }
 
-__attribute__((format(printf, 2, 3))) static bool printf_buf(bool is_error, const char *format,
-                                                             ...) {
-  if (!from_sling) {
-    va_list args;
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
-    return true;
-  }
-
-  va_list args;
-  va_start(args, format);
-  const size_t can_write = sizeof(display_buf) - display_buf_index;
-  int written = vsnprintf(display_buf + display_buf_index, can_write, format, args);
-  va_end(args);
-  if (written >= 0 && (size_t)written < can_write) {
-    display_buf_index += written;
-  } else if ((size_t)written >= can_write) {
-    // send off this part first
-    display_buf_fragmented = true;
-    display_buf[display_buf_index] = '\0';
-    sinter_value_t value = {.type = sinter_type_string, .string_value = display_buf};
-    send_ipc_message(&value, print_type(is_error));
-
-    display_buf_index = 0;
-    if ((size_t)written < sizeof(display_buf)) {
-      // now repeat the printf, if it can fit in the buffer
-      va_start(args, format);
-      int written = vsnprintf(display_buf, sizeof(display_buf), format, args);
-      va_end(args);
-      display_buf_index += written;
-    } else {
-      // give up, just send the value as-is
-      return false;
+static void send_display_fragment(enum sling_message_display_type type) {
+  display_buf_fragmented = true;
+  send_display_buf(type);
+}
+
+// Returns where to write up to size - 1 characters and a null terminator, sending what is
+// in display_buf first if they might not fit
+static char *reserve_display_buf(size_t size, enum sling_message_display_type type) {
+  if (sizeof(display_buf) - display_buf_index < size) {
+    send_display_fragment(type);
+  }
+  return display_buf + display_buf_index;
+}
+
+static void display_string(const char *str, enum sling_message_display_type type) {
+  // split long strings into fragments, so that no IPC message exceeds IPC_MESSAGE_MAX
+  size_t length = strlen(str);
+  while (true) {
+    const size_t can_write = sizeof(display_buf) - 1 - display_buf_index;
+    const size_t this_write = length < can_write ? length : can_write;
+    memcpy(display_buf + display_buf_index, str, this_write);
+    display_buf_index += this_write;
+    if (this_write == length) {
+      return;
     }
+    str += this_write;
+    length -= this_write;
+    send_display_fragment(type);
   }
+}
 
-  return true;
+static void flush_display(enum sling_message_display_type type) {
+  if (display_buf_fragmented) {
+    if (display_buf_index > 0) {
+      send_display_fragment(type);
+    }
+    struct sling_message_display_flush flush_message = {.message_type =
+                                                            sling_message_display_type_flush};
+    struct iovec iov = {.iov_base = &flush_message, .iov_len = sizeof(flush_message)};
+    send_ipc(&iov, 1);
+    display_buf_fragmented = false;
+    return;
+  }
+
+  send_display_buf(type | sling_message_display_type_self_flushing);
 }
 
 static void print_string(const char *str, bool is_error) {
-  if (!printf_buf(is_error, "%s", str)) {
-    sinter_value_t value = {.type = sinter_type_string, .string_value = str};
-    send_ipc_message(&value, print_type(is_error));
+  if (!from_sling) {
+    fputs(str, stdout);
+    return;
   }
+  display_string(str, print_type(is_error));
 }
 
+// Numbers are formatted once, straight into display_buf
 static void print_integer(int32_t intv, bool is_error) {
-  if (!printf_buf(is_error, "%" PRId32, intv)) {
-    sinter_value_t value = {.type = sinter_type_integer, .integer_value = intv};
-    send_ipc_message(&value, print_type(is_error));
+  if (!from_sling) {
+    char buf[SLING_FORMAT_NUMBER_MAX];
+    sling_format_int32(intv, buf);
+    fputs(buf, stdout);
+    return;
   }
+  char *out = reserve_display_buf(SLING_FORMAT_NUMBER_MAX, print_type(is_error));
+  display_buf_index += sling_format_int32(intv, out);
 }
 
 static void print_float(float floatv, bool is_error) {
-  if (!printf_buf(is_error, "%f", floatv)) {
-    sinter_value_t value = {.type = sinter_type_float, .float_value = floatv};
-    send_ipc_message(&value, print_type(is_error));
+  if (!from_sling) {
+    char buf[SLING_FORMAT_NUMBER_MAX];
+    sling_format_float(floatv, buf);
+    fputs(buf, stdout);
+    return;
   }
+  char *out = reserve_display_buf(SLING_FORMAT_NUMBER_MAX, print_type(is_error));
+  display_buf_index += sling_format_float(floatv, out);
 }
 
 static void print_flush(bool is_error) {
@@ -134,52 +213,173 @@ static void print_flush(bool is_error) {
     return;
   }
 
-  if (display_buf_fragmented) {
-    struct sling_message_display_flush flush_message = {.message_type =
-                                                            sling_message_display_type_flush};
-    ssize_t sendres = send(IPC_FD, &flush_message, sizeof(flush_message), 0);
-    if (sendres == -1) {
-      _Exit(child_exit_ipc_fail);
+  flush_display(print_type(is_error));
+}
+
+const char *sinter_host_prompt(const char *prompt) {
+  if (!from_sling) {
+    fputs(prompt, stdout);
+    fflush(stdout);
+    if (!fgets(input_buf, sizeof(input_buf), stdin)) {
+      return NULL;
     }
-    display_buf_fragmented = false;
-    display_buf_index = 0;
+    input_buf[strcspn(input_buf, "\n")] = '\0';
+    return input_buf;
+  }
+
+  if (display_buf_index > 0 || display_buf_fragmented) {
+    // the client should see everything printed before the prompt
+    flush_display(sling_message_display_type_output);
+  }
+  size_t length = strlen(prompt);
+  if (length > sizeof(display_buf) - 1) {
+    length = sizeof(display_buf) - 1;
+  }
+  struct sling_message_display header = {0};
+  const char *body = NULL;
+  size_t body_size = 0;
+  sling_sinter_string_to_header(prompt, length, &header, &body, &body_size);
+  send_ipc_display(&header, body, body_size, sling_message_display_type_prompt);
+
+  // the daemon answers on the same socket, even when output goes through the ring; block
+  // until it does, rather than poll. A response always has its null terminator, so 0 is EOF
+  ssize_t received;
+  do {
+    received = recv(IPC_FD, input_buf, sizeof(input_buf), 0);
+  } while (received == -1 && errno == EINTR);
+  if (received <= 0) {
+    return NULL;
+  }
+  input_buf[received - 1] = '\0';
+  return input_buf;
+}
+
+static void send_result(sinter_value_t *value, enum sling_message_display_type type) {
+  if (value->type == sinter_type_array) {
+    if (display_buf_index > 0 || display_buf_fragmented) {
+      // don't let the result run on from output that was never flushed
+      flush_display(sling_message_display_type_output);
+    }
+    // the VM renders the array through the printers, which send it on in display_buf-sized
+    // fragments as it goes, so it never has to be in memory all at once
+    streaming_result = true;
+    streaming_result_type = type;
+    display_object_result(value, type == sling_message_display_type_error);
+    flush_display(type);
+    streaming_result = false;
+    return;
+  }
+  if (value->type == sinter_type_string && strlen(value->string_value) >= sizeof(display_buf)) {
+    display_string(value->string_value, type);
+    flush_display(type);
     return;
   }
+  send_ipc_message(value, type | sling_message_display_type_self_flushing);
+}
 
-  sinter_value_t value = {.type = sinter_type_string, .string_value = display_buf};
-  send_ipc_message(&value, print_type(is_error) | sling_message_display_type_self_flushing);
-  display_buf_index = 0;
+// Returns false if the heap cannot be mapped, e.g. under an address space limit
+static bool map_heap(void) {
+  // reserve the whole heap, but let the kernel commit pages only as they are touched
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  if (heap_mode == ipc_heap_mode_prefault) {
+    flags |= MAP_POPULATE;
+  }
+  // huge pages need the heap aligned to them, so map extra and trim it
+  const size_t align = heap_mode == ipc_heap_mode_hugepage ? HUGE_PAGE_SIZE : 0;
+  char *heap = mmap(NULL, sinter_heap_size + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (heap == MAP_FAILED) {
+    return false;
+  }
+  if (align) {
+    char *aligned = (char *)(((uintptr_t)heap + align - 1) & ~(uintptr_t)(align - 1));
+    if (aligned != heap) {
+      munmap(heap, aligned - heap);
+    }
+    munmap(aligned + sinter_heap_size, heap + align - aligned);
+    heap = aligned;
+    // only a hint; without transparent huge pages we just get normal ones
+    madvise(heap, sinter_heap_size, MADV_HUGEPAGE);
+  }
+  sinter_heap = heap;
+  sinter_setup_heap(sinter_heap, sinter_heap_size);
+  return true;
+}
+
+static bool parse_heap_mode(const char *name) {
+  if (!strcmp(name, "lazy")) {
+    heap_mode = ipc_heap_mode_lazy;
+  } else if (!strcmp(name, "prefault")) {
+    heap_mode = ipc_heap_mode_prefault;
+  } else if (!strcmp(name, "hugepage")) {
+    heap_mode = ipc_heap_mode_hugepage;
+  } else {
+    return false;
+  }
+  return true;
 }
 
-void read_program(const char *filename) {
-  FILE *input_file = fopen(filename, "rb");
-  if (!input_file) {
+static void map_program(int fd, size_t size) {
+  if (size == 0) {
     _Exit(child_exit_program_read_fail);
   }
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    _Exit(child_exit_program_read_fail);
+  }
+  close(fd);
+  program = mapping;
+  program_size = size;
+}
 
-  size_t alloc_size = 0x1000, read_size = 0;
-  program = malloc(alloc_size);
-  if (!program) {
-    _Exit(child_exit_malloc_fail);
+static void receive_program(void) {
+  // block until the daemon hands us a program
+  struct ipc_run_request request;
+  struct iovec iov = {.iov_base = &request, .iov_len = sizeof(request)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * IPC_RUN_REQUEST_MAX_FDS)];
+  } control;
+  struct msghdr msg = {
+      .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+
+  ssize_t recvres = recvmsg(IPC_FD, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (recvres != sizeof(request) || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    _Exit(child_exit_ipc_fail);
   }
 
-  while (true) {
-    if (read_size + 0x100 >= alloc_size) {
-      alloc_size += 0x1000;
-      program = realloc(program, alloc_size);
-    }
+  int fds[IPC_RUN_REQUEST_MAX_FDS];
+  const size_t fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  if (fd_count != (request.ring_size ? 4 : 1)) {
+    _Exit(child_exit_ipc_fail);
+  }
+  memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
 
-    size_t this_read = fread(program + read_size, 1, alloc_size - read_size, input_file);
-    if (this_read > 0) {
-      read_size += this_read;
-    } else if (feof(input_file)) {
-      program_size = read_size;
-      program = realloc(program, program_size);
-      return;
-    } else {
-      _Exit(child_exit_program_read_fail);
+  if (request.heap_size < IPC_HEAP_SIZE_MIN || request.heap_size > IPC_HEAP_SIZE_MAX) {
+    _Exit(child_exit_ipc_fail);
+  }
+  sinter_heap_size = request.heap_size;
+  heap_mode = request.heap_mode;
+
+  if (request.ring_size) {
+    if (!ipc_ring_map(&ipc_ring, fds[1], request.ring_size)) {
+      _Exit(child_exit_ipc_fail);
     }
+    ipc_ring.data_efd = fds[2];
+    ipc_ring.space_efd = fds[3];
+    use_ipc_ring = true;
+  }
+  map_program(fds[0], request.program_size);
+}
+
+static void read_program(const char *filename) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    _Exit(child_exit_program_read_fail);
   }
+  map_program(fd, st.st_size);
 }
 
 static void on_term_signal(int signal) {
@@ -197,28 +397,164 @@ static void catch_term_signal(void) {
   sigaction(SIGINT, &act, NULL);
 }
 
+static ssize_t count_output(void *cookie, const char *buf, size_t size) {
+  (void) cookie;
+  (void) buf;
+  bench_output_bytes += size;
+  return size;
+}
+
+static double elapsed_s(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static size_t heap_touched(void) {
+  size_t touched = 0;
+  for (size_t i = 0; i < sinter_heap_size; ++i) {
+    touched += (unsigned char) sinter_heap[i] != BENCH_HEAP_FILL;
+  }
+  return touched;
+}
+
+static void run_bench(const char *filename) {
+  // count the output instead of printing it; the report goes to the real stdout
+  FILE *report = stdout;
+  stdout = fopencookie(NULL, "w", (cookie_io_functions_t){.write = count_output});
+  if (!stdout) {
+    _Exit(child_exit_malloc_fail);
+  }
+  setvbuf(stdout, NULL, _IOFBF, 0x10000);
+
+  read_program(filename);
+  if (!map_heap()) {
+    _Exit(child_exit_malloc_fail);
+  }
+
+  sinter_fault_t fault = sinter_fault_none;
+  double total_s = 0, min_s = 0, max_s = 0;
+  size_t peak_heap = 0;
+  for (unsigned long i = 0; i < bench_iterations; ++i) {
+    memset(sinter_heap, BENCH_HEAP_FILL, sinter_heap_size);
+    sinter_setup_heap(sinter_heap, sinter_heap_size);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sinter_value_t value = {0};
+    sinter_fault_t result = sinter_run(program, program_size, &value);
+    if (result != sinter_fault_none) {
+      fault = result;
+      fputs(fault_names[result], stdout);
+    } else {
+      print_result(&value);
+    }
+    putchar('\n');
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    const double s = elapsed_s(&start, &end);
+    total_s += s;
+    min_s = i == 0 || s < min_s ? s : min_s;
+    max_s = s > max_s ? s : max_s;
+    const size_t heap = heap_touched();
+    peak_heap = heap > peak_heap ? heap : peak_heap;
+  }
+
+  const char *name = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+  fprintf(report,
+          "{\"program\":\"%s\",\"iterations\":%lu,\"fault\":\"%s\",\"mean_us\":%.1f,\"min_us\":%.1f,"
+          "\"max_us\":%.1f,\"iterations_per_second\":%.1f,\"program_bytes\":%zu,"
+          "\"output_bytes_per_iteration\":%.1f,\"output_bytes_per_second\":%.1f,\"peak_heap_bytes\":%zu}\n",
+          name, bench_iterations, fault_names[fault], total_s / bench_iterations * 1e6, min_s * 1e6,
+          max_s * 1e6, bench_iterations / total_s, program_size,
+          (double) bench_output_bytes / bench_iterations, bench_output_bytes / total_s, peak_heap);
+}
+
 void setup_linux_rand(void);
+void setup_linux_prompt(void);
 
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    return child_exit_unknown_error;
+  while (1) {
+    static struct option long_options[] = {
+      {"from-sling", no_argument,       0, 's' },
+      {"bench",      required_argument, 0, 'b' },
+      {"heap-size",  required_argument, 0, 'e' },
+      {"heap-mode",  required_argument, 0, 'j' },
+      {0,            0,                 0, 0   }
+    };
+
+    int c = getopt_long(argc, argv, "", long_options, NULL);
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 's':
+      // the daemon sends us the program over IPC_FD once it has one to run
+      from_sling = true;
+      break;
+    case 'b':
+      // run the program this many times in-process, and report how long it took
+      bench_iterations = strtoul(optarg, NULL, 0);
+      if (bench_iterations == 0) {
+        return child_exit_unknown_error;
+      }
+      break;
+    case 'e':
+      // from Sling, the run request says how big the heap is instead
+      sinter_heap_size = strtoul(optarg, NULL, 0);
+      if (sinter_heap_size < IPC_HEAP_SIZE_MIN || sinter_heap_size > IPC_HEAP_SIZE_MAX) {
+        return child_exit_unknown_error;
+      }
+      break;
+    case 'j':
+      if (!parse_heap_mode(optarg)) {
+        return child_exit_unknown_error;
+      }
+      break;
+    default:
+      return child_exit_unknown_error;
+    }
   }
 
-  from_sling = argc >= 3 && !strcmp("--from-sling", argv[1]);
+  if (!from_sling && optind >= argc) {
+    return child_exit_unknown_error;
+  }
 
   setup_linux_rand();
+  setup_linux_prompt();
 
   catch_term_signal();
 
-  read_program(from_sling ? argv[2] : argv[1]);
-
-  sinter_setup_heap(sinter_heap, sizeof(sinter_heap));
-
   sinter_printer_string = print_string;
   sinter_printer_integer = print_integer;
   sinter_printer_float = print_float;
   sinter_printer_flush = print_flush;
 
+  if (bench_iterations) {
+    if (from_sling) {
+      return child_exit_unknown_error;
+    }
+    run_bench(argv[optind]);
+    return 0;
+  }
+
+  if (from_sling) {
+    // set up the daemon's default heap while we wait, as most runs take it; a warm host
+    // then has it ready. If it cannot be mapped, the run may yet ask for a smaller one
+    const size_t mapped_size = map_heap() ? sinter_heap_size : 0;
+    const enum ipc_heap_mode mapped_mode = heap_mode;
+    receive_program();
+    if (mapped_size && (sinter_heap_size != mapped_size || heap_mode != mapped_mode)) {
+      munmap(sinter_heap, mapped_size);
+      sinter_heap = NULL;
+    }
+  } else {
+    read_program(argv[optind]);
+  }
+  if (!sinter_heap && !map_heap()) {
+    _Exit(child_exit_malloc_fail);
+  }
+
 #ifdef SLING_SINTERHOST_PRERUN
 #include SLING_SINTERHOST_PRERUN
 #endif
@@ -232,9 +568,8 @@ int main(int argc, char *argv[]) {
   }
 
   if (from_sling) {
-    send_ipc_message(&value, (result == sinter_fault_none ? sling_message_display_type_result
-                                                          : sling_message_display_type_error) |
-                                 sling_message_display_type_self_flushing);
+    send_result(&value, result == sinter_fault_none ? sling_message_display_type_result
+                                                    : sling_message_display_type_error);
   } else {
     print_result(&value);
     printf("\n");
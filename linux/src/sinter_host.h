@@ -0,0 +1,12 @@
+#ifndef SLING_LINUX_SINTER_HOST_H
+#define SLING_LINUX_SINTER_HOST_H
+
+// For custom primitives (see SLING_SINTERHOST_CUSTOM_SOURCES) that want to
+// call back into sinter_host.
+
+// Asks for a line of input, blocking until it arrives: from the client when
+// run by Sling, otherwise from stdin. Source's prompt() calls this. Returns NULL if there will be none. The
+// string stays valid until the next call.
+const char *sinter_host_prompt(const char *prompt);
+
+#endif
@@ -1,15 +1,162 @@
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <sinter.h>
 #include <sinter/display.h>
+#include <sinter/heap.h>
 #include <sinter/heap_obj.h>
+#include <sinter/nanbox.h>
 #include <sinter/program.h>
 #include <sinter/vm.h>
 
-static void display_object_result(sinter_value_t *res, _Bool is_error) {
-  if (res->type == sinter_type_array || res->type == sinter_type_function) {
-    sinanbox_t arr = NANBOX_WITH_I32(res->object_value);
-    sidisplay_nanbox(arr, is_error);
+#include "../../common/sling_format.h"
+
+// Arrays (and so lists, whose pairs are arrays of two) are walked here rather
+// than by sidisplay_nanbox, which recurses once per nesting level: a list nests
+// each tail in the pair before it, so a long one would overflow the stack. The
+// arrays still open are kept on a stack of our own, in memory that grows with
+// the nesting. Everything else is printed by sidisplay_nanbox. All of it goes
+// through the printers, so it is sent on in fragments as it is walked.
+
+// An array being displayed, and the index of its next element
+struct display_frame {
+  siheap_array_t *array;
+  size_t index;
+};
+
+static struct display_frame *frames = NULL;
+static size_t frame_count = 0;
+static size_t frame_capacity = 0;
+
+// The arrays in frames, by address, to tell when one holds itself; a power of 2
+// in size, at most half full, with NULL for unused slots
+static siheap_array_t **open_arrays = NULL;
+static size_t open_capacity = 0;
+
+static size_t open_slot(const siheap_array_t *array) {
+  return (size_t)(((uintptr_t)array >> 3) * 0x9e3779b97f4a7c15u) & (open_capacity - 1);
+}
+
+static size_t open_find(const siheap_array_t *array) {
+  size_t slot = open_slot(array);
+  while (open_arrays[slot] && open_arrays[slot] != array) {
+    slot = (slot + 1) & (open_capacity - 1);
+  }
+  return slot;
+}
+
+static bool open_grow(void) {
+  const size_t capacity = open_capacity ? open_capacity * 2 : 64;
+  siheap_array_t **arrays = calloc(capacity, sizeof(*arrays));
+  if (!arrays) {
+    return false;
+  }
+  free(open_arrays);
+  open_arrays = arrays;
+  open_capacity = capacity;
+  for (size_t i = 0; i < frame_count; ++i) {
+    open_arrays[open_find(frames[i].array)] = frames[i].array;
+  }
+  return true;
+}
+
+static void open_remove(const siheap_array_t *array) {
+  size_t hole = open_find(array);
+  open_arrays[hole] = NULL;
+  // move back any later entry of the run that could no longer be found past the hole
+  for (size_t slot = (hole + 1) & (open_capacity - 1); open_arrays[slot];
+       slot = (slot + 1) & (open_capacity - 1)) {
+    const size_t home = open_slot(open_arrays[slot]);
+    if (((slot - home) & (open_capacity - 1)) >= ((slot - hole) & (open_capacity - 1))) {
+      open_arrays[hole] = open_arrays[slot];
+      open_arrays[slot] = NULL;
+      hole = slot;
+    }
+  }
+}
+
+// Returns false if there is no memory for another level
+static bool push_array(siheap_array_t *array) {
+  if (frame_count == frame_capacity) {
+    const size_t capacity = frame_capacity ? frame_capacity * 2 : 64;
+    struct display_frame *grown = realloc(frames, capacity * sizeof(*frames));
+    if (!grown) {
+      return false;
+    }
+    frames = grown;
+    frame_capacity = capacity;
+  }
+  if ((frame_count + 1) * 2 > open_capacity && !open_grow()) {
+    return false;
+  }
+  frames[frame_count++] = (struct display_frame){.array = array, .index = 0};
+  open_arrays[open_find(array)] = array;
+  return true;
+}
+
+static siheap_array_t *as_array(sinanbox_t value) {
+  if (!NANBOX_ISPTR(value)) {
+    return NULL;
+  }
+  siheap_header_t *obj = SIHEAP_NANBOXTOPTR(value);
+  return obj->type == sitype_array ? (siheap_array_t *)obj : NULL;
+}
+
+// Opens array, or stands in for it if it cannot be walked into
+static void enter_array(siheap_array_t *array, bool is_error) {
+  if (open_arrays && open_arrays[open_find(array)]) {
+    // e.g. a list whose tail was set back to an earlier pair
+    sinter_printer_string("...<circular>", is_error);
+  } else if (!push_array(array)) {
+    sinter_printer_string("...", is_error);
+  } else {
+    sinter_printer_string("[", is_error);
+  }
+}
+
+static void display_array(siheap_array_t *root, bool is_error) {
+  enter_array(root, is_error);
+  while (frame_count) {
+    struct display_frame *frame = &frames[frame_count - 1];
+    if (frame->index == frame->array->count) {
+      sinter_printer_string("]", is_error);
+      open_remove(frame->array);
+      --frame_count;
+      continue;
+    }
+    if (frame->index) {
+      sinter_printer_string(", ", is_error);
+    }
+    const sinanbox_t element = siarray_get(frame->array, frame->index++);
+    siheap_array_t *array = as_array(element);
+    if (array) {
+      enter_array(array, is_error);
+    } else {
+      sidisplay_nanbox(element, is_error);
+    }
+  }
+
+  // a long list's worth is not kept for the rest of the run
+  free(frames);
+  free(open_arrays);
+  frames = NULL;
+  open_arrays = NULL;
+  frame_capacity = open_capacity = 0;
+}
+
+// Renders arrays and functions through the sinter printers, which may stream
+void display_object_result(sinter_value_t *res, _Bool is_error) {
+  if (res->type != sinter_type_array && res->type != sinter_type_function) {
+    return;
+  }
+  const sinanbox_t value = NANBOX_WITH_I32(res->object_value);
+  siheap_array_t *array = as_array(value);
+  if (array) {
+    display_array(array, is_error);
+  } else {
+    sidisplay_nanbox(value, is_error);
   }
 }
 
@@ -27,9 +174,12 @@ void print_result(sinter_value_t *result) {
   case sinter_type_integer:
     printf("%d", result->integer_value);
     break;
-  case sinter_type_float:
-    printf("%f", result->float_value);
+  case sinter_type_float: {
+    char buf[SLING_FORMAT_NUMBER_MAX];
+    sling_format_float(result->float_value, buf);
+    fputs(buf, stdout);
     break;
+  }
   case sinter_type_string:
     printf("%s", result->string_value);
     break;
@@ -0,0 +1,91 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sinter.h>
+#include <sinter/display.h>
+#include <sinter/heap.h>
+#include <sinter/heap_obj.h>
+#include <sinter/internal_fn.h>
+#include <sinter/nanbox.h>
+
+#include "../../common/sling_format.h"
+#include "common.h"
+#include "sinter_host.h"
+
+// Where prompt sits in the SVML primitive table; override to match other Sinter builds
+#ifndef SLING_SINTERHOST_PROMPT_PRIMITIVE
+#define SLING_SINTERHOST_PROMPT_PRIMITIVE 0x5b
+#endif
+
+// The prompt string, as the program's argument renders through sidisplay_nanbox
+static char prompt_buf[IPC_DISPLAY_BUF_SIZE];
+static size_t prompt_buf_index;
+
+static void prompt_append(const char *str, size_t length) {
+  const size_t can_write = sizeof(prompt_buf) - 1 - prompt_buf_index;
+  if (length > can_write) {
+    length = can_write;
+  }
+  memcpy(prompt_buf + prompt_buf_index, str, length);
+  prompt_buf_index += length;
+}
+
+static void prompt_string(const char *str, bool is_error) {
+  (void)is_error;
+  prompt_append(str, strlen(str));
+}
+
+static void prompt_integer(int32_t intv, bool is_error) {
+  (void)is_error;
+  char buf[SLING_FORMAT_NUMBER_MAX];
+  prompt_append(buf, sling_format_int32(intv, buf));
+}
+
+static void prompt_float(float floatv, bool is_error) {
+  (void)is_error;
+  char buf[SLING_FORMAT_NUMBER_MAX];
+  prompt_append(buf, sling_format_float(floatv, buf));
+}
+
+static void prompt_flush(bool is_error) {
+  (void)is_error;
+}
+
+// prompt(message): shows message and returns the line typed in response, or
+// null if there will be none
+static sinanbox_t linux_prompt(uint8_t argc, sinanbox_t *argv) {
+  // the VM renders strings of every kind, as well as anything else passed in, so
+  // borrow the printers to turn the argument into a C string
+  void (*const saved_string)(const char *, bool) = sinter_printer_string;
+  void (*const saved_integer)(int32_t, bool) = sinter_printer_integer;
+  void (*const saved_float)(float, bool) = sinter_printer_float;
+  void (*const saved_flush)(bool) = sinter_printer_flush;
+  sinter_printer_string = prompt_string;
+  sinter_printer_integer = prompt_integer;
+  sinter_printer_float = prompt_float;
+  sinter_printer_flush = prompt_flush;
+  prompt_buf_index = 0;
+  if (argc > 0) {
+    sidisplay_nanbox(argv[0], false);
+  }
+  prompt_buf[prompt_buf_index] = '\0';
+  sinter_printer_string = saved_string;
+  sinter_printer_integer = saved_integer;
+  sinter_printer_float = saved_float;
+  sinter_printer_flush = saved_flush;
+
+  const char *response = sinter_host_prompt(prompt_buf);
+  if (!response) {
+    return NANBOX_OFNULL();
+  }
+  const size_t length = strlen(response);
+  siheap_string_t *str = (siheap_string_t *)siheap_malloc(sizeof(siheap_string_t) + length + 1, sitype_string);
+  memcpy(str->string, response, length + 1);
+  return SIHEAP_PTRTONANBOX(str);
+}
+
+void setup_linux_prompt(void) {
+  sivmfn_primitives[SLING_SINTERHOST_PROMPT_PRIMITIVE] = linux_prompt;
+}